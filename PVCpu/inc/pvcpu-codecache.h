@@ -0,0 +1,46 @@
+// Author: Pheonix Studios/AkshuDev
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PVCPU_CC_RESERVE (1ull << 30) // 1 GiB of address space, keeps every block within rel32 reach
+#define PVCPU_CC_SLAB_PAGES 16 // Pages committed at a time
+#define PVCPU_CC_ALIGN 16
+
+// Executable code cache
+// The region is reserved once and committed in slabs. When dual mapping is available
+// the same memory is mapped twice: `rw` is only ever written, `rx` is only ever executed,
+// so no protection changes are needed at all. Otherwise `rw == rx` and the committed
+// range is flipped between RW and RX once per published batch.
+typedef struct {
+    uint8_t* rw; // Writable alias
+    uint8_t* rx; // Executable alias
+    size_t reserved;
+    size_t committed;
+    size_t used;
+    size_t published;
+    size_t slab;
+    int fd; // memfd backing both aliases, -1 when single mapped
+    bool sealed; // Single mapped only: committed range is currently RX
+} Code_Cache;
+
+bool cc_init(Code_Cache* cc, size_t reserve);
+void cc_destroy(Code_Cache* cc);
+
+// Returns the executable address of `size` fresh bytes, NULL when the cache is exhausted
+uint8_t* cc_alloc(Code_Cache* cc, size_t size);
+// Makes the cache writable again for patching already published code (no-op when dual mapped),
+// false when the protection could not be changed and nothing may be written
+bool cc_begin_write(Code_Cache* cc);
+// Makes everything allocated since the last publish executable, false when the protection could not be changed
+bool cc_publish(Code_Cache* cc);
+
+static inline uint8_t* cc_rw(const Code_Cache* cc, const uint8_t* rx) {
+    return cc->rw + (rx - cc->rx);
+}
+
+static inline uint8_t* cc_rx(const Code_Cache* cc, const uint8_t* rw) {
+    return cc->rx + (rw - cc->rw);
+}
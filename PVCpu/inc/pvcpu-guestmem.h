@@ -0,0 +1,78 @@
+// Author: Pheonix Studios/AkshuDev
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Guarded guest memory needs the faulting host instruction back, so only where the signal context is known
+#if defined(__linux__) && defined(__x86_64__)
+#define PVCPU_GUARD_PAGES 1
+#endif
+
+#define PVCPU_GUARD_MIN_SHIFT 32 // Smallest span translated code maps guest addresses into, see Guest_Mem
+#define PVCPU_CODE_WRITES_MAX 4 // Writes after which a code page stays writable, see Code_Page
+
+// Translated instruction that may fault, an access on the guard zone or a divide by zero, and the code
+// raising the guest exception for it. Its pad writes back the guest state as of that instruction.
+typedef struct {
+    const uint8_t* site;
+    const uint8_t* pad;
+} Guard_Site;
+
+// Host page holding guest code. Pages blocks were decoded from are write protected, the first write
+// faults and the fault handler makes the page writable again and marks it written, the runtime then
+// drops the blocks decoded from it. Pages written PVCPU_CODE_WRITES_MAX times are never protected again.
+typedef struct {
+    bool protected;
+    bool written; // Since the runtime last looked, see gm_next_written()
+    uint8_t writes;
+} Code_Page;
+
+// Guest memory
+// The whole guest address space is reserved up front and the host commits pages as the
+// guest first touches them, so a large sparse guest only costs the pages it uses.
+// When guarded, the memory is placed at the end of the reservation so that everything from
+// memory + memsize to memory + (1 << span_shift) + 8 is inaccessible. Translated code then
+// accesses guest memory with a single host mov: an address outside guest memory faults on the
+// guard zone and the fault handler resumes at the pad of that access instead.
+typedef struct {
+    uint8_t* memory; // Guest address 0
+    size_t memsize;
+    bool guarded;
+    uint8_t span_shift; // Guarded only: smallest power of two span covering memsize, at least PVCPU_GUARD_MIN_SHIFT
+
+    uint8_t* base; // Start of the reservation
+    size_t reserved;
+    Guard_Site* sites; // Ascending by site, translated code is only ever appended
+    size_t site_count;
+    size_t site_cap;
+
+    size_t page_size;
+    uint8_t* code_base; // Host page holding guest address 0
+    Code_Page* code_pages; // Guarded only: pages of the code section, NULL when code is not watched
+    size_t code_page_count;
+    volatile bool written; // A code page was written since the last gm_next_written()
+    volatile bool retried; // The write came from translated code, which left through the pad of the store
+} Guest_Mem;
+
+// Zeroed guest memory, guarded when the platform allows
+bool gm_init(Guest_Mem* gm, size_t memsize);
+void gm_destroy(Guest_Mem* gm);
+bool gm_add_site(Guest_Mem* gm, const uint8_t* site, const uint8_t* pad);
+
+// Watches for writes to the first `code_size` bytes, false on allocation failure. Only guarded memory
+// is watched, elsewhere guest code is assumed to stay as loaded.
+bool gm_watch_code(Guest_Mem* gm, size_t code_size);
+// Write protects the code pages holding guest [start, end), except those written too often
+void gm_protect_code(Guest_Mem* gm, uint64_t start, uint64_t end);
+// Most writes to any code page holding guest [start, end)
+uint8_t gm_code_writes(const Guest_Mem* gm, uint64_t start, uint64_t end);
+// Takes the next page written since the last call, its guest addresses in [start, end). False when there is none.
+bool gm_next_written(Guest_Mem* gm, uint64_t* start, uint64_t* end);
+
+// Guard zone faults (SIGSEGV, SIGBUS) and divide errors (SIGFPE) inside translated code are turned into
+// jumps to their pad until gm_release_faults(). Writes to protected code pages make them writable again,
+// from translated code they jump to the pad of the store as well. Anything else goes to the previous handler.
+void gm_catch_faults(Guest_Mem* gm);
+void gm_release_faults();
@@ -1,11 +1,140 @@
 // Author: Pheonix Studios/AkshuDev
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <pvcpu-jit.h>
 
-void emit_u8(Jit_Buf* buf, uint8_t v);
-void emit_u16(Jit_Buf* buf, uint16_t v);
-void emit_u32(Jit_Buf* buf, uint32_t v);
-void emit_u64(Jit_Buf* buf, uint64_t v);
+// Unchecked, space must have been reserved with jit_reserve()
+static inline void emit_u8(Jit_Buf* buf, uint8_t v) {
+    buf->data[buf->size++] = v;
+}
+
+static inline void emit_u16(Jit_Buf* buf, uint16_t v) {
+    memcpy(buf->data + buf->size, &v, 2);
+    buf->size += 2;
+}
+
+static inline void emit_u32(Jit_Buf* buf, uint32_t v) {
+    memcpy(buf->data + buf->size, &v, 4);
+    buf->size += 4;
+}
+
+static inline void emit_u64(Jit_Buf* buf, uint64_t v) {
+    memcpy(buf->data + buf->size, &v, 8);
+    buf->size += 8;
+}
+
+// x86-64 host registers, numbered as encoded in ModRM/REX
+typedef enum {
+    HOST_RAX = 0,
+    HOST_RCX,
+    HOST_RDX,
+    HOST_RBX,
+    HOST_RSP,
+    HOST_RBP,
+    HOST_RSI,
+    HOST_RDI,
+    HOST_R8,
+    HOST_R9,
+    HOST_R10,
+    HOST_R11,
+    HOST_R12,
+    HOST_R13,
+    HOST_R14,
+    HOST_R15
+} Host_Reg;
+
+// Instructions of the encoder table, all operate on 64 bits unless a size is given
+typedef enum {
+    X86_ADD,
+    X86_OR,
+    X86_AND,
+    X86_SUB,
+    X86_XOR,
+    X86_CMP,
+    X86_MOV,
+    X86_TEST,
+    X86_LEA, // Register destination only
+    X86_OP_COUNT
+} X86_Op;
+
+// Shifts and rotates, numbered as ModRM.reg of their group 2 encodings
+typedef enum {
+    X86_ROL = 0,
+    X86_ROR = 1,
+    X86_SHL = 4,
+    X86_SHR = 5,
+    X86_SAR = 7
+} X86_Shift;
+
+// Memory operand [base + index << scale + disp], index is -1 when there is none and must not be rsp
+typedef struct {
+    int8_t base;
+    int8_t index;
+    uint8_t scale;
+    int32_t disp;
+} X86_Mem;
+
+static inline X86_Mem x86_mem(int base, int32_t disp) {
+    return (X86_Mem){(int8_t)base, -1, 0, disp};
+}
+
+static inline X86_Mem x86_mem_indexed(int base, int index, int scale, int32_t disp) {
+    return (X86_Mem){(int8_t)base, (int8_t)index, (uint8_t)scale, disp};
+}
+
+// Every form picks the shortest encoding: REX only when needed, disp8 / imm8 whenever they fit
+void emit_op_rr(Jit_Buf* buf, X86_Op op, int dst, int src); // op dst, src
+void emit_op_ri(Jit_Buf* buf, X86_Op op, int dst, int32_t imm); // op dst, imm
+void emit_op_rm(Jit_Buf* buf, X86_Op op, int reg, X86_Mem m); // op reg, [m]
+void emit_op_mr(Jit_Buf* buf, X86_Op op, X86_Mem m, int reg); // op [m], reg
+void emit_op_mi(Jit_Buf* buf, X86_Op op, int size, X86_Mem m, int32_t imm); // op size [m], imm with size 1, 2, 4 or 8
+
+void emit_load64(Jit_Buf* buf, int dst, int base, int32_t disp); // mov dst, [base + disp]
+void emit_store64(Jit_Buf* buf, int base, int32_t disp, int src); // mov [base + disp], src
+void emit_store32(Jit_Buf* buf, int base, int32_t disp, int src); // mov [base + disp], src32
+void emit_mov64(Jit_Buf* buf, int dst, int src); // mov dst, src
+void emit_mov32(Jit_Buf* buf, int dst, int src); // mov dst32, src32, clears the upper half
+void emit_shift_ri(Jit_Buf* buf, X86_Shift op, int reg, uint8_t count); // op reg, imm8
+void emit_shift_cl(Jit_Buf* buf, X86_Shift op, int reg); // op reg, cl
+void emit_not(Jit_Buf* buf, int reg);
+void emit_imul(Jit_Buf* buf, int dst, int src); // imul dst, src, the low 64 bits of the product
+void emit_imul_imm(Jit_Buf* buf, int dst, int src, int32_t imm); // imul dst, src, imm
+void emit_div(Jit_Buf* buf, int reg); // rdx:rax / reg unsigned, quotient in rax and remainder in rdx, #DE on zero
+// BMI1 / BMI2, leave the host flags alone except andn. The caller checks PVCpu_Host_Features.
+void emit_andn(Jit_Buf* buf, int dst, int src1, int src2); // dst = ~src1 & src2
+void emit_shiftx(Jit_Buf* buf, X86_Shift op, int dst, int src, int count); // shlx/shrx/sarx dst, src, count
+void emit_rorx(Jit_Buf* buf, int dst, int src, uint8_t count); // rorx dst, src, imm8
+void emit_cmov_rm(Jit_Buf* buf, uint8_t cc, int reg, X86_Mem m); // cmovcc reg, [m]
+void emit_movimm64(Jit_Buf* buf, int dst, uint64_t imm); // Leaves the host flags alone, unlike xor
+uint8_t* emit_movabs64(Jit_Buf* buf, int dst, uint64_t imm); // Always the 10 byte form, returns the executable address of imm64
+void emit_push(Jit_Buf* buf, int reg);
+void emit_pop(Jit_Buf* buf, int reg);
+void emit_call_reg(Jit_Buf* buf, int reg); // call reg
+void emit_jmp_mem(Jit_Buf* buf, X86_Mem m); // jmp [m]
+void emit_call_abs(Jit_Buf* buf, const void* fn); // mov rax, fn; call rax
+void emit_syscall(Jit_Buf* buf); // Linux only, clobbers rcx and r11
+void emit_ret(Jit_Buf* buf);
+void emit_setcc(Jit_Buf* buf, uint8_t cc, int reg); // setcc reg8 + movzx reg32, reg8
+// jcc/jmp rel32 with the displacement left open, returns the executable address of the rel32 field
+uint8_t* emit_jcc32(Jit_Buf* buf, uint8_t cc);
+uint8_t* emit_jmp32(Jit_Buf* buf);
+uint8_t* emit_lea_rip32(Jit_Buf* buf, int dst); // lea dst, [rip + rel32], patched like a jump
+void jit_patch_rel32(Jit_Buf* buf, uint8_t* field, const uint8_t* target);
+
+// x86 condition codes
+#define X86_CC_C 0x2
+#define X86_CC_B 0x2
+#define X86_CC_AE 0x3
+#define X86_CC_E 0x4
+#define X86_CC_NE 0x5
+#define X86_CC_BE 0x6
+#define X86_CC_A 0x7
+#define X86_CC_S 0x8
+#define X86_CC_L 0xC
+#define X86_CC_GE 0xD
+#define X86_CC_LE 0xE
+#define X86_CC_G 0xF
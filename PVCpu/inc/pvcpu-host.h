@@ -0,0 +1,40 @@
+// Author: Pheonix Studios/AkshuDev
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Host CPU extensions the code generators may use. Detected once at startup, and overridable
+// with --host-features to test the fallbacks or to build AOT executables for older CPUs.
+typedef struct {
+    bool bmi1; // andn
+    bool bmi2; // shlx, shrx, sarx, rorx
+    bool lzcnt;
+    bool popcnt;
+    bool adx;
+    bool avx2;
+    bool avx512f;
+    bool erms; // Fast rep movsb
+    bool fsrm; // Fast rep movsb for short copies as well
+} PVCpu_Host_Features;
+
+#define PVCPU_HOST_FEATURE_COUNT 9
+
+// Where CPUID reports a feature, for code checking for it at runtime (see aot.c)
+typedef struct {
+    const char* name;
+    uint32_t leaf;
+    uint8_t reg; // 0 = eax, 1 = ebx, 2 = ecx, 3 = edx
+    uint8_t bit;
+    bool required; // Translated code executes its instructions, without it the program cannot run
+} PVCpu_Host_Cpuid;
+
+// What this CPU and OS support, nothing on other architectures
+void pvcpu_host_detect(PVCpu_Host_Features* host);
+// Applies a comma separated list to `host`: "native" is the detected set, "none" the plain
+// x86-64 baseline, a name adds a feature and a name starting with '-' removes it.
+// False with the offending item in `bad` when an item is unknown.
+bool pvcpu_host_parse(PVCpu_Host_Features* host, const char* spec, const char** bad);
+// One bit per feature in PVCpu_Host_Cpuid order, for cache keys
+uint32_t pvcpu_host_mask(const PVCpu_Host_Features* host);
+const PVCpu_Host_Cpuid* pvcpu_host_cpuid(int feature);
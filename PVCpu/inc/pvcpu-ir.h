@@ -0,0 +1,102 @@
+// Author: Pheonix Studios/AkshuDev
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pvcpu-isa.h>
+#include <pvcpu-runtime.h>
+
+// Worst case lowering is 7 micro-ops per instruction (NAND with REG_DISP) plus the block's final exit
+#define PVCPU_IR_MAX_UOPS (PVCPU_BLOCK_MAX_INSTS * 7 + 2)
+#define IR_NONE 0xFFFF
+
+// Micro-op IR between the decoder and the backend. Every micro-op defines at most one value,
+// named by its index, and values are never redefined. Guest registers are only touched through
+// IR_GET/IR_SET so the passes can track them like any other value.
+typedef enum {
+    IR_NOP = 0, // Removed by a pass
+    IR_CONST, // imm
+    IR_GET, // Guest register `reg`
+    IR_SET, // Guest register `reg` = a, with IR_SET_LAZY in `cond` only side exits observe it before the IR_SET at `imm` overwrites it
+
+    // a <op> b
+    IR_ADD,
+    IR_SUB,
+    IR_AND,
+    IR_OR,
+    IR_XOR,
+    IR_ANDN, // a & ~b
+    IR_MUL, // Low 64 bits of a * b
+    // a shifted or rotated by b & 63
+    IR_SHL,
+    IR_SHR,
+    IR_SAR,
+    IR_ROL,
+    IR_ROR,
+
+    // Raise exception `imm` when out of bounds, PVCPU_EXC_MEMORY or PVCPU_EXC_STACK for CALL and RET
+    IR_LOAD, // mem[a]
+    IR_STORE, // mem[a] = b
+    IR_DIV, // a / b unsigned, raises PVCPU_EXC_DIV_ZERO when b is 0
+
+    IR_FLAGS, // PVCpu_State.flags from comparing a with b, `cond` holds OP_CMP, OP_UCMP or OP_TEST, or known flags in `imm` when a is IR_NONE
+    IR_BRANCH, // Leaves to guest address a when the flags of IR_FLAGS b match `cond` (jcc mask, bit 7 inverts), b is IR_NONE for the flags the block was entered with
+    IR_EXIT, // Leaves to guest address a, chained when a is an IR_CONST. A call has its return address in b, a return IR_EXIT_RETURN in `cond`.
+    IR_RAISE, // Raises exception `imm`
+
+    IR_OP_COUNT
+} Ir_Op;
+
+#define IR_COND_INVERT 0x80
+#define IR_SET_LAZY 1
+#define IR_EXIT_RETURN 1
+
+typedef struct {
+    uint8_t op; // Ir_Op
+    uint8_t reg; // Guest register of IR_GET/IR_SET
+    uint8_t cond;
+    uint8_t retired; // Guest instructions of the block done once this one's instruction has, for the fuel meter
+    uint16_t a, b; // Operand values, IR_NONE when unused
+    uint64_t imm;
+    uint64_t pc; // Guest instruction this was lowered from, exceptions are raised there
+} Ir_Uop;
+
+typedef struct {
+    Ir_Uop uops[PVCPU_IR_MAX_UOPS];
+    size_t count;
+} Ir_Block;
+
+static inline bool ir_is_alu(uint8_t op) {
+    return op >= IR_ADD && op <= IR_ROR;
+}
+
+static inline bool ir_is_shift(uint8_t op) {
+    return op >= IR_SHL && op <= IR_ROR;
+}
+
+// Micro-ops whose only effect is their value, dropped when nothing uses it
+static inline bool ir_is_pure(uint8_t op) {
+    return op == IR_CONST || op == IR_GET || ir_is_alu(op);
+}
+
+// Micro-ops that may leave the block, guest state has to be architectural in front of them
+static inline bool ir_may_exit(uint8_t op) {
+    return op >= IR_LOAD && op != IR_FLAGS;
+}
+
+// Micro-ops that leave the block only on some paths and otherwise fall through
+static inline bool ir_is_side_exit(uint8_t op) {
+    return op == IR_LOAD || op == IR_STORE || op == IR_DIV || op == IR_BRANCH;
+}
+
+void ir_init();
+// Whether the front end can lower `inst`, the JIT stops in front of anything it cannot
+bool ir_can_lower(const PVCpu_Inst* inst);
+// Lowers the first `count` instructions of `db` followed by the exit to `end` (or raising `fault` there)
+void ir_lower(Ir_Block* ir, const PVCpu_Decoded_Block* db, size_t count, uint64_t end, uint32_t fault);
+// Runs the optimization passes in order
+void ir_optimize(Ir_Block* ir);
+// Number of uses of each value, `uses` holds ir->count entries
+void ir_count_uses(const Ir_Block* ir, uint16_t* uses);
@@ -1,9 +1,11 @@
 // Author: Pheonix Studios/AkshuDev
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 
+#include <pvcpu-host.h>
 #include <pvcpu-jit.h>
 
 #define PVCPU_FLAGS_BP_VALID 0b0001 // PVCpu Flags Bit Position - Valid
@@ -11,6 +13,37 @@
 #define PVCPU_FLAGS_BP_DISP64 0b0100
 #define PVCPU_FLAGS_BP_EXT 0b1000
 
+#define PVCPU_MAX_EXTFLAGS 3 // Extended, Extended-Extended and Advanced flags
+
+#define PVCPU_RUN_EXEC 0b01 // Execute the translated code instead of dumping it
+#define PVCPU_RUN_DUMP_REGS 0b10 // Print the guest registers after execution
+#define PVCPU_RUN_TRACES 0b100 // Translate hot paths across branches as superblocks
+#define PVCPU_RUN_BASELINE 0b1000 // Compile new blocks from stencils right away instead of interpreting them
+
+#define PVCPU_DEFAULT_MEMSIZE (1024 * 1024)
+#define PVCPU_DEFAULT_JIT_THRESHOLD 32 // Interpreted executions before a block is translated
+
+// Register numbers
+#define PVCPU_REG_NULL 0
+#define PVCPU_REG_G0 1
+#define PVCPU_REG_LR 32
+#define PVCPU_REG_SF 33
+#define PVCPU_REG_SP 34
+#define PVCPU_REG_PC 35
+#define PVCPU_REG_IP 39
+
+// Condition flags, written by CMP/UCMP/TEST only
+#define PVCPU_FLAG_Z 0b001 // Equal / zero
+#define PVCPU_FLAG_L 0b010 // Less (signed for CMP and TEST, unsigned for UCMP)
+#define PVCPU_FLAG_G 0b100 // Greater
+
+// Guest exceptions
+#define PVCPU_EXC_INVALID_INST 0x1
+#define PVCPU_EXC_UNSUPPORTED 0x2
+#define PVCPU_EXC_STACK 0x3
+#define PVCPU_EXC_MEMORY 0x4 // Access outside guest memory
+#define PVCPU_EXC_DIV_ZERO 0x5
+
 typedef struct {
     uint16_t opcode; // Actually 12bits, use lower
     uint8_t mode; // Actually 4bits, use lower
@@ -44,10 +77,30 @@ typedef enum {
     // Memory
     OP_LOAD = 0x100,
     OP_STORE,
+    // Control flow, target is src (REG_REG), src as imm (REG_IMM) or imm (REG_EXTIMM)
+    OP_JMP = 0x12C,
+    OP_CALL, // LR = return address, return address is pushed onto the stack
+    OP_RET, // Pops the return address
+    OP_EXCEPTION, // Raises exception src (REG_IMM) or imm (REG_EXTIMM)
+    OP_JZ = 0x130,
+    OP_JNZ,
+    OP_JL,
+    OP_JLE,
+    OP_JG,
+    OP_JGE,
+    OP_JE,
+    OP_JNE,
     // Registers
     OP_MOV = 0x150
 } Opcodes;
 
+typedef enum {
+    PVCPU_EXIT_NONE = 0,
+    PVCPU_EXIT_HALT, // PC left the code section
+    PVCPU_EXIT_EXCEPTION,
+    PVCPU_EXIT_FUEL // Instruction budget used up, PC is the next instruction. Refilling fuel and clearing exit_reason resumes the guest.
+} PVCpu_Exit;
+
 typedef enum {
     NULL_MODE = 0, // No mode
     REG_REG, // dest = src
@@ -65,12 +118,55 @@ typedef enum {
     SYSCALL_IMM, // syscall(imm)
 } Modes;
 
+#define PVCPU_RAS_SIZE 16 // Shadow return stack entries, a power of two
+
+// Return address pushed by a translated call, with the exit of the calling block that continues there
+typedef struct {
+    uint64_t pc;
+    const uint8_t* code; // jmp of that exit, goes straight into the block at `pc` once the dispatcher linked it
+} PVCpu_Ras_Entry;
+
 typedef struct {
     uint64_t regs[40]; // NULL, G0-G30, LR, SF, SP, PC (Internal), I0-I3 (Internal), IP (Internal)
     uint8_t* memory;
     size_t memsize;
+    uint64_t flags; // PVCPU_FLAG_*, stale while flags_op is set, read them through pvcpu_flags()
+    uint64_t flags_a, flags_b; // Operands of the compare whose flags are pending
+    uint32_t flags_op; // OP_CMP, OP_UCMP or OP_TEST whose flags have not been computed yet, 0 when `flags` is current
+    uint32_t exit_reason; // PVCpu_Exit
+    uint32_t exception;
+    void* last_exit; // PVCpu_Block_Exit taken to return to the dispatcher, NULL for dynamic exits
+    uint64_t fuel; // Guest instructions left to run when metered, held in PVCPU_HOST_FUEL inside translated code
+    uint64_t ras_top; // Pushes minus pops, the newest entry is ras[(ras_top - 1) % PVCPU_RAS_SIZE]. Zero empties it.
+    PVCpu_Ras_Entry ras[PVCPU_RAS_SIZE]; // Shadow return stack of translated calls, a miss only costs a lookup
 } PVCpu_State;
 
+// Flags written by compare `op` (OP_CMP, OP_UCMP or OP_TEST) of a with b
+static inline uint64_t pvcpu_compare_flags(uint32_t op, uint64_t a, uint64_t b) {
+    if (op == OP_TEST) {
+        int64_t r = (int64_t)(a & b);
+        return r == 0 ? PVCPU_FLAG_Z : (r < 0 ? PVCPU_FLAG_L : PVCPU_FLAG_G);
+    }
+    if (a == b) return PVCPU_FLAG_Z;
+    bool less = op == OP_UCMP ? a < b : (int64_t)a < (int64_t)b;
+    return less ? PVCPU_FLAG_L : PVCPU_FLAG_G;
+}
+
+// Compares only record their operands, the flags are computed the first time something reads them
+static inline void pvcpu_record_compare(PVCpu_State* state, uint32_t op, uint64_t a, uint64_t b) {
+    state->flags_op = op;
+    state->flags_a = a;
+    state->flags_b = b;
+}
+
+static inline uint64_t pvcpu_flags(PVCpu_State* state) {
+    if (state->flags_op != 0) {
+        state->flags = pvcpu_compare_flags(state->flags_op, state->flags_a, state->flags_b);
+        state->flags_op = 0;
+    }
+    return state->flags;
+}
+
 typedef struct {
     uint16_t opcode; // Actually 12bits, use lower
     uint8_t extender; // Actually 4bits, use lower
@@ -110,10 +206,11 @@ inline static size_t pvcpu_unpack_inst(const uint8_t* buf, size_t len, PVCpu_Ins
         off += 8;
     }
     if (out->flags & PVCPU_FLAGS_BP_EXT) {
-        while (off < len) {
-            if (off + 8 > len) return 0;
+        while (1) {
+            if (off + 8 > len || *extflag_count >= PVCPU_MAX_EXTFLAGS) return 0;
             uint64_t mask;
             memcpy(&mask, buf + off, 8);
+            off += 8;
 
             extflags_out[*extflag_count] = mask;
             (*extflag_count)++;
@@ -132,4 +229,17 @@ inline static uint16_t pvpcu_c_pack_inst(PVCpuC_Inst inst) {
     return packed_inst;
 }
 
-void pvcpu_run(PVCpu_Inst* insts, uint64_t* values, uint64_t** extflags, int* extflag_count, size_t inst_num, size_t inst_cap, size_t memsize, size_t instsize, uint8_t run_code);
+typedef struct {
+    size_t memsize;
+    size_t chunk_size; // JIT chunk size
+    uint32_t jit_threshold; // PVCPU_DEFAULT_JIT_THRESHOLD, 0 translates every block before its first execution
+    uint8_t run_code; // PVCPU_RUN_*
+    const char* cache_dir; // Translations are kept here across runs, NULL for none
+    unsigned jit_threads; // Threads translating queued blocks, 0 for one per online CPU
+    PVCpu_Host_Features host; // Extensions translated code may use, see pvcpu_host_detect()
+    uint64_t fuel; // Guest instructions to run before exiting with PVCPU_EXIT_FUEL, 0 for no limit
+} PVCpu_Config;
+
+int pvcpu_run(const uint8_t* code, size_t code_size, const PVCpu_Config* config);
+// Compiles the whole program into the native x86-64 Linux executable `out` (see aot.c)
+int pvcpu_aot(const uint8_t* code, size_t code_size, const PVCpu_Config* config, const char* out);
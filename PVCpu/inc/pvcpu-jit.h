@@ -1,17 +1,49 @@
 // Author: Pheonix Studios/AkshuDev
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+#include <pvcpu-codecache.h>
+
+#define PVCPU_JIT_CHUNK 65536 // Default chunk size
+#define PVCPU_JIT_LINK_SIZE 5 // jmp rel32, kept free at the end of every chunk to chain to the next one
+
 typedef struct {
-    uint8_t* data;
+    uint8_t* exec;
     size_t size;
-    size_t capacity;
+} Jit_Chunk;
+
+// Emission buffer living inside the code cache
+// Space is reserved once per guest instruction with jit_reserve(), the emit_* helpers
+// then store without any checks. When a chunk fills up a new one is taken from the cache
+// and the old one jumps to it, so emitted code stays one logical stream.
+typedef struct {
+    uint8_t* data; // Writable alias of the current chunk
+    uint8_t* exec; // Executable alias of the current chunk
+    size_t size; // Bytes used in the current chunk
+    size_t capacity; // Usable bytes in the current chunk (link jump excluded)
+    size_t emitted; // Bytes in previous chunks
+
+    Code_Cache* cc;
+    size_t chunk_size;
+    Jit_Chunk* chunks;
+    size_t chunk_count;
+    size_t chunk_cap;
 } Jit_Buf;
 
-static inline void jit_init(Jit_Buf* buf, size_t cap) {
-    buf->data = (uint8_t*)malloc(cap);
-    buf->size = 0;
-    buf->capacity = cap;
+bool jit_init(Jit_Buf* buf, Code_Cache* cc, size_t chunk_size);
+void jit_free(Jit_Buf* buf);
+bool jit_grow(Jit_Buf* buf, size_t need);
+
+// Makes sure the next `need` bytes can be emitted without checks
+static inline bool jit_reserve(Jit_Buf* buf, size_t need) {
+    if (buf->size + need <= buf->capacity) return true;
+    return jit_grow(buf, need);
+}
+
+// Executable address the next emitted byte will have
+static inline uint8_t* jit_pos(const Jit_Buf* buf) {
+    return buf->exec + buf->size;
 }
@@ -0,0 +1,55 @@
+// Author: Pheonix Studios/AkshuDev
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pvcpu-isa.h>
+#include <pvcpu-jit.h>
+#include <pvcpu-ir.h>
+
+#define PVCPU_GUEST_REGS 40
+#define PVCPU_ALLOC_REGS 34 // Only NULL, G0-G30, LR, SF and SP are candidates
+
+#define PVCPU_HOST_STATE HOST_RBX // Holds the PVCpu_State pointer inside translated code
+#define PVCPU_HOST_FUEL HOST_R15 // Holds PVCpu_State.fuel inside metered translated code
+#define PVCPU_RA_SLOTS 8 // rsp relative frame slots the backend parks values in when it runs out of scratch registers
+
+// Block level guest -> host register assignment
+typedef struct {
+    int8_t host[PVCPU_GUEST_REGS]; // Host register caching each guest register, -1 when it lives in PVCpu_State
+    uint64_t live_in; // Allocated guest registers read before written, loaded on entry
+    uint64_t dirty; // Allocated guest registers newer than PVCpu_State
+    uint16_t saved; // Callee saved host registers pushed by the prologue, the same for every block
+    bool fuel; // PVCPU_HOST_FUEL is loaded by the prologue and stored by the epilogue instead of being allocated
+    int frame; // Stack adjustment for the slots, keeping rsp 16 byte aligned for helper calls
+} Reg_Alloc;
+
+// No guest register cached, only the frame every block shares
+void ra_init_frame(Reg_Alloc* ra, bool fuel);
+// Allocates from the guest register reads and writes of the optimized IR
+void ra_alloc_block(Reg_Alloc* ra, const Ir_Block* ir, bool fuel);
+// rsp offset of frame slot `slot`
+int32_t ra_slot(int slot);
+
+static inline int ra_host(const Reg_Alloc* ra, int guest) {
+    return ra->host[guest];
+}
+
+static inline void ra_mark_dirty(Reg_Alloc* ra, int guest) {
+    if (ra->host[guest] >= 0) ra->dirty |= 1ull << guest;
+}
+
+// Upper bounds of what the functions below emit
+#define PVCPU_RA_PROLOGUE_MAX 64
+#define PVCPU_RA_LOAD_MAX (PVCPU_ALLOC_REGS * 7)
+#define PVCPU_RA_SPILL_MAX (PVCPU_ALLOC_REGS * 7)
+#define PVCPU_RA_EPILOGUE_MAX 32
+
+void ra_emit_prologue(Jit_Buf* buf, const Reg_Alloc* ra);
+void ra_emit_epilogue(Jit_Buf* buf, const Reg_Alloc* ra);
+// Loads live-in guest registers into their host registers
+void ra_emit_load(Jit_Buf* buf, const Reg_Alloc* ra);
+// Writes dirty guest registers back to PVCpu_State
+void ra_emit_spill(Jit_Buf* buf, const Reg_Alloc* ra);
@@ -0,0 +1,152 @@
+// Author: Pheonix Studios/AkshuDev
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pvcpu-isa.h>
+#include <pvcpu-codecache.h>
+#include <pvcpu-guestmem.h>
+#include <pvcpu-jit.h>
+#include <pvcpu-tcache.h>
+
+#define PVCPU_BLOCK_MAX_INSTS 128
+#define PVCPU_TC_INITIAL 1024
+#define PVCPU_JIT_QUEUE 64 // Hot blocks translated together in one batch
+#define PVCPU_LINK_QUEUE 32 // Chain links patched together where the code cache has to be unsealed for them
+#define PVCPU_TRACE_MIN_EXECS 8 // Interpreted executions of a conditional branch before a trace follows it
+#define PVCPU_JIT_MAX_THREADS 16 // Threads translating one batch, the calling thread included
+
+// Guest instructions of one basic block or trace, decoded straight from guest memory
+typedef struct {
+    size_t count;
+    uint64_t end; // Guest address after the last decoded instruction
+    uint32_t fault; // Exception to raise at `end` instead of falling through, 0 if none
+    uint64_t span_start; // Guest bytes the decoder looked at lie in [span_start, span_end)
+    uint64_t span_end;
+    PVCpu_Inst insts[PVCPU_BLOCK_MAX_INSTS];
+    uint64_t values[PVCPU_BLOCK_MAX_INSTS];
+    uint64_t pcs[PVCPU_BLOCK_MAX_INSTS];
+    uint8_t sizes[PVCPU_BLOCK_MAX_INSTS]; // Encoded length, pcs[i] + sizes[i] is the fall-through
+    uint64_t extflags[PVCPU_BLOCK_MAX_INSTS][PVCPU_MAX_EXTFLAGS];
+    int extflag_count[PVCPU_BLOCK_MAX_INSTS];
+} PVCpu_Decoded_Block;
+
+// Chain link waiting for the next time the code cache is writable anyway
+typedef struct {
+    PVCpu_Block_Exit* exit;
+    PVCpu_Block* target;
+} PVCpu_Pending_Link;
+
+typedef struct Jit_Job Jit_Job;
+typedef struct Jit_Pool Jit_Pool;
+typedef struct Jit_Compiler Jit_Compiler;
+
+typedef struct {
+    PVCpu_State state;
+    Guest_Mem mem; // Backs state.memory
+    Code_Cache cache;
+    Jit_Buf buf;
+    Trans_Cache tc;
+    size_t code_size; // Code occupies guest memory [0, code_size)
+
+    uint32_t jit_threshold;
+    PVCpu_Host_Features host;
+    bool traces; // PVCPU_RUN_TRACES
+    bool baseline; // PVCPU_RUN_BASELINE
+    bool fuel; // Guest instructions are metered against PVCpu_State.fuel
+    PVCpu_Block* jit_queue[PVCPU_JIT_QUEUE]; // Hot blocks waiting for translation
+    size_t queue_count;
+    PVCpu_Pending_Link links[PVCPU_LINK_QUEUE]; // Only used without a writable alias of the code cache
+    size_t link_count;
+    const uint8_t* flags_stub; // Computes pending flags for translated code, emitted with the first block
+    Jit_Pool* pool; // Worker threads translating batches of blocks, NULL when translating serially
+    Jit_Compiler* compiler; // Background thread translating hot blocks, NULL when they are translated in batches
+
+    bool keep_relocs; // Translated blocks keep their PVCpu_Reloc, for the disk cache and AOT compilation
+    const char* cache_dir; // Persistent translation cache, NULL when off
+    uint64_t cache_key; // Of the program as loaded, see dc_key()
+    bool cache_dirty; // Blocks were translated or dropped since the cache file was loaded
+} PVCpu_Runtime;
+
+static inline bool pvcpu_is_block_end(uint16_t opcode) {
+    return opcode >= OP_JMP && opcode <= OP_JNE;
+}
+
+void pvcpu_decode_block(const PVCpu_Runtime* rt, uint64_t pc, PVCpu_Decoded_Block* out);
+// Decodes the hot path starting at `pc`, following static jumps and conditional
+// branches in the direction the interpreter saw them go most of the time
+void pvcpu_decode_trace(const PVCpu_Runtime* rt, uint64_t pc, PVCpu_Decoded_Block* out);
+
+// Decodes the block at `pc` for the interpreter (or baseline) tier and adds it to the translation cache
+PVCpu_Block* pvcpu_new_block(PVCpu_Runtime* rt, uint64_t pc);
+
+// isa.c
+// Translates an interpreted block in place, blocks starting with an instruction
+// the JIT cannot handle become PVCPU_TIER_INTERP_ONLY. False on allocation failure.
+bool pvcpu_translate_block(PVCpu_Runtime* rt, PVCpu_Block* block);
+// Shared routine computing pending flags (see emit_flags_stub()), emitted on first use, NULL when out of code cache
+const uint8_t* pvcpu_flags_stub(PVCpu_Runtime* rt);
+// Translation split up for other threads: pvcpu_job_new() decodes the block on the owning thread,
+// pvcpu_job_compile() translates it into memory of its own on any thread, touching neither the block
+// nor the code cache, so the block may even keep running. Needs the flags stub to exist.
+// pvcpu_job_install() then copies the code into the code cache and the results into the block on the
+// owning thread and frees the job. All of them fail on allocation failure only.
+Jit_Job* pvcpu_job_new(PVCpu_Runtime* rt, PVCpu_Block* block);
+bool pvcpu_job_compile(PVCpu_Runtime* rt, Jit_Job* job);
+bool pvcpu_job_install(PVCpu_Runtime* rt, Jit_Job* job);
+PVCpu_Block* pvcpu_job_block(const Jit_Job* job);
+void pvcpu_job_free(Jit_Job* job); // Drops the job without touching the block
+
+// jitpool.c
+// Online CPUs, at most PVCPU_JIT_MAX_THREADS
+unsigned pvcpu_jit_threads();
+// Starts `threads - 1` workers, none for a single thread or where threads are not supported
+void pvcpu_pool_start(PVCpu_Runtime* rt, unsigned threads);
+void pvcpu_pool_stop(PVCpu_Runtime* rt);
+// Compiles the jobs on the workers and the calling thread, returns once all of them are done
+bool pvcpu_pool_compile(PVCpu_Runtime* rt, Jit_Job** jobs, size_t count);
+// pvcpu_translate_block() for a whole batch, in parallel when there is a pool. Makes the code cache
+// writable first, the caller publishes.
+bool pvcpu_translate_blocks(PVCpu_Runtime* rt, PVCpu_Block** blocks, size_t count);
+// The background compiler takes hot blocks from a lock-free queue and translates them while the guest
+// keeps running them in their current tier. Finished translations wait in a second queue until the
+// guest thread installs them between two blocks, so executable code is only ever written by the guest
+// thread. Not started where threads are not supported, the runtime then translates in batches.
+void pvcpu_compiler_start(PVCpu_Runtime* rt);
+// Queues `block` and marks it compiling, false on allocation failure. Any thread may request.
+bool pvcpu_compiler_request(PVCpu_Runtime* rt, PVCpu_Block* block);
+// Installs every finished translation, false on allocation failure or when the code cache could not
+// be written. The blocks of a failed install stay in their tier.
+bool pvcpu_compiler_install(PVCpu_Runtime* rt);
+// Installs what is finished and drops what is not, those blocks stay in their tier
+void pvcpu_compiler_stop(PVCpu_Runtime* rt);
+
+// stencil.c
+void pvcpu_stencil_init();
+// Compiles `db` into `block` by copying the stencils of its instructions, the threaded code is kept
+// for when the block is queued for the JIT. False when an instruction has no stencil or the cache is full.
+bool pvcpu_stencil_compile(PVCpu_Runtime* rt, PVCpu_Block* block, const PVCpu_Decoded_Block* db);
+
+// diskcache.c
+// Translated blocks persisted across runs in `<cache_dir>/<key>.pvtc`, the key covers the code section
+// and everything else translations depend on. A missing or stale file simply means translating again,
+// false only when the code cache could not be written.
+bool dc_load(PVCpu_Runtime* rt);
+// Rewrites the cache file when this run translated blocks it did not load, false when that failed
+bool dc_save(PVCpu_Runtime* rt);
+
+// interp.c
+void pvcpu_interp_init();
+// Builds the threaded code of `block` from `db` and takes its extent from it, false on allocation failure
+bool pvcpu_interp_prepare(PVCpu_Block* block, const PVCpu_Decoded_Block* db);
+// Runs one block and leaves PC at the next one
+void pvcpu_interp_block(PVCpu_State* state, const PVCpu_Block* block);
+
+// Called from translated code, the guest state has been spilled before
+void pvcpu_helper_call(PVCpu_State* state, uint64_t ret, uint64_t target);
+void pvcpu_helper_ret(PVCpu_State* state);
+void pvcpu_helper_raise(PVCpu_State* state, uint64_t pc, uint64_t code);
+// Helper a PVCPU_RELOC_HELPER_* relocation refers to
+const void* pvcpu_helper(uint8_t kind);
@@ -0,0 +1,121 @@
+// Author: Pheonix Studios/AkshuDev
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pvcpu-isa.h>
+#include <pvcpu-codecache.h>
+
+#define PVCPU_TRACE_MAX_BLOCKS 8 // Basic blocks a trace may span
+#define PVCPU_BLOCK_MAX_EXITS (PVCPU_TRACE_MAX_BLOCKS + 1) // A side exit per inner branch, two for the last one
+
+struct PVCpu_Block;
+
+// A statically known block exit, jumps to a stub returning to the dispatcher until linked
+typedef struct PVCpu_Block_Exit {
+    uint8_t* site; // Executable address of the patchable jmp rel32 field (4 byte aligned)
+    uint8_t* stub; // Exit stub the jump goes to while unlinked
+    uint64_t target; // Guest PC
+    struct PVCpu_Block* block; // Owning block
+    struct PVCpu_Block* linked; // Block currently jumped to, NULL when unlinked
+    struct PVCpu_Block_Exit* next_in; // Next exit linked into the same block
+} PVCpu_Block_Exit;
+
+// Absolute host address inside translated code, rewritten when the code is moved (see diskcache.c, aot.c)
+typedef enum {
+    PVCPU_RELOC_HELPER_CALL = 0, // pvcpu_helper_call
+    PVCPU_RELOC_HELPER_RET, // pvcpu_helper_ret
+    PVCPU_RELOC_HELPER_RAISE, // pvcpu_helper_raise
+    PVCPU_RELOC_FLAGS_STUB, // PVCpu_Runtime.flags_stub
+    PVCPU_RELOC_EXIT // Exit record `arg` of the block itself
+} PVCpu_Reloc_Kind;
+
+typedef struct {
+    uint32_t offset; // Of the imm64 of a movabs, from the block entry
+    uint8_t kind; // PVCpu_Reloc_Kind
+    uint8_t arg;
+} PVCpu_Reloc;
+
+typedef enum {
+    PVCPU_TIER_INTERP = 0, // Interpreted, counting executions
+    PVCPU_TIER_QUEUED, // Hot, interpreted until the translation queue is drained
+    PVCPU_TIER_JIT, // Translated, `code` and `body` are valid
+    PVCPU_TIER_INTERP_ONLY, // Starts with an instruction the JIT has no handler for, or lies on code the guest keeps writing
+    PVCPU_TIER_BASELINE // Copied together from stencils, counting executions like PVCPU_TIER_INTERP, `code` is valid
+} PVCpu_Tier;
+
+// Threaded code for the interpreter tier, one entry per instruction or fused pair (see interp.c)
+typedef struct {
+    const void* handler; // Label inside pvcpu_interp_block for this (opcode, mode)
+    uint64_t value; // Immediate, displacement or static branch target
+    uint64_t target; // Branch target of a fused compare and jump
+    uint64_t pc;
+    uint16_t opcode;
+    uint8_t mode;
+    uint8_t dest;
+    uint8_t src;
+    uint8_t cond; // Flags tested by a jump, bit 7 set when it is taken on clear flags
+    uint8_t aux; // Destination of the second instruction of a fused pair
+} PVCpu_Interp_Inst;
+
+// A basic block, interpreted until it gets hot and translated after that.
+// With traces enabled a translated block may continue along the hot path across
+// taken branches, leaving through side exits wherever the path is not followed.
+typedef struct PVCpu_Block {
+    uint64_t pc; // Guest address of the first instruction
+    uint64_t end; // Guest address after the last instruction
+    uint64_t span_start; // Guest code it was decoded from lies in [span_start, span_end), traces reach past [pc, end)
+    uint64_t span_end;
+    uint8_t* code; // Executable entry, sets up the frame
+    uint8_t* body; // Entry for chained jumps from other blocks, frame already set up
+    size_t code_size;
+    uint32_t inst_count;
+
+    uint8_t tier; // PVCpu_Tier
+    bool compiling; // With the background compiler, runs in its current tier until the translation is installed
+    bool dropped; // Removed while compiling, freed once the compiler hands it back
+    uint32_t exec_count; // Interpreted executions
+    uint32_t fall_count; // Interpreted executions leaving through `end`, picks the direction traces follow
+    uint32_t fault; // Exception the interpreter raises at `end`, 0 if none
+    PVCpu_Interp_Inst* insts; // Threaded code, interpreter tier only, freed once translated
+    uint8_t* snapshot; // Guest code as decoded when it lies on a page the guest keeps writing, checked before each run
+
+    PVCpu_Block_Exit exits[PVCPU_BLOCK_MAX_EXITS];
+    uint32_t exit_count;
+    PVCpu_Block_Exit* incoming; // Exits of other blocks linked to this one
+    PVCpu_Reloc* relocs; // Translated blocks only, and only with PVCpu_Runtime.keep_relocs
+    uint32_t reloc_count;
+} PVCpu_Block;
+
+// Translation cache, open addressing hash table keyed by guest PC
+typedef struct {
+    PVCpu_Block** slots;
+    size_t cap; // Power of two
+    size_t count;
+} Trans_Cache;
+
+bool tc_init(Trans_Cache* tc, size_t cap);
+void tc_destroy(Trans_Cache* tc); // Frees the blocks as well
+bool tc_insert(Trans_Cache* tc, PVCpu_Block* block);
+// Unlinks the block in both directions and drops it from the table, the caller frees it and publishes.
+// False when the code cache could not be made writable, the block then stays.
+bool tc_remove(Trans_Cache* tc, Code_Cache* cc, PVCpu_Block* block);
+void tc_free(PVCpu_Block* block); // The block and what it owns, its code stays in the code cache
+
+// Patches `exit` to jump straight into `target`'s body
+void tc_link(Code_Cache* cc, PVCpu_Block_Exit* exit, PVCpu_Block* target);
+void tc_unlink(Code_Cache* cc, PVCpu_Block_Exit* exit);
+
+static inline size_t tc_hash(uint64_t pc) {
+    return (size_t)((pc >> 2) * 0x9E3779B97F4A7C15ull >> 16);
+}
+
+static inline PVCpu_Block* tc_lookup(const Trans_Cache* tc, uint64_t pc) {
+    size_t mask = tc->cap - 1;
+    for (size_t i = tc_hash(pc) & mask;; i = (i + 1) & mask) {
+        PVCpu_Block* b = tc->slots[i];
+        if (b == NULL || b->pc == pc) return b;
+    }
+}
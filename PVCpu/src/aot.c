@@ -0,0 +1,505 @@
+// Author: Pheonix Studios/AkshuDev
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <elfutils.h>
+
+#include <pvcpu-runtime.h>
+#include <pvcpu-helpers.h>
+#include <pvcpu-ir.h>
+#include <pvcpu-regalloc.h>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+// Native image, a static non-PIE x86-64 Linux ELF loaded as one read + execute segment at AOT_BASE:
+//   ELF header, program headers, messages, guest code, entry table, text
+// Text holds the runtime helpers, the flags stub, every translated block and the startup code.
+// PVCpu_State is a zero filled segment of its own at AOT_STATE, guest memory is mapped at startup.
+#define AOT_BASE 0x400000ull
+#define AOT_STATE 0x200000ull
+#define AOT_PHNUM 3
+#define AOT_HEADROOM (4u << 20) // Free text kept in front of each translation, well above the largest block
+
+#define AOT_SYS_WRITE 1
+#define AOT_SYS_MMAP 9
+#define AOT_SYS_EXIT_GROUP 231
+#define AOT_MMAP_FLAGS 0x4022 // MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE
+
+static const char* const messages[] = {
+    "Guest exception\n",
+    "Error: No native code for the guest PC!\n",
+    "Error: Memory allocation failed!\n",
+    "Error: This CPU lacks extensions the program was compiled for!\n",
+};
+#define AOT_MSG_EXCEPTION 0
+#define AOT_MSG_MISSING 1
+#define AOT_MSG_MEMORY 2
+#define AOT_MSG_HOST 3
+#define AOT_MSG_COUNT 4
+
+typedef struct {
+    PVCpu_Runtime* rt;
+    Code_Cache cc; // rw is the text in `image`, rx its address in the native process
+    uint8_t* image;
+    size_t cap;
+    size_t code_off; // Guest code
+    size_t table_off; // Block entry per guest address, 0 where no block starts
+    size_t text_off;
+    uint64_t msg_addr[AOT_MSG_COUNT];
+    const uint8_t* helpers[PVCPU_RELOC_HELPER_RAISE + 1]; // Native helper per PVCPU_RELOC_HELPER_*
+} Aot;
+
+static size_t align_up(size_t v, size_t a) {
+    return (v + a - 1) & ~(a - 1);
+}
+
+// Keeps AOT_HEADROOM free behind the text so translation never has to grow the Jit_Buf
+static bool text_room(Aot* a) {
+    Jit_Buf* buf = &a->rt->buf;
+    if (buf->capacity - buf->size >= AOT_HEADROOM) return true;
+    size_t cap = a->cap * 2;
+    uint8_t* image = realloc(a->image, cap);
+    if (image == NULL) return false;
+    a->image = image;
+    a->cap = cap;
+    a->cc.rw = image + a->text_off;
+    buf->data = a->cc.rw;
+    buf->capacity = cap - a->text_off;
+    return true;
+}
+
+// pvcpu_helper_raise(state, pc, code)
+static void emit_native_raise(Jit_Buf* buf) {
+    emit_store64(buf, HOST_RDI, offsetof(PVCpu_State, regs) + PVCPU_REG_PC * 8, HOST_RSI);
+    emit_store32(buf, HOST_RDI, offsetof(PVCpu_State, exception), HOST_RDX);
+    emit_op_mi(buf, X86_MOV, 4, x86_mem(HOST_RDI, offsetof(PVCpu_State, exit_reason)), PVCPU_EXIT_EXCEPTION);
+    emit_ret(buf);
+}
+
+// Stack exception at the PC the call or return stored, through the raise helper
+static void emit_stack_fault(Jit_Buf* buf, uint8_t* fault, const uint8_t* raise) {
+    jit_patch_rel32(buf, fault, jit_pos(buf));
+    emit_load64(buf, HOST_RSI, HOST_RDI, offsetof(PVCpu_State, regs) + PVCPU_REG_PC * 8);
+    emit_movimm64(buf, HOST_RDX, PVCPU_EXC_STACK);
+    jit_patch_rel32(buf, emit_jmp32(buf), raise);
+}
+
+// pvcpu_helper_call(state, ret, target)
+static void emit_native_call(Jit_Buf* buf, const uint8_t* raise) {
+    emit_load64(buf, HOST_RAX, HOST_RDI, offsetof(PVCpu_State, regs) + PVCPU_REG_SP * 8);
+    emit_op_ri(buf, X86_CMP, HOST_RAX, 8);
+    uint8_t* low = emit_jcc32(buf, X86_CC_B);
+    emit_op_rm(buf, X86_CMP, HOST_RAX, x86_mem(HOST_RDI, offsetof(PVCpu_State, memsize)));
+    uint8_t* high = emit_jcc32(buf, X86_CC_A);
+    emit_op_ri(buf, X86_SUB, HOST_RAX, 8);
+    emit_load64(buf, HOST_RCX, HOST_RDI, offsetof(PVCpu_State, memory));
+    emit_op_mr(buf, X86_MOV, x86_mem_indexed(HOST_RCX, HOST_RAX, 0, 0), HOST_RSI);
+    emit_store64(buf, HOST_RDI, offsetof(PVCpu_State, regs) + PVCPU_REG_SP * 8, HOST_RAX);
+    emit_store64(buf, HOST_RDI, offsetof(PVCpu_State, regs) + PVCPU_REG_LR * 8, HOST_RSI);
+    emit_store64(buf, HOST_RDI, offsetof(PVCpu_State, regs) + PVCPU_REG_PC * 8, HOST_RDX);
+    emit_ret(buf);
+    jit_patch_rel32(buf, low, jit_pos(buf));
+    emit_stack_fault(buf, high, raise);
+}
+
+// pvcpu_helper_ret(state)
+static void emit_native_ret(Jit_Buf* buf, const uint8_t* raise) {
+    emit_load64(buf, HOST_RAX, HOST_RDI, offsetof(PVCpu_State, regs) + PVCPU_REG_SP * 8);
+    emit_load64(buf, HOST_RCX, HOST_RDI, offsetof(PVCpu_State, memsize));
+    emit_op_rr(buf, X86_CMP, HOST_RAX, HOST_RCX);
+    uint8_t* high = emit_jcc32(buf, X86_CC_A);
+    emit_op_rr(buf, X86_SUB, HOST_RCX, HOST_RAX);
+    emit_op_ri(buf, X86_CMP, HOST_RCX, 8);
+    uint8_t* low = emit_jcc32(buf, X86_CC_B);
+    emit_load64(buf, HOST_RCX, HOST_RDI, offsetof(PVCpu_State, memory));
+    emit_op_rm(buf, X86_MOV, HOST_RCX, x86_mem_indexed(HOST_RCX, HOST_RAX, 0, 0));
+    emit_op_ri(buf, X86_ADD, HOST_RAX, 8);
+    emit_store64(buf, HOST_RDI, offsetof(PVCpu_State, regs) + PVCPU_REG_SP * 8, HOST_RAX);
+    emit_store64(buf, HOST_RDI, offsetof(PVCpu_State, regs) + PVCPU_REG_PC * 8, HOST_RCX);
+    emit_ret(buf);
+    jit_patch_rel32(buf, low, jit_pos(buf));
+    emit_stack_fault(buf, high, raise);
+}
+
+// Prints message `msg` to stderr and exits with `status`
+static void emit_native_exit(const Aot* a, int msg, int status) {
+    Jit_Buf* buf = &a->rt->buf;
+    if (msg >= 0) {
+        emit_movimm64(buf, HOST_RAX, AOT_SYS_WRITE);
+        emit_movimm64(buf, HOST_RDI, 2);
+        emit_movimm64(buf, HOST_RSI, a->msg_addr[msg]);
+        emit_movimm64(buf, HOST_RDX, strlen(messages[msg]));
+        emit_syscall(buf);
+    }
+    emit_movimm64(buf, HOST_RAX, AOT_SYS_EXIT_GROUP);
+    emit_movimm64(buf, HOST_RDI, (uint64_t)status);
+    emit_syscall(buf);
+}
+
+// Jumps to `fail` unless CPUID reports every extension the translated code executes. Runs before
+// rbx holds the state, cpuid clobbers it.
+static void emit_host_check(const Aot* a, uint8_t** fail, size_t* fail_count) {
+    static const int cpuid_regs[4] = {HOST_RAX, HOST_RBX, HOST_RCX, HOST_RDX};
+    Jit_Buf* buf = &a->rt->buf;
+    for (int i = 0; i < PVCPU_HOST_FEATURE_COUNT; i++) {
+        const PVCpu_Host_Cpuid* f = pvcpu_host_cpuid(i);
+        if (!f->required || !(pvcpu_host_mask(&a->rt->host) & (1u << i))) continue;
+        // Leaves above the highest one return garbage
+        emit_movimm64(buf, HOST_RAX, f->leaf & 0x80000000);
+        emit_u8(buf, 0x0F); // cpuid
+        emit_u8(buf, 0xA2);
+        emit_movimm64(buf, HOST_RCX, f->leaf);
+        emit_op_rr(buf, X86_CMP, HOST_RAX, HOST_RCX);
+        fail[(*fail_count)++] = emit_jcc32(buf, X86_CC_B);
+        emit_movimm64(buf, HOST_RAX, f->leaf);
+        emit_movimm64(buf, HOST_RCX, 0);
+        emit_u8(buf, 0x0F);
+        emit_u8(buf, 0xA2);
+        emit_op_ri(buf, X86_TEST, cpuid_regs[f->reg], (int32_t)(1u << f->bit));
+        fail[(*fail_count)++] = emit_jcc32(buf, X86_CC_E);
+    }
+}
+
+// Process entry: maps guest memory, loads the code and runs the dispatch loop of runtime.c
+// over the entry table. Exit status is 0 when PC leaves the code and 8 on a guest exception.
+static const uint8_t* emit_native_start(const Aot* a, size_t code_size, size_t memsize) {
+    Jit_Buf* buf = &a->rt->buf;
+    const uint8_t* start = jit_pos(buf);
+    uint8_t* no_host[PVCPU_HOST_FEATURE_COUNT * 2];
+    size_t no_host_count = 0;
+    emit_host_check(a, no_host, &no_host_count);
+
+    // Committed by the kernel as the guest touches it, like Guest_Mem
+    emit_movimm64(buf, HOST_RAX, AOT_SYS_MMAP);
+    emit_movimm64(buf, HOST_RDI, 0);
+    emit_movimm64(buf, HOST_RSI, memsize);
+    emit_movimm64(buf, HOST_RDX, 3); // PROT_READ | PROT_WRITE
+    emit_movimm64(buf, HOST_R10, AOT_MMAP_FLAGS);
+    emit_movimm64(buf, HOST_R8, UINT64_MAX);
+    emit_movimm64(buf, HOST_R9, 0);
+    emit_syscall(buf);
+    emit_op_ri(buf, X86_CMP, HOST_RAX, -4095);
+    uint8_t* no_memory = emit_jcc32(buf, X86_CC_AE);
+
+    // Code lives at the bottom of guest memory, the stack grows down from the top
+    emit_mov64(buf, HOST_RDI, HOST_RAX);
+    emit_movimm64(buf, HOST_RSI, AOT_BASE + a->code_off);
+    if (a->rt->host.erms || a->rt->host.fsrm) {
+        emit_movimm64(buf, HOST_RCX, code_size);
+        emit_u8(buf, 0xF3); // rep movsb
+        emit_u8(buf, 0xA4);
+    } else {
+        // Without fast strings byte moves are slow, only the tail goes byte by byte
+        emit_movimm64(buf, HOST_RCX, code_size / 8);
+        emit_u8(buf, 0xF3); // rep movsq
+        emit_u8(buf, 0x48);
+        emit_u8(buf, 0xA5);
+        emit_movimm64(buf, HOST_RCX, code_size % 8);
+        emit_u8(buf, 0xF3); // rep movsb
+        emit_u8(buf, 0xA4);
+    }
+    emit_movimm64(buf, PVCPU_HOST_STATE, AOT_STATE);
+    emit_store64(buf, PVCPU_HOST_STATE, offsetof(PVCpu_State, memory), HOST_RAX);
+    emit_movimm64(buf, HOST_RCX, memsize);
+    emit_store64(buf, PVCPU_HOST_STATE, offsetof(PVCpu_State, memsize), HOST_RCX);
+    emit_store64(buf, PVCPU_HOST_STATE, offsetof(PVCpu_State, regs) + PVCPU_REG_SP * 8, HOST_RCX);
+    emit_store64(buf, PVCPU_HOST_STATE, offsetof(PVCpu_State, regs) + PVCPU_REG_SF * 8, HOST_RCX);
+
+    // Every exit returns here, chained exits never do
+    const uint8_t* loop = jit_pos(buf);
+    emit_load64(buf, HOST_RAX, PVCPU_HOST_STATE, offsetof(PVCpu_State, regs) + PVCPU_REG_PC * 8);
+    emit_movimm64(buf, HOST_RCX, code_size);
+    emit_op_rr(buf, X86_CMP, HOST_RAX, HOST_RCX);
+    uint8_t* halt = emit_jcc32(buf, X86_CC_AE);
+    emit_movimm64(buf, HOST_RCX, AOT_BASE + a->table_off);
+    emit_op_rm(buf, X86_MOV, HOST_RAX, x86_mem_indexed(HOST_RCX, HOST_RAX, 3, 0));
+    emit_op_rr(buf, X86_TEST, HOST_RAX, HOST_RAX);
+    uint8_t* missing = emit_jcc32(buf, X86_CC_E);
+    emit_mov64(buf, HOST_RDI, PVCPU_HOST_STATE);
+    emit_call_reg(buf, HOST_RAX);
+    emit_op_mi(buf, X86_CMP, 4, x86_mem(PVCPU_HOST_STATE, offsetof(PVCpu_State, exit_reason)), PVCPU_EXIT_NONE);
+    jit_patch_rel32(buf, emit_jcc32(buf, X86_CC_E), loop);
+    emit_native_exit(a, AOT_MSG_EXCEPTION, 8);
+
+    jit_patch_rel32(buf, halt, jit_pos(buf));
+    emit_native_exit(a, -1, 0);
+    jit_patch_rel32(buf, missing, jit_pos(buf));
+    emit_native_exit(a, AOT_MSG_MISSING, 9);
+    jit_patch_rel32(buf, no_memory, jit_pos(buf));
+    emit_native_exit(a, AOT_MSG_MEMORY, 9);
+    if (no_host_count > 0) {
+        for (size_t i = 0; i < no_host_count; i++) {
+            jit_patch_rel32(buf, no_host[i], jit_pos(buf));
+        }
+        emit_native_exit(a, AOT_MSG_HOST, 9);
+    }
+    return start;
+}
+
+#define AOT_SEEN 1 // Queued for translation
+#define AOT_NEEDED 2 // Control reaches it: the entry, a static exit target or the return address of a call
+
+// Whether the interpreted block ends in a CALL, a RET continues at its end. Only valid before the
+// translation is installed, that frees the threaded code.
+static bool ends_in_call(const PVCpu_Block* block) {
+    const PVCpu_Interp_Inst* last = NULL;
+    for (const PVCpu_Interp_Inst* op = block->insts; op->pc != block->end; op++) last = op;
+    return last != NULL && last->opcode == OP_CALL;
+}
+
+// Guest address of the instruction after the one at `pc`. One that does not decode is skipped 4 bytes
+// at a time, every encoding is a multiple of that.
+static uint64_t next_inst(const PVCpu_Runtime* rt, uint64_t pc) {
+    PVCpu_Inst inst;
+    uint64_t value = 0;
+    uint64_t extflags[PVCPU_MAX_EXTFLAGS];
+    int extflag_count = 0;
+    size_t size = pvcpu_unpack_inst(rt->state.memory + pc, rt->code_size - pc, &inst, &value, extflags, &extflag_count);
+    return pc + (size ? size : 4);
+}
+
+// Translates a block starting at every instruction boundary of a linear sweep from address 0 and at
+// every static exit target, so computed jumps, returns to rewritten addresses and functions only ever
+// reached through registers all find native code. Goes breadth first: the blocks found in one round
+// are compiled together on the worker threads, then installed one after the other and their
+// successors make up the next round. False on allocation failure or when code control reaches has no
+// native code.
+static bool translate_all(Aot* a, size_t code_size) {
+    PVCpu_Runtime* rt = a->rt;
+    uint8_t* seen = calloc(code_size ? code_size : 1, 1);
+    size_t cap = 256;
+    size_t count = 0;
+    uint64_t* work = malloc(cap * sizeof(uint64_t));
+    PVCpu_Block** blocks = malloc(cap * sizeof(PVCpu_Block*));
+    Jit_Job** jobs = malloc(cap * sizeof(Jit_Job*));
+    bool ok = seen != NULL && work != NULL && blocks != NULL && jobs != NULL;
+    if (ok) {
+        work[count++] = 0;
+        if (code_size > 0) seen[0] = AOT_NEEDED;
+    }
+
+    while (ok && count > 0) {
+        size_t round = 0;
+        for (size_t i = 0; i < count && ok; i++) {
+            uint64_t pc = work[i];
+            if (pc >= code_size || (seen[pc] & AOT_SEEN)) continue;
+            seen[pc] |= AOT_SEEN;
+            blocks[round] = pvcpu_new_block(rt, pc);
+            jobs[round] = blocks[round] != NULL ? pvcpu_job_new(rt, blocks[round]) : NULL;
+            ok = jobs[round] != NULL;
+            if (ok && blocks[round]->end < code_size && ends_in_call(blocks[round])) seen[blocks[round]->end] |= AOT_NEEDED;
+            if (ok) round++;
+        }
+        ok = ok && pvcpu_pool_compile(rt, jobs, round);
+        for (size_t i = 0; i < round; i++) {
+            if (!text_room(a) || !pvcpu_job_install(rt, jobs[i])) ok = false;
+        }
+        if (!ok) break;
+
+        // Every block queues at most its second instruction, its end and its exits
+        count = 0;
+        if (round * (2 + PVCPU_BLOCK_MAX_EXITS) > cap) {
+            cap = round * (2 + PVCPU_BLOCK_MAX_EXITS);
+            uint64_t* grown = realloc(work, cap * sizeof(uint64_t));
+            if (grown != NULL) work = grown;
+            PVCpu_Block** grown_blocks = realloc(blocks, cap * sizeof(PVCpu_Block*));
+            if (grown_blocks != NULL) blocks = grown_blocks;
+            Jit_Job** grown_jobs = realloc(jobs, cap * sizeof(Jit_Job*));
+            if (grown_jobs != NULL) jobs = grown_jobs;
+            ok = grown != NULL && grown_blocks != NULL && grown_jobs != NULL;
+        }
+        for (size_t i = 0; i < round && ok; i++) {
+            PVCpu_Block* block = blocks[i];
+            work[count++] = next_inst(rt, block->pc);
+            work[count++] = block->end;
+            if (block->tier != PVCPU_TIER_JIT) continue;
+            for (uint32_t e = 0; e < block->exit_count; e++) {
+                uint64_t target = block->exits[e].target;
+                if (target < code_size) seen[target] |= AOT_NEEDED;
+                work[count++] = target;
+            }
+        }
+    }
+
+    // Code only the sweep found may as well be data, the rest has to run natively
+    size_t untranslated = 0;
+    uint64_t first = 0;
+    for (uint64_t pc = 0; ok && pc < code_size; pc++) {
+        if (!(seen[pc] & AOT_SEEN)) continue;
+        PVCpu_Block* block = tc_lookup(&rt->tc, pc);
+        if (block == NULL || block->tier == PVCPU_TIER_JIT) continue;
+        if (seen[pc] & AOT_NEEDED) {
+            fprintf(stderr, "Error: Block at 0x%llx has no native code!\n", (unsigned long long)pc);
+            ok = false;
+        } else if (untranslated++ == 0) {
+            first = pc;
+        }
+    }
+    if (ok && untranslated > 0) {
+        fprintf(stderr, "Warning: %zu blocks from 0x%llx on have no native code, the program stops if it jumps into one\n", untranslated, (unsigned long long)first);
+    }
+
+    free(seen);
+    free(work);
+    free(blocks);
+    free(jobs);
+    return ok;
+}
+
+// Points the absolute addresses at the native helpers, chains every exit with a translated target
+// and fills the entry table. Exit records are only used for linking at runtime, they stay NULL.
+static void link_all(Aot* a) {
+    PVCpu_Runtime* rt = a->rt;
+    uint64_t* table = (uint64_t*)(a->image + a->table_off);
+    for (size_t i = 0; i < rt->tc.cap; i++) {
+        PVCpu_Block* block = rt->tc.slots[i];
+        if (block == NULL || block->tier != PVCPU_TIER_JIT) continue;
+
+        uint8_t* code = cc_rw(&a->cc, block->code);
+        for (uint32_t r = 0; r < block->reloc_count; r++) {
+            const PVCpu_Reloc* rel = &block->relocs[r];
+            uint64_t value = 0;
+            if (rel->kind <= PVCPU_RELOC_HELPER_RAISE) value = (uint64_t)(uintptr_t)a->helpers[rel->kind];
+            else if (rel->kind == PVCPU_RELOC_FLAGS_STUB) value = (uint64_t)(uintptr_t)rt->flags_stub;
+            memcpy(code + rel->offset, &value, 8);
+        }
+        for (uint32_t e = 0; e < block->exit_count; e++) {
+            PVCpu_Block* target = tc_lookup(&rt->tc, block->exits[e].target);
+            if (target != NULL && target->tier == PVCPU_TIER_JIT) jit_patch_rel32(&rt->buf, block->exits[e].site, target->body);
+        }
+        table[block->pc] = (uint64_t)(uintptr_t)block->code;
+    }
+}
+
+static bool write_image(const Aot* a, size_t size, const uint8_t* entry, const char* out) {
+    Elf64_Ehdr* eh = (Elf64_Ehdr*)a->image;
+    memset(eh, 0, sizeof(Elf64_Ehdr));
+    memcpy(eh->e_ident, ELFMAG, SELFMAG);
+    eh->e_ident[EI_CLASS] = ELFCLASS64;
+    eh->e_ident[EI_DATA] = ELFDATA2LSB;
+    eh->e_ident[EI_VERSION] = EV_CURRENT;
+    eh->e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    eh->e_type = ET_EXEC;
+    eh->e_machine = EM_X86_64;
+    eh->e_version = EV_CURRENT;
+    eh->e_entry = (Elf64_Addr)(uintptr_t)entry;
+    eh->e_phoff = sizeof(Elf64_Ehdr);
+    eh->e_ehsize = sizeof(Elf64_Ehdr);
+    eh->e_phentsize = sizeof(Elf64_Phdr);
+    eh->e_phnum = AOT_PHNUM;
+
+    Elf64_Phdr* ph = (Elf64_Phdr*)(a->image + sizeof(Elf64_Ehdr));
+    memset(ph, 0, AOT_PHNUM * sizeof(Elf64_Phdr));
+    ph[0].p_type = PT_LOAD;
+    ph[0].p_flags = PF_R | PF_X;
+    ph[0].p_vaddr = ph[0].p_paddr = AOT_BASE;
+    ph[0].p_filesz = ph[0].p_memsz = size;
+    ph[0].p_align = 0x1000;
+    ph[1].p_type = PT_LOAD;
+    ph[1].p_flags = PF_R | PF_W;
+    ph[1].p_vaddr = ph[1].p_paddr = AOT_STATE;
+    ph[1].p_memsz = sizeof(PVCpu_State);
+    ph[1].p_align = 0x1000;
+    ph[2].p_type = PT_GNU_STACK;
+    ph[2].p_flags = PF_R | PF_W;
+
+    FILE* f = fopen(out, "wb");
+    if (f == NULL) return false;
+    bool ok = fwrite(a->image, 1, size, f) == size;
+    if (fclose(f) != 0) ok = false;
+    #ifndef _WIN32
+        if (ok) ok = chmod(out, 0755) == 0;
+    #endif
+    return ok;
+}
+
+int pvcpu_aot(const uint8_t* code, size_t code_size, const PVCpu_Config* config, const char* out) {
+    #ifndef __x86_64__
+        (void)code;
+        (void)code_size;
+        (void)config;
+        (void)out;
+        fprintf(stderr, "Error: Ahead of time compilation needs an x86-64 host!\n");
+        return 9;
+    #else
+    ir_init();
+    pvcpu_interp_init();
+    size_t memsize = config->memsize;
+    if (code_size > memsize) {
+        fprintf(stderr, "Error: Program (%zu bytes) does not fit into guest memory (%zu bytes)!\n", code_size, memsize);
+        return 9;
+    }
+
+    Aot a;
+    memset(&a, 0, sizeof(a));
+    size_t off = sizeof(Elf64_Ehdr) + AOT_PHNUM * sizeof(Elf64_Phdr);
+    for (int i = 0; i < AOT_MSG_COUNT; i++) {
+        a.msg_addr[i] = AOT_BASE + off;
+        off += strlen(messages[i]);
+    }
+    a.code_off = align_up(off, 8);
+    a.table_off = align_up(a.code_off + code_size, 8);
+    a.text_off = align_up(a.table_off + code_size * 8, PVCPU_CC_ALIGN);
+    a.cap = a.text_off + 2 * AOT_HEADROOM;
+    a.image = calloc(1, a.cap);
+    a.rt = calloc(1, sizeof(PVCpu_Runtime));
+    if (a.image == NULL || a.rt == NULL || !tc_init(&a.rt->tc, PVCPU_TC_INITIAL)) {
+        perror("Error: Memory allocation failed!");
+        free(a.image);
+        free(a.rt);
+        return 9;
+    }
+    for (int i = 0; i < AOT_MSG_COUNT; i++) {
+        memcpy(a.image + (a.msg_addr[i] - AOT_BASE), messages[i], strlen(messages[i]));
+    }
+    memcpy(a.image + a.code_off, code, code_size);
+
+    // Translation reads the guest code straight from the image and emits at the native addresses.
+    // Without a guard zone every access keeps its bounds check.
+    PVCpu_Runtime* rt = a.rt;
+    rt->state.memory = a.image + a.code_off;
+    rt->state.memsize = memsize;
+    rt->code_size = code_size;
+    rt->host = config->host;
+    rt->keep_relocs = true;
+    a.cc.rw = a.image + a.text_off;
+    a.cc.rx = (uint8_t*)(uintptr_t)(AOT_BASE + a.text_off);
+    rt->buf.cc = &a.cc;
+    rt->buf.data = a.cc.rw;
+    rt->buf.exec = a.cc.rx;
+    rt->buf.capacity = a.cap - a.text_off;
+
+    int ret = 0;
+    Jit_Buf* buf = &rt->buf;
+    a.helpers[PVCPU_RELOC_HELPER_RAISE] = jit_pos(buf);
+    emit_native_raise(buf);
+    a.helpers[PVCPU_RELOC_HELPER_CALL] = jit_pos(buf);
+    emit_native_call(buf, a.helpers[PVCPU_RELOC_HELPER_RAISE]);
+    a.helpers[PVCPU_RELOC_HELPER_RET] = jit_pos(buf);
+    emit_native_ret(buf, a.helpers[PVCPU_RELOC_HELPER_RAISE]);
+
+    pvcpu_pool_start(rt, config->jit_threads ? config->jit_threads : pvcpu_jit_threads());
+    if (pvcpu_flags_stub(rt) == NULL || !translate_all(&a, code_size) || !text_room(&a)) {
+        fprintf(stderr, "Error: Translation failed!\n");
+        ret = 9;
+    } else {
+        link_all(&a);
+        const uint8_t* entry = emit_native_start(&a, code_size, memsize);
+        if (!write_image(&a, a.text_off + buf->size, entry, out)) {
+            fprintf(stderr, "Error: Could not write [%s]\n", out);
+            ret = 4;
+        }
+    }
+
+    pvcpu_pool_stop(rt);
+    tc_destroy(&rt->tc);
+    free(rt);
+    free(a.image);
+    return ret;
+    #endif
+}
@@ -0,0 +1,133 @@
+// Author: Pheonix Studios/AkshuDev
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <pvcpu-codecache.h>
+
+static size_t page_size() {
+    #ifdef _WIN32
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        return si.dwPageSize;
+    #else
+        return (size_t)sysconf(_SC_PAGESIZE);
+    #endif
+}
+
+// Flips the committed range, `sealed` only follows when the protection actually changed
+static bool set_exec(Code_Cache* cc, bool exec) {
+    if (cc->committed == 0) return true;
+    #ifdef _WIN32
+        DWORD old;
+        if (!VirtualProtect(cc->rx, cc->committed, exec ? PAGE_EXECUTE_READ : PAGE_READWRITE, &old)) return false;
+        if (exec) FlushInstructionCache(GetCurrentProcess(), cc->rx, cc->committed);
+    #else
+        if (mprotect(cc->rx, cc->committed, exec ? (PROT_READ | PROT_EXEC) : (PROT_READ | PROT_WRITE)) != 0) return false;
+    #endif
+    cc->sealed = exec;
+    return true;
+}
+
+bool cc_init(Code_Cache* cc, size_t reserve) {
+    memset(cc, 0, sizeof(Code_Cache));
+    cc->fd = -1;
+    cc->slab = page_size() * PVCPU_CC_SLAB_PAGES;
+    cc->reserved = (reserve + cc->slab - 1) / cc->slab * cc->slab;
+
+    #ifdef _WIN32
+        cc->rw = (uint8_t*)VirtualAlloc(NULL, cc->reserved, MEM_RESERVE, PAGE_NOACCESS);
+        if (cc->rw == NULL) return false;
+        cc->rx = cc->rw;
+    #else
+        void* rx = mmap(NULL, cc->reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (rx == MAP_FAILED) return false;
+        cc->rx = (uint8_t*)rx;
+
+        #ifdef __linux__
+            cc->fd = memfd_create("pvcpu-code", MFD_CLOEXEC);
+        #endif
+        if (cc->fd >= 0) {
+            void* rw = mmap(NULL, cc->reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (rw == MAP_FAILED) {
+                close(cc->fd);
+                cc->fd = -1;
+                cc->rw = cc->rx;
+            } else {
+                cc->rw = (uint8_t*)rw;
+            }
+        } else {
+            cc->rw = cc->rx;
+        }
+    #endif
+    return true;
+}
+
+void cc_destroy(Code_Cache* cc) {
+    #ifdef _WIN32
+        if (cc->rx) VirtualFree(cc->rx, 0, MEM_RELEASE);
+    #else
+        if (cc->rx) munmap(cc->rx, cc->reserved);
+        if (cc->rw && cc->rw != cc->rx) munmap(cc->rw, cc->reserved);
+        if (cc->fd >= 0) close(cc->fd);
+    #endif
+    memset(cc, 0, sizeof(Code_Cache));
+    cc->fd = -1;
+}
+
+static bool commit_slab(Code_Cache* cc) {
+    if (cc->committed + cc->slab > cc->reserved) return false;
+    size_t off = cc->committed;
+
+    #ifdef _WIN32
+        if (VirtualAlloc(cc->rx + off, cc->slab, MEM_COMMIT, PAGE_READWRITE) == NULL) return false;
+    #else
+        if (cc->fd >= 0) {
+            if (ftruncate(cc->fd, (off_t)(off + cc->slab)) != 0) return false;
+            if (mmap(cc->rw + off, cc->slab, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, cc->fd, (off_t)off) == MAP_FAILED) return false;
+            if (mmap(cc->rx + off, cc->slab, PROT_READ | PROT_EXEC, MAP_SHARED | MAP_FIXED, cc->fd, (off_t)off) == MAP_FAILED) return false;
+        } else {
+            if (mprotect(cc->rx + off, cc->slab, PROT_READ | PROT_WRITE) != 0) return false;
+        }
+    #endif
+
+    cc->committed += cc->slab;
+    return true;
+}
+
+bool cc_begin_write(Code_Cache* cc) {
+    if (cc->fd < 0 && cc->sealed) return set_exec(cc, false);
+    return true;
+}
+
+uint8_t* cc_alloc(Code_Cache* cc, size_t size) {
+    size_t start = (cc->used + PVCPU_CC_ALIGN - 1) & ~(size_t)(PVCPU_CC_ALIGN - 1);
+    if (!cc_begin_write(cc)) return NULL;
+    while (start + size > cc->committed) {
+        if (!commit_slab(cc)) return NULL;
+    }
+    cc->used = start + size;
+    return cc->rx + start;
+}
+
+bool cc_publish(Code_Cache* cc) {
+    if (cc->fd < 0) {
+        if (!cc->sealed && !set_exec(cc, true)) return false;
+    } else {
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __builtin___clear_cache((char*)cc->rx + cc->published, (char*)cc->rx + cc->used);
+    }
+    cc->published = cc->used;
+    return true;
+}
@@ -0,0 +1,373 @@
+// Author: Pheonix Studios/AkshuDev
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <pvcpu-runtime.h>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <cpuid.h>
+#endif
+
+// Cache file layout, all host endian:
+//   Dc_Header
+//   block_count times: Dc_Block, exits, relocations, guard sites, code, zero padding to 8 bytes
+#define DC_MAGIC 0x43545650u // "PVTC"
+#define DC_VERSION 5 // Bump whenever translated code or the layout below changes
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    uint64_t block_count;
+} Dc_Header;
+
+typedef struct {
+    uint64_t pc;
+    uint64_t end;
+    uint64_t span_start;
+    uint64_t span_end;
+    uint32_t inst_count;
+    uint32_t fault;
+    uint32_t code_size;
+    uint32_t body; // Offsets below are all from the block entry
+    uint32_t exit_count;
+    uint32_t reloc_count;
+    uint32_t site_count;
+    uint32_t align; // Entry address modulo PVCPU_CC_ALIGN, chain exits rely on it
+} Dc_Block;
+
+typedef struct {
+    uint32_t site;
+    uint32_t stub;
+    uint64_t target;
+} Dc_Exit;
+
+typedef struct {
+    uint32_t site;
+    uint32_t pad;
+} Dc_Site;
+
+static uint64_t fnv1a(uint64_t h, const void* data, size_t size) {
+    const uint8_t* p = (const uint8_t*)data;
+    for (size_t i = 0; i < size; i++) {
+        h ^= p[i];
+        h *= 0x100000001B3ull;
+    }
+    return h;
+}
+
+// Code section plus everything the translation of it depends on: runtime version,
+// state layout, guest memory layout, trace formation, fuel metering and the host CPU
+static uint64_t dc_key(const PVCpu_Runtime* rt) {
+    uint64_t h = 0xCBF29CE484222325ull;
+    h = fnv1a(h, rt->state.memory, rt->code_size);
+
+    // Code generated for other host features may not run here, or not as well
+    uint64_t env[10] = {
+        DC_VERSION,
+        sizeof(PVCpu_State),
+        rt->state.memsize,
+        rt->code_size,
+        rt->traces,
+        rt->fuel,
+        rt->mem.guarded,
+        rt->mem.span_shift,
+        pvcpu_host_mask(&rt->host),
+        0,
+    };
+    #if defined(__x86_64__) && defined(__GNUC__)
+        unsigned int a, b, c, d;
+        if (__get_cpuid(1, &a, &b, &c, &d)) env[9] = (uint64_t)c << 32 | d;
+    #endif
+    return fnv1a(h, env, sizeof(env));
+}
+
+static char* dc_path(const PVCpu_Runtime* rt, const char* suffix) {
+    size_t len = strlen(rt->cache_dir) + 48;
+    char* path = malloc(len);
+    if (path != NULL) snprintf(path, len, "%s/%016llx.pvtc%s", rt->cache_dir, (unsigned long long)rt->cache_key, suffix);
+    return path;
+}
+
+static bool read_at(const uint8_t* data, size_t size, size_t* off, void* out, size_t len) {
+    if (len > size - *off) return false;
+    memcpy(out, data + *off, len);
+    *off += len;
+    return true;
+}
+
+// Copies one block record into the code cache, false when the record is damaged or the cache is full
+static bool load_block(PVCpu_Runtime* rt, const uint8_t* data, size_t size, size_t* off) {
+    Dc_Block rec;
+    if (!read_at(data, size, off, &rec, sizeof(rec))) return false;
+    if (rec.code_size < 8 || rec.body >= rec.code_size || rec.exit_count > PVCPU_BLOCK_MAX_EXITS || rec.align >= PVCPU_CC_ALIGN) return false;
+    if (rec.span_start > rec.pc || rec.span_end < rec.end || rec.span_end > rt->code_size) return false;
+
+    Dc_Exit exits[PVCPU_BLOCK_MAX_EXITS];
+    if (!read_at(data, size, off, exits, rec.exit_count * sizeof(Dc_Exit))) return false;
+    size_t tail = (size_t)rec.reloc_count * sizeof(PVCpu_Reloc) + (size_t)rec.site_count * sizeof(Dc_Site) + rec.code_size;
+    if (tail > size - *off) return false;
+    const uint8_t* relocs = data + *off;
+    const uint8_t* sites = relocs + rec.reloc_count * sizeof(PVCpu_Reloc);
+    const uint8_t* code = sites + rec.site_count * sizeof(Dc_Site);
+    *off += (tail + 7) & ~(size_t)7;
+    if (*off > size) *off = size;
+
+    PVCpu_Block* block = calloc(1, sizeof(PVCpu_Block));
+    PVCpu_Reloc* rel = rec.reloc_count ? malloc(rec.reloc_count * sizeof(PVCpu_Reloc)) : NULL;
+    if (block == NULL || (rec.reloc_count && rel == NULL)) {
+        free(block);
+        free(rel);
+        return false;
+    }
+    if (rec.reloc_count) memcpy(rel, relocs, rec.reloc_count * sizeof(PVCpu_Reloc));
+    for (uint32_t i = 0; i < rec.reloc_count; i++) {
+        bool valid = rel[i].kind <= PVCPU_RELOC_EXIT && (rel[i].kind != PVCPU_RELOC_EXIT || rel[i].arg < rec.exit_count);
+        if (!valid || rel[i].offset > rec.code_size - 8) {
+            free(block);
+            free(rel);
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < rec.exit_count; i++) {
+        if (exits[i].site > rec.code_size - 4 || exits[i].stub >= rec.code_size) {
+            free(block);
+            free(rel);
+            return false;
+        }
+    }
+
+    // Same position relative to the alignment as when it was translated
+    if (!jit_reserve(&rt->buf, rec.code_size + PVCPU_CC_ALIGN)) {
+        free(block);
+        free(rel);
+        return false;
+    }
+    size_t skip = (rec.align - (uintptr_t)jit_pos(&rt->buf)) & (PVCPU_CC_ALIGN - 1);
+    memset(rt->buf.data + rt->buf.size, 0x90, skip); // nop
+    rt->buf.size += skip;
+    uint8_t* entry = jit_pos(&rt->buf);
+    uint8_t* out = rt->buf.data + rt->buf.size;
+    memcpy(out, code, rec.code_size);
+    rt->buf.size += rec.code_size;
+
+    block->pc = rec.pc;
+    block->end = rec.end;
+    block->span_start = rec.span_start;
+    block->span_end = rec.span_end;
+    block->code = entry;
+    block->body = entry + rec.body;
+    block->code_size = rec.code_size;
+    block->inst_count = rec.inst_count;
+    block->fault = rec.fault;
+    block->tier = PVCPU_TIER_JIT;
+    block->exit_count = rec.exit_count;
+    for (uint32_t i = 0; i < rec.exit_count; i++) {
+        block->exits[i].site = entry + exits[i].site;
+        block->exits[i].stub = entry + exits[i].stub;
+        block->exits[i].target = exits[i].target;
+        block->exits[i].block = block;
+    }
+    block->relocs = rel;
+    block->reloc_count = rec.reloc_count;
+
+    for (uint32_t i = 0; i < rec.reloc_count; i++) {
+        const void* target;
+        switch (rel[i].kind) {
+            case PVCPU_RELOC_FLAGS_STUB: target = rt->flags_stub; break;
+            case PVCPU_RELOC_EXIT: target = &block->exits[rel[i].arg]; break;
+            default: target = pvcpu_helper(rel[i].kind); break;
+        }
+        uint64_t imm = (uint64_t)(uintptr_t)target;
+        memcpy(out + rel[i].offset, &imm, 8);
+    }
+
+    bool ok = true;
+    for (uint32_t i = 0; ok && i < rec.site_count; i++) {
+        Dc_Site s;
+        memcpy(&s, sites + i * sizeof(Dc_Site), sizeof(s));
+        ok = s.site < rec.code_size && s.pad < rec.code_size && gm_add_site(&rt->mem, entry + s.site, entry + s.pad);
+    }
+    if (!ok || !tc_insert(&rt->tc, block)) {
+        free(rel);
+        free(block);
+        return false;
+    }
+    gm_protect_code(&rt->mem, block->span_start, block->span_end);
+    return true;
+}
+
+bool dc_load(PVCpu_Runtime* rt) {
+    rt->cache_key = dc_key(rt);
+    char* path = dc_path(rt, "");
+    if (path == NULL) return true;
+
+    // Mapped rather than read, only the pages the blocks occupy are ever touched
+    const uint8_t* data = NULL;
+    size_t size = 0;
+    #ifndef _WIN32
+        int fd = open(path, O_RDONLY);
+        free(path);
+        if (fd < 0) return true;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            size = (size_t)st.st_size;
+            void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            data = map != MAP_FAILED ? (const uint8_t*)map : NULL;
+        }
+        close(fd);
+    #else
+        FILE* f = fopen(path, "rb");
+        free(path);
+        if (f == NULL) return true;
+        if (fseek(f, 0, SEEK_END) == 0) {
+            long len = ftell(f);
+            uint8_t* buf = len > 0 ? malloc((size_t)len) : NULL;
+            if (buf != NULL && fseek(f, 0, SEEK_SET) == 0 && fread(buf, 1, (size_t)len, f) == (size_t)len) {
+                data = buf;
+                size = (size_t)len;
+            } else {
+                free(buf);
+            }
+        }
+        fclose(f);
+    #endif
+    if (data == NULL) return true;
+
+    Dc_Header hdr;
+    size_t off = 0;
+    bool valid = read_at(data, size, &off, &hdr, sizeof(hdr)) && hdr.magic == DC_MAGIC && hdr.version == DC_VERSION && hdr.key == rt->cache_key;
+    bool ok = cc_begin_write(&rt->cache);
+    if (ok && valid && hdr.block_count > 0 && pvcpu_flags_stub(rt) != NULL) {
+        // Blocks already loaded stay, a damaged record just ends the load early and the file is rewritten
+        for (uint64_t i = 0; i < hdr.block_count && !rt->cache_dirty; i++) {
+            if (!load_block(rt, data, size, &off)) rt->cache_dirty = true;
+        }
+    }
+    if (ok) ok = cc_publish(&rt->cache);
+
+    #ifndef _WIN32
+        munmap((void*)data, size);
+    #else
+        free((void*)data);
+    #endif
+    return ok;
+}
+
+// First guard site at or after `at`
+static size_t first_site(const Guest_Mem* gm, const uint8_t* at) {
+    size_t lo = 0;
+    size_t hi = gm->site_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (gm->sites[mid].site < at) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static bool save_block(const PVCpu_Runtime* rt, const PVCpu_Block* block, FILE* f) {
+    const Guest_Mem* gm = &rt->mem;
+    const uint8_t* code = block->code;
+    size_t first = first_site(gm, code);
+    size_t last = first_site(gm, code + block->code_size);
+
+    Dc_Block rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.pc = block->pc;
+    rec.end = block->end;
+    rec.span_start = block->span_start;
+    rec.span_end = block->span_end;
+    rec.inst_count = block->inst_count;
+    rec.fault = block->fault;
+    rec.code_size = (uint32_t)block->code_size;
+    rec.body = (uint32_t)(block->body - code);
+    rec.exit_count = block->exit_count;
+    rec.reloc_count = block->reloc_count;
+    rec.site_count = (uint32_t)(last - first);
+    rec.align = (uint32_t)((uintptr_t)code & (PVCPU_CC_ALIGN - 1));
+    bool ok = fwrite(&rec, sizeof(rec), 1, f) == 1;
+
+    for (uint32_t i = 0; ok && i < block->exit_count; i++) {
+        const PVCpu_Block_Exit* e = &block->exits[i];
+        Dc_Exit de = {(uint32_t)(e->site - code), (uint32_t)(e->stub - code), e->target};
+        ok = fwrite(&de, sizeof(de), 1, f) == 1;
+    }
+    if (ok && block->reloc_count) ok = fwrite(block->relocs, sizeof(PVCpu_Reloc), block->reloc_count, f) == block->reloc_count;
+    for (size_t i = first; ok && i < last; i++) {
+        Dc_Site s = {(uint32_t)(gm->sites[i].site - code), (uint32_t)(gm->sites[i].pad - code)};
+        ok = fwrite(&s, sizeof(s), 1, f) == 1;
+    }
+    if (!ok) return false;
+
+    // Chained exits are stored unlinked, the next run links them against its own blocks
+    uint8_t* copy = malloc(block->code_size);
+    if (copy == NULL) return false;
+    memcpy(copy, cc_rw(&rt->cache, code), block->code_size);
+    for (uint32_t i = 0; i < block->exit_count; i++) {
+        const PVCpu_Block_Exit* e = &block->exits[i];
+        int32_t rel = (int32_t)(e->stub - (e->site + 4));
+        memcpy(copy + (e->site - code), &rel, 4);
+    }
+    static const uint8_t zero[8];
+    ok = fwrite(copy, 1, block->code_size, f) == block->code_size;
+    if (ok && (block->code_size & 7)) ok = fwrite(zero, 1, 8 - (block->code_size & 7), f) == 8 - (block->code_size & 7);
+    free(copy);
+    return ok;
+}
+
+// Translated from the code as loaded, which the key covers, and not from code the guest wrote
+static bool persistent(const PVCpu_Runtime* rt, const PVCpu_Block* b) {
+    return b != NULL && b->tier == PVCPU_TIER_JIT && gm_code_writes(&rt->mem, b->span_start, b->span_end) == 0;
+}
+
+bool dc_save(PVCpu_Runtime* rt) {
+    // The file already holds exactly what is translated
+    if (!rt->cache_dirty) return true;
+    uint64_t count = 0;
+    for (size_t i = 0; i < rt->tc.cap; i++) {
+        if (persistent(rt, rt->tc.slots[i])) count++;
+    }
+
+    // Written next to the old file and renamed over it, concurrent runs never see a partial file
+    char suffix[32];
+    #ifdef _WIN32
+        snprintf(suffix, sizeof(suffix), ".%d.tmp", _getpid());
+    #else
+        mkdir(rt->cache_dir, 0755);
+        snprintf(suffix, sizeof(suffix), ".%d.tmp", (int)getpid());
+    #endif
+    char* path = dc_path(rt, "");
+    char* temp = dc_path(rt, suffix);
+    FILE* f = temp != NULL ? fopen(temp, "wb") : NULL;
+    bool ok = path != NULL && f != NULL;
+
+    Dc_Header hdr = {DC_MAGIC, DC_VERSION, rt->cache_key, count};
+    if (ok) ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    for (size_t i = 0; ok && i < rt->tc.cap; i++) {
+        if (persistent(rt, rt->tc.slots[i])) ok = save_block(rt, rt->tc.slots[i], f);
+    }
+    if (f != NULL && fclose(f) != 0) ok = false;
+    if (ok) {
+        #ifdef _WIN32
+            remove(path);
+        #endif
+        ok = rename(temp, path) == 0;
+    }
+    if (!ok && f != NULL) remove(temp);
+
+    free(path);
+    free(temp);
+    return ok;
+}
@@ -0,0 +1,226 @@
+// Author: Pheonix Studios/AkshuDev
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <pvcpu-guestmem.h>
+
+#ifdef PVCPU_GUARD_PAGES
+#include <signal.h>
+#include <ucontext.h>
+#endif
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+bool gm_init(Guest_Mem* gm, size_t memsize) {
+    memset(gm, 0, sizeof(Guest_Mem));
+    gm->memsize = memsize;
+
+    #ifndef _WIN32
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        gm->page_size = page;
+        size_t committed = (memsize + page - 1) / page * page;
+        size_t reserved = committed;
+        #ifdef PVCPU_GUARD_PAGES
+            int shift = PVCPU_GUARD_MIN_SHIFT;
+            while (shift < 62 && (1ull << shift) < memsize) shift++;
+            // An 8 byte access at the last address below the span still has to land in the reservation
+            reserved += (1ull << shift) + page;
+        #endif
+        void* base = mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base != MAP_FAILED) {
+            if (committed == 0 || mprotect(base, committed, PROT_READ | PROT_WRITE) == 0) {
+                gm->base = (uint8_t*)base;
+                gm->reserved = reserved;
+                // Guest memory ends right where the guard zone starts
+                gm->memory = gm->base + (committed - memsize);
+                #ifdef PVCPU_GUARD_PAGES
+                    gm->guarded = true;
+                    gm->span_shift = (uint8_t)shift;
+                #endif
+                return true;
+            }
+            munmap(base, reserved);
+        }
+    #endif
+
+    gm->memory = (uint8_t*)calloc(1, memsize ? memsize : 1);
+    return gm->memory != NULL;
+}
+
+void gm_destroy(Guest_Mem* gm) {
+    #ifndef _WIN32
+        if (gm->base != NULL) munmap(gm->base, gm->reserved);
+        else free(gm->memory);
+    #else
+        free(gm->memory);
+    #endif
+    free(gm->sites);
+    free(gm->code_pages);
+    memset(gm, 0, sizeof(Guest_Mem));
+}
+
+bool gm_add_site(Guest_Mem* gm, const uint8_t* site, const uint8_t* pad) {
+    if (gm->site_count == gm->site_cap) {
+        size_t cap = gm->site_cap ? gm->site_cap * 2 : 256;
+        Guard_Site* sites = realloc(gm->sites, cap * sizeof(Guard_Site));
+        if (sites == NULL) return false;
+        gm->sites = sites;
+        gm->site_cap = cap;
+    }
+    gm->sites[gm->site_count].site = site;
+    gm->sites[gm->site_count].pad = pad;
+    gm->site_count++;
+    return true;
+}
+
+bool gm_watch_code(Guest_Mem* gm, size_t code_size) {
+    #ifdef PVCPU_GUARD_PAGES
+        if (!gm->guarded || code_size == 0) return true;
+        gm->code_base = (uint8_t*)((uintptr_t)gm->memory & ~(uintptr_t)(gm->page_size - 1));
+        gm->code_page_count = (size_t)(gm->memory + code_size - gm->code_base + gm->page_size - 1) / gm->page_size;
+        gm->code_pages = calloc(gm->code_page_count, sizeof(Code_Page));
+        return gm->code_pages != NULL;
+    #else
+        (void)gm;
+        (void)code_size;
+        return true;
+    #endif
+}
+
+// Code pages holding guest [start, end) are [*first, *last), false when there are none
+static bool code_page_range(const Guest_Mem* gm, uint64_t start, uint64_t end, size_t* first, size_t* last) {
+    if (gm->code_pages == NULL || start >= end) return false;
+    size_t offset = (size_t)(gm->memory - gm->code_base);
+    *first = (size_t)((start + offset) / gm->page_size);
+    *last = (size_t)((end - 1 + offset) / gm->page_size) + 1;
+    if (*last > gm->code_page_count) *last = gm->code_page_count;
+    return *first < *last;
+}
+
+void gm_protect_code(Guest_Mem* gm, uint64_t start, uint64_t end) {
+    size_t first, last;
+    if (!code_page_range(gm, start, end, &first, &last)) return;
+    #ifndef _WIN32
+        for (size_t i = first; i < last; i++) {
+            Code_Page* p = &gm->code_pages[i];
+            if (p->protected || p->writes >= PVCPU_CODE_WRITES_MAX) continue;
+            if (mprotect(gm->code_base + i * gm->page_size, gm->page_size, PROT_READ) == 0) p->protected = true;
+        }
+    #endif
+}
+
+uint8_t gm_code_writes(const Guest_Mem* gm, uint64_t start, uint64_t end) {
+    size_t first, last;
+    uint8_t most = 0;
+    if (!code_page_range(gm, start, end, &first, &last)) return 0;
+    for (size_t i = first; i < last; i++) {
+        if (gm->code_pages[i].writes > most) most = gm->code_pages[i].writes;
+    }
+    return most;
+}
+
+bool gm_next_written(Guest_Mem* gm, uint64_t* start, uint64_t* end) {
+    gm->written = false;
+    for (size_t i = 0; i < gm->code_page_count; i++) {
+        if (!gm->code_pages[i].written) continue;
+        gm->code_pages[i].written = false;
+        // The first page may start below guest address 0
+        size_t offset = (size_t)(gm->memory - gm->code_base);
+        *start = i * gm->page_size > offset ? i * gm->page_size - offset : 0;
+        *end = (i + 1) * gm->page_size - offset;
+        return true;
+    }
+    return false;
+}
+
+#ifdef PVCPU_GUARD_PAGES
+static Guest_Mem* catching;
+static const int caught[] = {SIGSEGV, SIGBUS, SIGFPE};
+#define CAUGHT_COUNT (sizeof(caught) / sizeof(caught[0]))
+static struct sigaction previous[CAUGHT_COUNT];
+
+static const uint8_t* find_pad(const Guest_Mem* gm, const uint8_t* site) {
+    size_t lo = 0;
+    size_t hi = gm->site_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (gm->sites[mid].site < site) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < gm->site_count && gm->sites[lo].site == site ? gm->sites[lo].pad : NULL;
+}
+
+// A write to a protected code page, which is made writable again. Translated code leaves through the
+// pad of the store so the runtime drops the stale blocks before the store runs again, anything else
+// simply carries on with the store.
+static bool code_write(Guest_Mem* gm, const uint8_t* addr, ucontext_t* uc) {
+    if (gm->code_pages == NULL || addr < gm->code_base) return false;
+    size_t i = (size_t)(addr - gm->code_base) / gm->page_size;
+    if (i >= gm->code_page_count || !gm->code_pages[i].protected) return false;
+    if (mprotect(gm->code_base + i * gm->page_size, gm->page_size, PROT_READ | PROT_WRITE) != 0) return false;
+
+    Code_Page* p = &gm->code_pages[i];
+    p->protected = false;
+    p->written = true;
+    if (p->writes < UINT8_MAX) p->writes++;
+    gm->written = true;
+    const uint8_t* pad = find_pad(gm, (const uint8_t*)uc->uc_mcontext.gregs[REG_RIP]);
+    if (pad != NULL) {
+        gm->retried = true;
+        uc->uc_mcontext.gregs[REG_RIP] = (greg_t)(uintptr_t)pad;
+    }
+    return true;
+}
+
+static void on_fault(int sig, siginfo_t* info, void* context) {
+    ucontext_t* uc = (ucontext_t*)context;
+    Guest_Mem* gm = catching;
+    const uint8_t* addr = (const uint8_t*)info->si_addr;
+    const uint8_t* pad = NULL;
+    if (gm != NULL && sig == SIGSEGV && code_write(gm, addr, uc)) return;
+    if (gm != NULL) {
+        // A divide error has no address to check, the site alone tells it apart
+        bool guest = sig == SIGFPE ? info->si_code == FPE_INTDIV : addr >= gm->memory + gm->memsize && addr < gm->base + gm->reserved;
+        if (guest) pad = find_pad(gm, (const uint8_t*)uc->uc_mcontext.gregs[REG_RIP]);
+    }
+    if (pad != NULL) {
+        uc->uc_mcontext.gregs[REG_RIP] = (greg_t)(uintptr_t)pad;
+        return;
+    }
+
+    // Not from translated code, the faulting instruction runs again under the previous handler
+    for (size_t i = 0; i < CAUGHT_COUNT; i++) {
+        if (caught[i] == sig) sigaction(sig, &previous[i], NULL);
+    }
+}
+#endif
+
+void gm_catch_faults(Guest_Mem* gm) {
+    #ifdef PVCPU_GUARD_PAGES
+        if (!gm->guarded) return;
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = on_fault;
+        sa.sa_flags = SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        catching = gm;
+        for (size_t i = 0; i < CAUGHT_COUNT; i++) sigaction(caught[i], &sa, &previous[i]);
+    #else
+        (void)gm;
+    #endif
+}
+
+void gm_release_faults() {
+    #ifdef PVCPU_GUARD_PAGES
+        if (catching == NULL) return;
+        for (size_t i = 0; i < CAUGHT_COUNT; i++) sigaction(caught[i], &previous[i], NULL);
+        catching = NULL;
+    #endif
+}
@@ -4,29 +4,374 @@
 #include <stdint.h>
 #include <string.h>
 
+#include <pvcpu-codecache.h>
 #include <pvcpu-jit.h>
 #include <pvcpu-helpers.h>
 
-void emit_u8(Jit_Buf* buf, uint8_t v) {
-    if (buf->size + 1 > buf->capacity) return;
-    memcpy(buf->data + buf->size, &v, 1);
-    buf->size += 1;
+static bool new_chunk(Jit_Buf* buf, size_t need) {
+    size_t cap = buf->chunk_size;
+    if (need + PVCPU_JIT_LINK_SIZE > cap) cap = need + PVCPU_JIT_LINK_SIZE;
+
+    uint8_t* exec = cc_alloc(buf->cc, cap);
+    if (exec == NULL) return false;
+
+    if (buf->chunk_count == buf->chunk_cap) {
+        size_t ncap = buf->chunk_cap ? buf->chunk_cap * 2 : 8;
+        Jit_Chunk* chunks = realloc(buf->chunks, ncap * sizeof(Jit_Chunk));
+        if (chunks == NULL) return false;
+        buf->chunks = chunks;
+        buf->chunk_cap = ncap;
+    }
+    buf->chunks[buf->chunk_count].exec = exec;
+    buf->chunks[buf->chunk_count].size = 0;
+    buf->chunk_count++;
+
+    buf->exec = exec;
+    buf->data = cc_rw(buf->cc, exec);
+    buf->size = 0;
+    buf->capacity = cap - PVCPU_JIT_LINK_SIZE;
+    return true;
+}
+
+bool jit_init(Jit_Buf* buf, Code_Cache* cc, size_t chunk_size) {
+    memset(buf, 0, sizeof(Jit_Buf));
+    buf->cc = cc;
+    buf->chunk_size = chunk_size;
+    return new_chunk(buf, 0);
+}
+
+void jit_free(Jit_Buf* buf) {
+    free(buf->chunks);
+    memset(buf, 0, sizeof(Jit_Buf));
+}
+
+bool jit_grow(Jit_Buf* buf, size_t need) {
+    uint8_t* link = jit_pos(buf);
+    uint8_t* link_rw = buf->data + buf->size;
+    size_t used = buf->size;
+
+    if (!new_chunk(buf, need)) return false;
+
+    // Chain the old chunk to the new one, the link space is never handed out by jit_reserve
+    int32_t rel = (int32_t)(buf->exec - (link + PVCPU_JIT_LINK_SIZE));
+    link_rw[0] = 0xE9; // jmp rel32
+    memcpy(link_rw + 1, &rel, 4);
+
+    buf->chunks[buf->chunk_count - 2].size = used + PVCPU_JIT_LINK_SIZE;
+    buf->emitted += used + PVCPU_JIT_LINK_SIZE;
+    return true;
+}
+
+// How each X86_Op encodes, 0 marks a form the instruction does not have
+typedef struct {
+    uint8_t mr; // op r/m, r
+    uint8_t rm; // op r, r/m
+    uint8_t ext; // ModRM.reg of the immediate forms
+    uint8_t imm8; // op r/m, imm8 sign extended
+    uint8_t imm32; // op r/m, imm32 (sign extended for 64 bit operands)
+    uint8_t byte_imm8; // op r/m8, imm8
+    uint8_t eax_imm32; // op eax/rax, imm32 without a ModRM byte
+} X86_Encoding;
+
+static const X86_Encoding encodings[X86_OP_COUNT] = {
+    [X86_ADD] = {0x01, 0x03, 0, 0x83, 0x81, 0x80, 0x05},
+    [X86_OR] = {0x09, 0x0B, 1, 0x83, 0x81, 0x80, 0x0D},
+    [X86_AND] = {0x21, 0x23, 4, 0x83, 0x81, 0x80, 0x25},
+    [X86_SUB] = {0x29, 0x2B, 5, 0x83, 0x81, 0x80, 0x2D},
+    [X86_XOR] = {0x31, 0x33, 6, 0x83, 0x81, 0x80, 0x35},
+    [X86_CMP] = {0x39, 0x3B, 7, 0x83, 0x81, 0x80, 0x3D},
+    [X86_MOV] = {0x89, 0x8B, 0, 0, 0xC7, 0xC6, 0},
+    [X86_TEST] = {0x85, 0x85, 0, 0, 0xF7, 0xF6, 0xA9},
+    [X86_LEA] = {0, 0x8D, 0, 0, 0, 0, 0},
+};
+
+static bool fits_imm8(int64_t v) {
+    return v >= INT8_MIN && v <= INT8_MAX;
+}
+
+// REX prefix, left out when it would carry no bits unless `force` (byte access to spl-dil)
+static void emit_rex(Jit_Buf* buf, bool w, int reg, int index, int base, bool force) {
+    uint8_t rex = 0x40 | (w ? 8 : 0) | ((reg & 8) >> 1) | ((index & 8) >> 2) | ((base & 8) >> 3);
+    if (rex != 0x40 || force) emit_u8(buf, rex);
+}
+
+static void emit_modrm_reg(Jit_Buf* buf, int reg, int rm) {
+    emit_u8(buf, 0b11000000 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// ModRM + SIB + displacement with the shortest displacement the operand allows
+static void emit_modrm_mem(Jit_Buf* buf, int reg, X86_Mem m) {
+    bool sib = m.index >= 0 || (m.base & 7) == HOST_RSP;
+    // rbp and r13 have no displacement-less form
+    int mod = m.disp == 0 && (m.base & 7) != HOST_RBP ? 0 : (fits_imm8(m.disp) ? 1 : 2);
+    emit_u8(buf, (uint8_t)((mod << 6) | ((reg & 7) << 3) | (sib ? 0b100 : (m.base & 7))));
+    if (sib) emit_u8(buf, (uint8_t)((m.scale << 6) | ((m.index >= 0 ? m.index & 7 : 0b100) << 3) | (m.base & 7)));
+    if (mod == 1) emit_u8(buf, (uint8_t)(int8_t)m.disp);
+    else if (mod == 2) emit_u32(buf, (uint32_t)m.disp);
+}
+
+static int mem_index(X86_Mem m) {
+    return m.index >= 0 ? m.index : 0;
+}
+
+void emit_op_rr(Jit_Buf* buf, X86_Op op, int dst, int src) {
+    emit_rex(buf, true, src, 0, dst, false);
+    emit_u8(buf, encodings[op].mr);
+    emit_modrm_reg(buf, src, dst);
+}
+
+void emit_op_ri(Jit_Buf* buf, X86_Op op, int dst, int32_t imm) {
+    const X86_Encoding* e = &encodings[op];
+    emit_rex(buf, true, 0, 0, dst, false);
+    if (e->imm8 && fits_imm8(imm)) {
+        emit_u8(buf, e->imm8);
+        emit_modrm_reg(buf, e->ext, dst);
+        emit_u8(buf, (uint8_t)(int8_t)imm);
+        return;
+    }
+    if (e->eax_imm32 && dst == HOST_RAX) {
+        emit_u8(buf, e->eax_imm32);
+    } else {
+        emit_u8(buf, e->imm32);
+        emit_modrm_reg(buf, e->ext, dst);
+    }
+    emit_u32(buf, (uint32_t)imm);
+}
+
+void emit_op_rm(Jit_Buf* buf, X86_Op op, int reg, X86_Mem m) {
+    emit_rex(buf, true, reg, mem_index(m), m.base, false);
+    emit_u8(buf, encodings[op].rm);
+    emit_modrm_mem(buf, reg, m);
+}
+
+void emit_op_mr(Jit_Buf* buf, X86_Op op, X86_Mem m, int reg) {
+    emit_rex(buf, true, reg, mem_index(m), m.base, false);
+    emit_u8(buf, encodings[op].mr);
+    emit_modrm_mem(buf, reg, m);
+}
+
+void emit_op_mi(Jit_Buf* buf, X86_Op op, int size, X86_Mem m, int32_t imm) {
+    const X86_Encoding* e = &encodings[op];
+    if (size == 2) emit_u8(buf, 0x66); // Operand size prefix
+    emit_rex(buf, size == 8, 0, mem_index(m), m.base, false);
+    if (size == 1) {
+        emit_u8(buf, e->byte_imm8);
+        emit_modrm_mem(buf, e->ext, m);
+        emit_u8(buf, (uint8_t)imm);
+    } else if (e->imm8 && fits_imm8(imm)) {
+        emit_u8(buf, e->imm8);
+        emit_modrm_mem(buf, e->ext, m);
+        emit_u8(buf, (uint8_t)(int8_t)imm);
+    } else {
+        emit_u8(buf, e->imm32);
+        emit_modrm_mem(buf, e->ext, m);
+        if (size == 2) emit_u16(buf, (uint16_t)imm);
+        else emit_u32(buf, (uint32_t)imm);
+    }
+}
+
+void emit_load64(Jit_Buf* buf, int dst, int base, int32_t disp) {
+    emit_op_rm(buf, X86_MOV, dst, x86_mem(base, disp));
+}
+
+void emit_store64(Jit_Buf* buf, int base, int32_t disp, int src) {
+    emit_op_mr(buf, X86_MOV, x86_mem(base, disp), src);
+}
+
+void emit_store32(Jit_Buf* buf, int base, int32_t disp, int src) {
+    X86_Mem m = x86_mem(base, disp);
+    emit_rex(buf, false, src, 0, base, false);
+    emit_u8(buf, 0x89); // mov r/m32, r32
+    emit_modrm_mem(buf, src, m);
+}
+
+void emit_mov64(Jit_Buf* buf, int dst, int src) {
+    emit_op_rr(buf, X86_MOV, dst, src);
+}
+
+void emit_mov32(Jit_Buf* buf, int dst, int src) {
+    emit_rex(buf, false, src, 0, dst, false);
+    emit_u8(buf, 0x89); // mov r/m32, r32 (zero extends)
+    emit_modrm_reg(buf, src, dst);
+}
+
+void emit_shift_ri(Jit_Buf* buf, X86_Shift op, int reg, uint8_t count) {
+    emit_rex(buf, true, 0, 0, reg, false);
+    emit_u8(buf, 0xC1); // op r/m64, imm8
+    emit_modrm_reg(buf, op, reg);
+    emit_u8(buf, count);
+}
+
+void emit_shift_cl(Jit_Buf* buf, X86_Shift op, int reg) {
+    emit_rex(buf, true, 0, 0, reg, false);
+    emit_u8(buf, 0xD3); // op r/m64, cl
+    emit_modrm_reg(buf, op, reg);
+}
+
+void emit_not(Jit_Buf* buf, int reg) {
+    emit_rex(buf, true, 0, 0, reg, false);
+    emit_u8(buf, 0xF7); // not r/m64
+    emit_modrm_reg(buf, 2, reg);
+}
+
+void emit_imul(Jit_Buf* buf, int dst, int src) {
+    emit_rex(buf, true, dst, 0, src, false);
+    emit_u8(buf, 0x0F);
+    emit_u8(buf, 0xAF); // imul r64, r/m64
+    emit_modrm_reg(buf, dst, src);
+}
+
+void emit_imul_imm(Jit_Buf* buf, int dst, int src, int32_t imm) {
+    emit_rex(buf, true, dst, 0, src, false);
+    if (fits_imm8(imm)) {
+        emit_u8(buf, 0x6B); // imul r64, r/m64, imm8
+        emit_modrm_reg(buf, dst, src);
+        emit_u8(buf, (uint8_t)(int8_t)imm);
+        return;
+    }
+    emit_u8(buf, 0x69); // imul r64, r/m64, imm32
+    emit_modrm_reg(buf, dst, src);
+    emit_u32(buf, (uint32_t)imm);
+}
+
+void emit_div(Jit_Buf* buf, int reg) {
+    emit_rex(buf, true, 0, 0, reg, false);
+    emit_u8(buf, 0xF7); // div r/m64
+    emit_modrm_reg(buf, 6, reg);
+}
+
+// Three byte VEX prefix of a 64 bit (W1, L0) instruction, `map` is 2 for 0F38 and 3 for 0F3A,
+// `pp` the implied prefix (0 none, 1 66, 2 F3, 3 F2)
+static void emit_vex(Jit_Buf* buf, int map, int pp, int reg, int vvvv, int rm) {
+    emit_u8(buf, 0xC4);
+    emit_u8(buf, (uint8_t)((~reg & 8) << 4 | 0x40 | (~rm & 8) << 2 | map));
+    emit_u8(buf, (uint8_t)(0x80 | (~vvvv & 15) << 3 | pp));
+}
+
+void emit_andn(Jit_Buf* buf, int dst, int src1, int src2) {
+    emit_vex(buf, 2, 0, dst, src1, src2);
+    emit_u8(buf, 0xF2);
+    emit_modrm_reg(buf, dst, src2);
+}
+
+void emit_shiftx(Jit_Buf* buf, X86_Shift op, int dst, int src, int count) {
+    emit_vex(buf, 2, op == X86_SHL ? 1 : (op == X86_SAR ? 2 : 3), dst, count, src);
+    emit_u8(buf, 0xF7);
+    emit_modrm_reg(buf, dst, src);
+}
+
+void emit_rorx(Jit_Buf* buf, int dst, int src, uint8_t count) {
+    emit_vex(buf, 3, 3, dst, 0, src);
+    emit_u8(buf, 0xF0);
+    emit_modrm_reg(buf, dst, src);
+    emit_u8(buf, count);
+}
+
+void emit_cmov_rm(Jit_Buf* buf, uint8_t cc, int reg, X86_Mem m) {
+    emit_rex(buf, true, reg, mem_index(m), m.base, false);
+    emit_u8(buf, 0x0F);
+    emit_u8(buf, 0x40 | cc); // cmovcc r64, r/m64
+    emit_modrm_mem(buf, reg, m);
+}
+
+void emit_movimm64(Jit_Buf* buf, int dst, uint64_t imm) {
+    if (imm <= UINT32_MAX) {
+        emit_rex(buf, false, 0, 0, dst, false);
+        emit_u8(buf, 0xB8 | (dst & 7)); // mov r32, imm32 (zero extends)
+        emit_u32(buf, (uint32_t)imm);
+    } else if ((int64_t)imm >= INT32_MIN && (int64_t)imm < 0) {
+        emit_rex(buf, true, 0, 0, dst, false);
+        emit_u8(buf, 0xC7); // mov r/m64, imm32 (sign extends)
+        emit_modrm_reg(buf, 0, dst);
+        emit_u32(buf, (uint32_t)imm);
+    } else {
+        emit_rex(buf, true, 0, 0, dst, false);
+        emit_u8(buf, 0xB8 | (dst & 7)); // mov r64, imm64
+        emit_u64(buf, imm);
+    }
+}
+
+void emit_push(Jit_Buf* buf, int reg) {
+    emit_rex(buf, false, 0, 0, reg, false);
+    emit_u8(buf, 0x50 | (reg & 7));
+}
+
+void emit_pop(Jit_Buf* buf, int reg) {
+    emit_rex(buf, false, 0, 0, reg, false);
+    emit_u8(buf, 0x58 | (reg & 7));
+}
+
+uint8_t* emit_movabs64(Jit_Buf* buf, int dst, uint64_t imm) {
+    emit_rex(buf, true, 0, 0, dst, false);
+    emit_u8(buf, 0xB8 | (dst & 7)); // mov r64, imm64
+    uint8_t* field = jit_pos(buf);
+    emit_u64(buf, imm);
+    return field;
+}
+
+void emit_call_reg(Jit_Buf* buf, int reg) {
+    emit_rex(buf, false, 0, 0, reg, false);
+    emit_u8(buf, 0xFF); // call r/m64
+    emit_modrm_reg(buf, 2, reg);
+}
+
+void emit_jmp_mem(Jit_Buf* buf, X86_Mem m) {
+    emit_rex(buf, false, 0, mem_index(m), m.base, false);
+    emit_u8(buf, 0xFF); // jmp r/m64
+    emit_modrm_mem(buf, 4, m);
+}
+
+void emit_call_abs(Jit_Buf* buf, const void* fn) {
+    emit_movimm64(buf, HOST_RAX, (uint64_t)(uintptr_t)fn);
+    emit_call_reg(buf, HOST_RAX);
+}
+
+void emit_syscall(Jit_Buf* buf) {
+    emit_u8(buf, 0x0F);
+    emit_u8(buf, 0x05);
+}
+
+void emit_ret(Jit_Buf* buf) {
+    emit_u8(buf, 0xC3);
+}
+
+void emit_setcc(Jit_Buf* buf, uint8_t cc, int reg) {
+    // Without REX spl-dil would encode ah-bh
+    emit_rex(buf, false, 0, 0, reg, reg >= HOST_RSP);
+    emit_u8(buf, 0x0F);
+    emit_u8(buf, 0x90 | cc); // setcc r/m8
+    emit_modrm_reg(buf, 0, reg);
+    emit_rex(buf, false, reg, 0, reg, reg >= HOST_RSP);
+    emit_u8(buf, 0x0F);
+    emit_u8(buf, 0xB6); // movzx r32, r/m8
+    emit_modrm_reg(buf, reg, reg);
+}
+
+uint8_t* emit_jcc32(Jit_Buf* buf, uint8_t cc) {
+    emit_u8(buf, 0x0F);
+    emit_u8(buf, 0x80 | cc); // jcc rel32
+    uint8_t* field = jit_pos(buf);
+    emit_u32(buf, 0);
+    return field;
 }
 
-void emit_u16(Jit_Buf* buf, uint16_t v) {
-    if (buf->size + 2 > buf->capacity) return;
-    memcpy(buf->data + buf->size, &v, 2);
-    buf->size += 2;
+uint8_t* emit_jmp32(Jit_Buf* buf) {
+    emit_u8(buf, 0xE9); // jmp rel32
+    uint8_t* field = jit_pos(buf);
+    emit_u32(buf, 0);
+    return field;
 }
 
-void emit_u32(Jit_Buf* buf, uint32_t v) {
-    if (buf->size + 4 > buf->capacity) return;
-    memcpy(buf->data + buf->size, &v, 4);
-    buf->size += 4;
+uint8_t* emit_lea_rip32(Jit_Buf* buf, int dst) {
+    emit_rex(buf, true, dst, 0, 0, false);
+    emit_u8(buf, 0x8D); // lea r64, m
+    emit_u8(buf, (uint8_t)(((dst & 7) << 3) | 0b101)); // mod 00 rm 101 is rip + disp32
+    uint8_t* field = jit_pos(buf);
+    emit_u32(buf, 0);
+    return field;
 }
 
-void emit_u64(Jit_Buf* buf, uint64_t v) {
-    if (buf->size + 8 > buf->capacity) return;
-    memcpy(buf->data + buf->size, &v, 8);
-    buf->size += 8;
+void jit_patch_rel32(Jit_Buf* buf, uint8_t* field, const uint8_t* target) {
+    int32_t rel = (int32_t)(target - (field + 4));
+    memcpy(cc_rw(buf->cc, field), &rel, 4);
 }
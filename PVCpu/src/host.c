@@ -0,0 +1,105 @@
+// Author: Pheonix Studios/AkshuDev
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <pvcpu-host.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <cpuid.h>
+#endif
+
+#define CPUID_EBX 1
+#define CPUID_ECX 2
+#define CPUID_EDX 3
+
+// In PVCpu_Host_Features order, leaf 7 is read with subleaf 0
+static const PVCpu_Host_Cpuid features[PVCPU_HOST_FEATURE_COUNT] = {
+    {"bmi1", 7, CPUID_EBX, 3, true},
+    {"bmi2", 7, CPUID_EBX, 8, true},
+    {"lzcnt", 0x80000001, CPUID_ECX, 5, false},
+    {"popcnt", 1, CPUID_ECX, 23, false},
+    {"adx", 7, CPUID_EBX, 19, false},
+    {"avx2", 7, CPUID_EBX, 5, false},
+    {"avx512f", 7, CPUID_EBX, 16, false},
+    {"erms", 7, CPUID_EBX, 9, false},
+    {"fsrm", 7, CPUID_EDX, 4, false},
+};
+
+static bool* feature_flag(PVCpu_Host_Features* host, int i) {
+    return (bool*)host + i;
+}
+
+_Static_assert(sizeof(PVCpu_Host_Features) == PVCPU_HOST_FEATURE_COUNT * sizeof(bool), "one bool per feature");
+
+void pvcpu_host_detect(PVCpu_Host_Features* host) {
+    memset(host, 0, sizeof(PVCpu_Host_Features));
+    #if defined(__x86_64__) && defined(__GNUC__)
+        unsigned int max = __get_cpuid_max(0, NULL);
+        unsigned int max_ext = __get_cpuid_max(0x80000000, NULL);
+        for (int i = 0; i < PVCPU_HOST_FEATURE_COUNT; i++) {
+            uint32_t leaf = features[i].leaf;
+            if (leaf < 0x80000000 ? leaf > max : leaf > max_ext) continue;
+            unsigned int regs[4];
+            __cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+            *feature_flag(host, i) = (regs[features[i].reg] >> features[i].bit) & 1;
+        }
+
+        // AVX state has to be enabled by the OS as well: ymm for AVX2, opmask and zmm for AVX-512
+        unsigned int a, b, c, d;
+        uint64_t xcr0 = 0;
+        __cpuid(1, a, b, c, d);
+        if (c & (1u << 27)) { // OSXSAVE
+            uint32_t lo, hi;
+            __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+            xcr0 = (uint64_t)hi << 32 | lo;
+        }
+        if ((xcr0 & 0x6) != 0x6) host->avx2 = false;
+        if ((xcr0 & 0xE6) != 0xE6) host->avx512f = false;
+    #endif
+}
+
+bool pvcpu_host_parse(PVCpu_Host_Features* host, const char* spec, const char** bad) {
+    static char item[32];
+    while (*spec) {
+        size_t len = strcspn(spec, ",");
+        if (len >= sizeof(item)) len = sizeof(item) - 1;
+        memcpy(item, spec, len);
+        item[len] = '\0';
+        spec += strcspn(spec, ",");
+        if (*spec == ',') spec++;
+
+        bool on = item[0] != '-';
+        const char* name = on ? item : item + 1;
+        if (!strcmp(name, "native")) {
+            pvcpu_host_detect(host);
+            continue;
+        }
+        if (!strcmp(name, "none")) {
+            memset(host, 0, sizeof(PVCpu_Host_Features));
+            continue;
+        }
+        int i = 0;
+        while (i < PVCPU_HOST_FEATURE_COUNT && strcmp(name, features[i].name)) i++;
+        if (i == PVCPU_HOST_FEATURE_COUNT) {
+            if (bad != NULL) *bad = item;
+            return false;
+        }
+        *feature_flag(host, i) = on;
+    }
+    return true;
+}
+
+uint32_t pvcpu_host_mask(const PVCpu_Host_Features* host) {
+    uint32_t mask = 0;
+    for (int i = 0; i < PVCPU_HOST_FEATURE_COUNT; i++) {
+        if (*feature_flag((PVCpu_Host_Features*)host, i)) mask |= 1u << i;
+    }
+    return mask;
+}
+
+const PVCpu_Host_Cpuid* pvcpu_host_cpuid(int feature) {
+    return &features[feature];
+}
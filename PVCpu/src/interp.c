@@ -0,0 +1,389 @@
+// Author: Pheonix Studios/AkshuDev
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <pvcpu-isa.h>
+#include <pvcpu-tcache.h>
+#include <pvcpu-runtime.h>
+
+// Threaded code interpreter
+// Every block is pre-decoded into PVCpu_Interp_Inst records whose `handler` is the address of
+// a label inside pvcpu_interp_block picked per (opcode, mode), so moving to the next instruction
+// is a single indirect jump (GCC computed goto). Compare + jump and load + add pairs are fused.
+
+// `dest = a <op> b` instructions, a is dest and b the operand
+#define ALU_OPS(X) \
+    X(ADD, a + b) \
+    X(SUB, a - b) \
+    X(MUL, a * b) \
+    X(AND, a & b) \
+    X(OR, a | b) \
+    X(NOR, ~(a | b)) \
+    X(XOR, a ^ b) \
+    X(XNOR, ~(a ^ b)) \
+    X(NOT, ((void)a, ~b)) \
+    X(NAND, ~(a & b)) \
+    X(RSHIFT, a >> (b & 63)) \
+    X(LSHIFT, a << (b & 63)) \
+    X(ARSHIFT, (uint64_t)((int64_t)a >> (b & 63))) \
+    X(ARLSHIFT, a << (b & 63)) \
+    X(ROTR, rotr64(a, b)) \
+    X(ROTL, rotl64(a, b)) \
+    X(MOV, ((void)a, b))
+
+// Instructions only writing the flags
+#define COMPARE_OPS(X) \
+    X(CMP) \
+    X(UCMP) \
+    X(TEST)
+
+#define HANDLER_PAIR(name, ...) H_##name##_RR, H_##name##_RI,
+#define HANDLER_FUSED_PAIR(name) H_##name##_JCC_RR, H_##name##_JCC_RI,
+
+// RI follows RR for every pair, REG_IMM and REG_EXTIMM share it with the immediate in `value`
+typedef enum {
+    ALU_OPS(HANDLER_PAIR)
+    H_DIV_RR, H_DIV_RI,
+    COMPARE_OPS(HANDLER_PAIR)
+    COMPARE_OPS(HANDLER_FUSED_PAIR)
+    H_ALU_DISP, // Any ALU op reading its operand from memory
+    H_LOAD,
+    H_STORE,
+    H_LOAD_ADD,
+    H_JMP_R, H_JMP_I,
+    H_JCC_R, H_JCC_I,
+    H_CALL_R, H_CALL_I,
+    H_RET,
+    H_RAISE, // Raises `value` at `pc`
+    H_NOP,
+    H_END, // Falls through to the next block
+    H_COUNT
+} Interp_Handler;
+
+static const void* const* handler_labels; // Filled by pvcpu_interp_init
+
+static inline uint64_t rotr64(uint64_t a, uint64_t b) {
+    unsigned sh = (unsigned)(b & 63);
+    return sh ? (a >> sh) | (a << (64 - sh)) : a;
+}
+
+static inline uint64_t rotl64(uint64_t a, uint64_t b) {
+    unsigned sh = (unsigned)(b & 63);
+    return sh ? (a << sh) | (a >> (64 - sh)) : a;
+}
+
+static inline bool mem_read64(const PVCpu_State* state, uint64_t addr, uint64_t* out) {
+    if (addr > state->memsize || state->memsize - addr < 8) return false;
+    memcpy(out, state->memory + addr, 8);
+    return true;
+}
+
+static inline bool mem_write64(PVCpu_State* state, uint64_t addr, uint64_t v) {
+    if (addr > state->memsize || state->memsize - addr < 8) return false;
+    memcpy(state->memory + addr, &v, 8);
+    return true;
+}
+
+static inline void set_reg(PVCpu_State* state, int reg, uint64_t v) {
+    if (reg != PVCPU_REG_NULL) state->regs[reg] = v; // Writes to NULL are ignored
+}
+
+// Address of a LOAD_* or STORE_* access, `base` is src for loads and dest for stores
+static inline uint64_t mem_addr(const PVCpu_State* state, const PVCpu_Interp_Inst* op, int base) {
+    switch (op->mode) {
+        case LOAD_IMMADDR:
+        case STORE_IMMADDR: return op->value;
+        case LOAD_PC_REL:
+        case STORE_PC_REL: return state->regs[base] + op->pc;
+        default: return state->regs[base];
+    }
+}
+
+// Slow path for ALU ops with a memory operand, false with `fault` set when the op faults
+static bool exec_alu(PVCpu_State* state, const PVCpu_Interp_Inst* op, uint64_t b, uint32_t* fault) {
+    uint64_t a = state->regs[op->dest];
+    uint64_t r;
+
+    #define ALU_CASE(name, expr) case OP_##name: r = (expr); break;
+    #define COMPARE_CASE(name) case OP_##name: pvcpu_record_compare(state, OP_##name, a, b); return true;
+    switch (op->opcode) {
+        ALU_OPS(ALU_CASE)
+        COMPARE_OPS(COMPARE_CASE)
+        case OP_DIV:
+            if (b == 0) {
+                *fault = PVCPU_EXC_DIV_ZERO;
+                return false;
+            }
+            r = a / b;
+            break;
+        default:
+            *fault = PVCPU_EXC_UNSUPPORTED;
+            return false;
+    }
+    #undef ALU_CASE
+    #undef COMPARE_CASE
+
+    set_reg(state, op->dest, r);
+    return true;
+}
+
+void pvcpu_interp_block(PVCpu_State* state, const PVCpu_Block* block) {
+    #define ALU_LABELS(name, expr) [H_##name##_RR] = &&name##_rr, [H_##name##_RI] = &&name##_ri,
+    #define COMPARE_LABELS(name) [H_##name##_RR] = &&name##_rr, [H_##name##_RI] = &&name##_ri, \
+        [H_##name##_JCC_RR] = &&name##_jcc_rr, [H_##name##_JCC_RI] = &&name##_jcc_ri,
+    static const void* const labels[H_COUNT] = {
+        ALU_OPS(ALU_LABELS)
+        COMPARE_OPS(COMPARE_LABELS)
+        [H_DIV_RR] = &&div_rr, [H_DIV_RI] = &&div_ri,
+        [H_ALU_DISP] = &&alu_disp,
+        [H_LOAD] = &&load, [H_STORE] = &&store, [H_LOAD_ADD] = &&load_add,
+        [H_JMP_R] = &&jmp_r, [H_JMP_I] = &&jmp_i,
+        [H_JCC_R] = &&jcc_r, [H_JCC_I] = &&jcc_i,
+        [H_CALL_R] = &&call_r, [H_CALL_I] = &&call_i,
+        [H_RET] = &&ret, [H_RAISE] = &&raise, [H_NOP] = &&nop, [H_END] = &&end
+    };
+    #undef ALU_LABELS
+    #undef COMPARE_LABELS
+
+    if (state == NULL) { // pvcpu_interp_init
+        handler_labels = labels;
+        return;
+    }
+
+    uint64_t* regs = state->regs;
+    const PVCpu_Interp_Inst* op = block->insts;
+    uint64_t v;
+
+    #define NEXT goto *(++op)->handler
+    // Jump condition of `op` against `flags`
+    #define TAKEN(flags) (((((flags) & (op->cond & 0x7F)) != 0) ^ (op->cond >> 7)) != 0)
+
+    goto *op->handler;
+
+    // Writes to NULL have been turned into H_NOP, so dest is written unconditionally
+    #define ALU_BODY(name, expr) \
+        name##_rr: { uint64_t a = regs[op->dest], b = regs[op->src]; regs[op->dest] = (expr); NEXT; } \
+        name##_ri: { uint64_t a = regs[op->dest], b = op->value; regs[op->dest] = (expr); NEXT; }
+    ALU_OPS(ALU_BODY)
+    #undef ALU_BODY
+
+    // Compares only record their operands. The superinstructions need the flags right away,
+    // so they store them computed, the jump is always static.
+    #define COMPARE_BODY(name) \
+        name##_rr: pvcpu_record_compare(state, OP_##name, regs[op->dest], regs[op->src]); NEXT; \
+        name##_ri: pvcpu_record_compare(state, OP_##name, regs[op->dest], op->value); NEXT; \
+        name##_jcc_rr: v = pvcpu_compare_flags(OP_##name, regs[op->dest], regs[op->src]); goto fused_jcc; \
+        name##_jcc_ri: v = pvcpu_compare_flags(OP_##name, regs[op->dest], op->value); goto fused_jcc;
+    COMPARE_OPS(COMPARE_BODY)
+    #undef COMPARE_BODY
+
+fused_jcc:
+    state->flags = v;
+    state->flags_op = 0;
+    regs[PVCPU_REG_PC] = TAKEN(v) ? op->target : block->end;
+    return;
+
+div_rr:
+    v = regs[op->src];
+    goto div;
+div_ri:
+    v = op->value;
+div:
+    if (v == 0) {
+        pvcpu_helper_raise(state, op->pc, PVCPU_EXC_DIV_ZERO);
+        return;
+    }
+    set_reg(state, op->dest, regs[op->dest] / v);
+    NEXT;
+
+alu_disp: {
+    uint32_t fault = PVCPU_EXC_MEMORY;
+    if (!mem_read64(state, op->value + op->pc, &v) || !exec_alu(state, op, v, &fault)) {
+        pvcpu_helper_raise(state, op->pc, fault);
+        return;
+    }
+    NEXT;
+}
+
+load:
+    if (!mem_read64(state, mem_addr(state, op, op->src), &v)) goto memory_fault;
+    set_reg(state, op->dest, v);
+    NEXT;
+
+store:
+    if (!mem_write64(state, mem_addr(state, op, op->dest), regs[op->src])) goto memory_fault;
+    NEXT;
+
+// dest = mem[...]; aux += dest, with dest and aux never NULL
+load_add:
+    if (!mem_read64(state, mem_addr(state, op, op->src), &v)) goto memory_fault;
+    regs[op->dest] = v;
+    regs[op->aux] += v;
+    NEXT;
+
+memory_fault:
+    pvcpu_helper_raise(state, op->pc, PVCPU_EXC_MEMORY);
+    return;
+
+jmp_r:
+    regs[PVCPU_REG_PC] = regs[op->src];
+    return;
+jmp_i:
+    regs[PVCPU_REG_PC] = op->value;
+    return;
+
+// Jumps end the block, so `end` is the fall-through and return address
+jcc_r:
+    regs[PVCPU_REG_PC] = TAKEN(pvcpu_flags(state)) ? regs[op->src] : block->end;
+    return;
+jcc_i:
+    regs[PVCPU_REG_PC] = TAKEN(pvcpu_flags(state)) ? op->value : block->end;
+    return;
+
+// The helpers report stack faults at the address held in PC
+call_r:
+    v = regs[op->src];
+    regs[PVCPU_REG_PC] = op->pc;
+    pvcpu_helper_call(state, block->end, v);
+    return;
+call_i:
+    regs[PVCPU_REG_PC] = op->pc;
+    pvcpu_helper_call(state, block->end, op->value);
+    return;
+
+ret:
+    regs[PVCPU_REG_PC] = op->pc;
+    pvcpu_helper_ret(state);
+    return;
+
+raise:
+    pvcpu_helper_raise(state, op->pc, op->value);
+    return;
+
+nop:
+    NEXT;
+
+end:
+    regs[PVCPU_REG_PC] = block->end;
+    return;
+
+    #undef NEXT
+    #undef TAKEN
+}
+
+void pvcpu_interp_init() {
+    if (handler_labels == NULL) pvcpu_interp_block(NULL, NULL);
+}
+
+static bool is_jcc(uint16_t opcode) {
+    return opcode >= OP_JZ && opcode <= OP_JNE;
+}
+
+// Same conditions the JIT tests, jnz/jne are taken when Z is clear
+static uint8_t jcc_cond(uint16_t opcode) {
+    static const uint8_t masks[8] = {
+        PVCPU_FLAG_Z, PVCPU_FLAG_Z, PVCPU_FLAG_L, PVCPU_FLAG_L | PVCPU_FLAG_Z,
+        PVCPU_FLAG_G, PVCPU_FLAG_G | PVCPU_FLAG_Z, PVCPU_FLAG_Z, PVCPU_FLAG_Z
+    };
+    uint8_t cond = masks[opcode - OP_JZ];
+    if (opcode == OP_JNZ || opcode == OP_JNE) cond |= 0x80;
+    return cond;
+}
+
+// Handler of an instruction taking a REG_* operand, `rr` is its REG_REG handler
+static Interp_Handler operand_handler(const PVCpu_Interp_Inst* op, Interp_Handler rr) {
+    if (op->mode == REG_DISP && rr < H_ALU_DISP) return H_ALU_DISP;
+    if (op->mode != REG_REG && op->mode != REG_IMM && op->mode != REG_EXTIMM) return H_RAISE;
+    return rr + (op->mode != REG_REG);
+}
+
+// Picks the handler of a single instruction, resolving REG_IMM into `value`
+static Interp_Handler select_handler(PVCpu_Interp_Inst* op) {
+    if (op->mode == REG_IMM) op->value = op->src;
+
+    Interp_Handler h;
+    #define ALU_SELECT(name, expr) case OP_##name: h = operand_handler(op, H_##name##_RR); break;
+    #define COMPARE_SELECT(name) case OP_##name: return operand_handler(op, H_##name##_RR);
+    switch (op->opcode) {
+        ALU_OPS(ALU_SELECT)
+        COMPARE_OPS(COMPARE_SELECT)
+        case OP_DIV: return operand_handler(op, H_DIV_RR);
+        case OP_LOAD: return op->mode >= LOAD_REGADDR && op->mode <= LOAD_PC_REL ? H_LOAD : H_RAISE;
+        case OP_STORE: return op->mode >= STORE_REGADDR && op->mode <= STORE_PC_REL ? H_STORE : H_RAISE;
+        case OP_JMP: return operand_handler(op, H_JMP_R);
+        case OP_CALL: return operand_handler(op, H_CALL_R);
+        case OP_RET: return H_RET;
+        case OP_EXCEPTION:
+            if (op->mode != REG_IMM && op->mode != REG_EXTIMM) op->value = 0;
+            return H_RAISE;
+        default:
+            if (!is_jcc(op->opcode)) return H_RAISE;
+            op->cond = jcc_cond(op->opcode);
+            return operand_handler(op, H_JCC_R);
+    }
+    #undef ALU_SELECT
+    #undef COMPARE_SELECT
+
+    // Plain ALU ops writing NULL do nothing
+    if (h < H_DIV_RR && op->dest == PVCPU_REG_NULL) return H_NOP;
+    return h;
+}
+
+// Fuses `op` with the following instruction when they form a superinstruction
+static bool fuse(PVCpu_Interp_Inst* op, Interp_Handler h, const PVCpu_Inst* next, uint64_t next_value) {
+    // CMP/UCMP/TEST + conditional jump to a static target
+    if (h >= H_CMP_RR && h <= H_TEST_RI && is_jcc(next->opcode) && (next->mode == REG_IMM || next->mode == REG_EXTIMM)) {
+        op->handler = handler_labels[h - H_CMP_RR + H_CMP_JCC_RR];
+        op->target = next->mode == REG_IMM ? next->src : next_value;
+        op->cond = jcc_cond(next->opcode);
+        return true;
+    }
+    // LOAD + ADD of the loaded value
+    if (h == H_LOAD && op->dest != PVCPU_REG_NULL && next->opcode == OP_ADD && next->mode == REG_REG && next->src == op->dest && next->dest != PVCPU_REG_NULL) {
+        op->handler = handler_labels[H_LOAD_ADD];
+        op->aux = next->dest;
+        return true;
+    }
+    return false;
+}
+
+bool pvcpu_interp_prepare(PVCpu_Block* block, const PVCpu_Decoded_Block* db) {
+    // One record per instruction at most, plus the one leaving the block
+    PVCpu_Interp_Inst* ops = malloc((db->count + 1) * sizeof(PVCpu_Interp_Inst));
+    if (ops == NULL) return false;
+
+    size_t n = 0;
+    for (size_t i = 0; i < db->count; i++) {
+        const PVCpu_Inst* inst = &db->insts[i];
+        PVCpu_Interp_Inst* op = &ops[n++];
+        memset(op, 0, sizeof(PVCpu_Interp_Inst));
+        op->opcode = inst->opcode;
+        op->mode = inst->mode;
+        op->dest = inst->dest;
+        op->src = inst->src;
+        op->value = db->values[i];
+        op->pc = db->pcs[i];
+
+        Interp_Handler h = select_handler(op);
+        if (h == H_RAISE && op->opcode != OP_EXCEPTION) op->value = PVCPU_EXC_UNSUPPORTED;
+        op->handler = handler_labels[h];
+        if (i + 1 < db->count && fuse(op, h, &db->insts[i + 1], db->values[i + 1])) i++;
+    }
+
+    // Blocks ending in a branch never reach this one
+    PVCpu_Interp_Inst* last = &ops[n];
+    memset(last, 0, sizeof(PVCpu_Interp_Inst));
+    last->pc = db->end;
+    last->value = db->fault;
+    last->handler = handler_labels[db->fault ? H_RAISE : H_END];
+
+    free(block->insts);
+    block->insts = ops;
+    block->end = db->end;
+    block->inst_count = (uint32_t)db->count;
+    block->fault = db->fault;
+    return true;
+}
@@ -0,0 +1,560 @@
+// Author: Pheonix Studios/AkshuDev
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <pvcpu-isa.h>
+#include <pvcpu-ir.h>
+#include <pvcpu-regalloc.h>
+#include <pvcpu-runtime.h>
+
+typedef struct {
+    Ir_Block* ir;
+    uint64_t pc; // Guest address of the instruction being lowered
+    uint8_t retired; // Instructions done once it has, counting itself
+    uint64_t next_pc; // Guest address of the following instruction
+    bool inner; // Branch inside a trace, the path continues at `follow`
+    uint64_t follow;
+    uint16_t flags; // Last IR_FLAGS, IR_NONE until the block compares anything
+} Ir_Builder;
+
+typedef void (*Ir_Lower)(Ir_Builder* b, const PVCpu_Inst* inst, uint64_t value);
+static Ir_Lower lowerers[4096]; // 12-bits
+static uint16_t lower_modes[4096]; // Bit per Modes value the front end can lower
+
+#define MODES_OPERAND ((1 << REG_REG) | (1 << REG_IMM) | (1 << REG_EXTIMM))
+#define MODES_ALU (MODES_OPERAND | (1 << REG_DISP))
+#define MODES_LOAD ((1 << LOAD_REGADDR) | (1 << LOAD_IMMADDR) | (1 << LOAD_PC_REL))
+#define MODES_STORE ((1 << STORE_REGADDR) | (1 << STORE_IMMADDR) | (1 << STORE_PC_REL))
+#define MODES_ANY 0xFFFF
+
+static uint16_t push_uop(Ir_Builder* b, uint8_t op, uint16_t a, uint16_t bv, uint64_t imm) {
+    Ir_Uop* u = &b->ir->uops[b->ir->count];
+    u->op = op;
+    u->reg = 0;
+    u->cond = 0;
+    u->a = a;
+    u->b = bv;
+    u->imm = imm;
+    u->pc = b->pc;
+    u->retired = b->retired;
+    return (uint16_t)b->ir->count++;
+}
+
+static uint16_t lower_const(Ir_Builder* b, uint64_t imm) {
+    return push_uop(b, IR_CONST, IR_NONE, IR_NONE, imm);
+}
+
+static uint16_t lower_get(Ir_Builder* b, int reg) {
+    if (reg == PVCPU_REG_NULL) return lower_const(b, 0); // NULL always reads as zero
+    uint16_t v = push_uop(b, IR_GET, IR_NONE, IR_NONE, 0);
+    b->ir->uops[v].reg = (uint8_t)reg;
+    return v;
+}
+
+static void lower_set(Ir_Builder* b, int reg, uint16_t value) {
+    if (reg == PVCPU_REG_NULL) return; // Writes to NULL are ignored
+    uint16_t v = push_uop(b, IR_SET, value, IR_NONE, 0);
+    b->ir->uops[v].reg = (uint8_t)reg;
+}
+
+// Source operand of the REG_* modes, REG_DISP reads mem[imm + PC]
+static uint16_t lower_operand(Ir_Builder* b, const PVCpu_Inst* inst, uint64_t value) {
+    switch (inst->mode) {
+        case REG_REG: return lower_get(b, inst->src);
+        case REG_IMM: return lower_const(b, inst->src);
+        case REG_DISP: return push_uop(b, IR_LOAD, lower_const(b, value + b->pc), IR_NONE, PVCPU_EXC_MEMORY);
+        default: return lower_const(b, value);
+    }
+}
+
+static bool static_target(const PVCpu_Inst* inst, uint64_t value, uint64_t* target) {
+    if (inst->mode == REG_IMM) *target = inst->src;
+    else if (inst->mode == REG_EXTIMM) *target = value;
+    else return false;
+    return true;
+}
+
+// NAND, NOR and XNOR are the complement of AND, OR and XOR
+static uint8_t alu_uop(uint16_t opcode) {
+    switch (opcode) {
+        case OP_ADD: return IR_ADD;
+        case OP_SUB: return IR_SUB;
+        case OP_MUL: return IR_MUL;
+        case OP_AND:
+        case OP_NAND: return IR_AND;
+        case OP_OR:
+        case OP_NOR: return IR_OR;
+        case OP_RSHIFT: return IR_SHR;
+        case OP_LSHIFT:
+        case OP_ARLSHIFT: return IR_SHL;
+        case OP_ARSHIFT: return IR_SAR;
+        case OP_ROTR: return IR_ROR;
+        case OP_ROTL: return IR_ROL;
+        default: return IR_XOR;
+    }
+}
+
+static bool alu_complements(uint16_t opcode) {
+    return opcode == OP_NAND || opcode == OP_NOR || opcode == OP_XNOR || opcode == OP_NOT;
+}
+
+static void lower_alu(Ir_Builder* b, const PVCpu_Inst* inst, uint64_t value) {
+    uint16_t src = lower_operand(b, inst, value); // Kept for NULL, a REG_DISP load may still fault
+    if (inst->dest == PVCPU_REG_NULL) return;
+    uint16_t result = src; // NOT only complements its operand
+    if (inst->opcode != OP_NOT) result = push_uop(b, alu_uop(inst->opcode), lower_get(b, inst->dest), src, 0);
+    if (alu_complements(inst->opcode)) result = push_uop(b, IR_XOR, result, lower_const(b, ~0ull), 0);
+    lower_set(b, inst->dest, result);
+}
+
+// Kept for NULL as well, dividing by zero still raises
+static void lower_div(Ir_Builder* b, const PVCpu_Inst* inst, uint64_t value) {
+    uint16_t src = lower_operand(b, inst, value);
+    lower_set(b, inst->dest, push_uop(b, IR_DIV, lower_get(b, inst->dest), src, 0));
+}
+
+static void lower_mov(Ir_Builder* b, const PVCpu_Inst* inst, uint64_t value) {
+    lower_set(b, inst->dest, lower_operand(b, inst, value));
+}
+
+static void lower_compare(Ir_Builder* b, const PVCpu_Inst* inst, uint64_t value) {
+    uint16_t src = lower_operand(b, inst, value);
+    b->flags = push_uop(b, IR_FLAGS, lower_get(b, inst->dest), src, 0);
+    b->ir->uops[b->flags].cond = (uint8_t)inst->opcode;
+}
+
+// Address of a LOAD_* or STORE_* access, `base` is src for loads and dest for stores
+static uint16_t lower_addr(Ir_Builder* b, const PVCpu_Inst* inst, uint64_t value, int base) {
+    switch (inst->mode) {
+        case LOAD_IMMADDR:
+        case STORE_IMMADDR: return lower_const(b, value);
+        case LOAD_PC_REL:
+        case STORE_PC_REL: return push_uop(b, IR_ADD, lower_get(b, base), lower_const(b, b->pc), 0);
+        default: return lower_get(b, base);
+    }
+}
+
+static void lower_load(Ir_Builder* b, const PVCpu_Inst* inst, uint64_t value) {
+    uint16_t addr = lower_addr(b, inst, value, inst->src);
+    lower_set(b, inst->dest, push_uop(b, IR_LOAD, addr, IR_NONE, PVCPU_EXC_MEMORY));
+}
+
+static void lower_store(Ir_Builder* b, const PVCpu_Inst* inst, uint64_t value) {
+    uint16_t addr = lower_addr(b, inst, value, inst->dest);
+    push_uop(b, IR_STORE, addr, lower_get(b, inst->src), PVCPU_EXC_MEMORY);
+}
+
+static void lower_jmp(Ir_Builder* b, const PVCpu_Inst* inst, uint64_t value) {
+    if (b->inner) return; // The trace continues at the target
+    push_uop(b, IR_EXIT, lower_operand(b, inst, value), IR_NONE, 0);
+}
+
+static void push_branch(Ir_Builder* b, uint16_t target, uint8_t cond) {
+    uint16_t v = push_uop(b, IR_BRANCH, target, b->flags, 0);
+    b->ir->uops[v].cond = cond;
+}
+
+// Conditional jumps, taken when (flags & mask) is non zero, or zero for jnz/jne
+static void lower_jcc(Ir_Builder* b, const PVCpu_Inst* inst, uint64_t value) {
+    static const uint8_t masks[8] = {
+        PVCPU_FLAG_Z, PVCPU_FLAG_Z, PVCPU_FLAG_L, PVCPU_FLAG_L | PVCPU_FLAG_Z,
+        PVCPU_FLAG_G, PVCPU_FLAG_G | PVCPU_FLAG_Z, PVCPU_FLAG_Z, PVCPU_FLAG_Z
+    };
+    uint8_t cond = masks[inst->opcode - OP_JZ];
+    if (inst->opcode == OP_JNZ || inst->opcode == OP_JNE) cond |= IR_COND_INVERT;
+
+    uint64_t target;
+    if (b->inner && static_target(inst, value, &target)) {
+        if (target == b->next_pc) return;
+        // Inside a trace only the direction the path does not follow leaves the block
+        if (b->follow == target) push_branch(b, lower_const(b, b->next_pc), cond ^ IR_COND_INVERT);
+        else push_branch(b, lower_const(b, target), cond);
+        return;
+    }
+
+    push_branch(b, lower_operand(b, inst, value), cond);
+    push_uop(b, IR_EXIT, lower_const(b, b->next_pc), IR_NONE, 0);
+}
+
+// CALL and RET are plain stack accesses, an SP outside guest memory faults like any other access
+// but raises PVCPU_EXC_STACK. SP and LR only change once the access went through.
+static void lower_call(Ir_Builder* b, const PVCpu_Inst* inst, uint64_t value) {
+    uint16_t target = lower_operand(b, inst, value);
+    uint16_t sp = push_uop(b, IR_SUB, lower_get(b, PVCPU_REG_SP), lower_const(b, 8), 0);
+    uint16_t ret = lower_const(b, b->next_pc);
+    push_uop(b, IR_STORE, sp, ret, PVCPU_EXC_STACK);
+    lower_set(b, PVCPU_REG_SP, sp);
+    lower_set(b, PVCPU_REG_LR, ret);
+    push_uop(b, IR_EXIT, target, ret, 0);
+}
+
+static void lower_ret(Ir_Builder* b, const PVCpu_Inst* inst, uint64_t value) {
+    (void)inst; (void)value;
+    uint16_t sp = lower_get(b, PVCPU_REG_SP);
+    uint16_t target = push_uop(b, IR_LOAD, sp, IR_NONE, PVCPU_EXC_STACK);
+    lower_set(b, PVCPU_REG_SP, push_uop(b, IR_ADD, sp, lower_const(b, 8), 0));
+    uint16_t v = push_uop(b, IR_EXIT, target, IR_NONE, 0);
+    b->ir->uops[v].cond = IR_EXIT_RETURN;
+}
+
+static void lower_exception(Ir_Builder* b, const PVCpu_Inst* inst, uint64_t value) {
+    uint64_t code = 0;
+    if (inst->mode == REG_IMM) code = inst->src;
+    else if (inst->mode == REG_EXTIMM) code = value;
+    push_uop(b, IR_RAISE, IR_NONE, IR_NONE, code);
+}
+
+static void register_lowering(uint16_t opcode, Ir_Lower fn, uint16_t modes) {
+    lowerers[opcode] = fn;
+    lower_modes[opcode] = modes;
+}
+
+void ir_init() {
+    for (int i = 0; i < 4096; i++) {
+        lowerers[i] = NULL;
+        lower_modes[i] = 0;
+    }
+
+    register_lowering(OP_ADD, lower_alu, MODES_ALU);
+    register_lowering(OP_SUB, lower_alu, MODES_ALU);
+    register_lowering(OP_MUL, lower_alu, MODES_ALU);
+    register_lowering(OP_AND, lower_alu, MODES_ALU);
+    register_lowering(OP_OR, lower_alu, MODES_ALU);
+    register_lowering(OP_XOR, lower_alu, MODES_ALU);
+    for (uint16_t op = OP_NOR; op <= OP_NAND; op++) {
+        register_lowering(op, lower_alu, MODES_ALU);
+    }
+    for (uint16_t op = OP_RSHIFT; op <= OP_ROTL; op++) {
+        register_lowering(op, lower_alu, MODES_ALU);
+    }
+    register_lowering(OP_DIV, lower_div, MODES_ALU);
+    register_lowering(OP_MOV, lower_mov, MODES_ALU);
+    register_lowering(OP_CMP, lower_compare, MODES_ALU);
+    register_lowering(OP_UCMP, lower_compare, MODES_ALU);
+    register_lowering(OP_TEST, lower_compare, MODES_ALU);
+    register_lowering(OP_LOAD, lower_load, MODES_LOAD);
+    register_lowering(OP_STORE, lower_store, MODES_STORE);
+
+    register_lowering(OP_JMP, lower_jmp, MODES_OPERAND);
+    for (uint16_t op = OP_JZ; op <= OP_JNE; op++) {
+        register_lowering(op, lower_jcc, MODES_OPERAND);
+    }
+    register_lowering(OP_CALL, lower_call, MODES_OPERAND);
+    register_lowering(OP_RET, lower_ret, MODES_ANY);
+    register_lowering(OP_EXCEPTION, lower_exception, MODES_ANY);
+}
+
+bool ir_can_lower(const PVCpu_Inst* inst) {
+    return lowerers[inst->opcode] != NULL && (lower_modes[inst->opcode] & (1 << inst->mode));
+}
+
+void ir_lower(Ir_Block* ir, const PVCpu_Decoded_Block* db, size_t count, uint64_t end, uint32_t fault) {
+    Ir_Builder b = {ir, 0, 0, 0, false, 0, IR_NONE};
+    ir->count = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        const PVCpu_Inst* inst = &db->insts[i];
+        b.pc = db->pcs[i];
+        b.next_pc = db->pcs[i] + db->sizes[i];
+        b.retired = (uint8_t)(i + 1);
+        // Only traces have branches before their last instruction
+        b.inner = i + 1 < count && pvcpu_is_block_end(inst->opcode);
+        b.follow = b.inner ? db->pcs[i + 1] : 0;
+        lowerers[inst->opcode](&b, inst, db->values[i]);
+    }
+
+    // Blocks ending in a branch have their exits already
+    if (count > 0 && pvcpu_is_block_end(db->insts[count - 1].opcode) && !fault) return;
+    b.pc = end;
+    if (fault) push_uop(&b, IR_RAISE, IR_NONE, IR_NONE, fault);
+    else push_uop(&b, IR_EXIT, lower_const(&b, end), IR_NONE, 0);
+}
+
+void ir_count_uses(const Ir_Block* ir, uint16_t* uses) {
+    memset(uses, 0, ir->count * sizeof(uint16_t));
+    for (size_t i = 0; i < ir->count; i++) {
+        const Ir_Uop* u = &ir->uops[i];
+        if (u->a != IR_NONE) uses[u->a]++;
+        if (u->b != IR_NONE) uses[u->b]++;
+    }
+}
+
+static void kill_uop(Ir_Uop* u) {
+    u->op = IR_NOP;
+    u->a = IR_NONE;
+    u->b = IR_NONE;
+}
+
+static bool is_commutative(uint8_t op) {
+    return op == IR_ADD || op == IR_MUL || op == IR_AND || op == IR_OR || op == IR_XOR;
+}
+
+static void make_const(Ir_Uop* u, uint64_t imm) {
+    u->op = IR_CONST;
+    u->a = IR_NONE;
+    u->b = IR_NONE;
+    u->imm = imm;
+}
+
+static uint64_t eval_alu(uint8_t op, uint64_t x, uint64_t y) {
+    switch (op) {
+        case IR_ADD: return x + y;
+        case IR_SUB: return x - y;
+        case IR_AND: return x & y;
+        case IR_OR: return x | y;
+        case IR_XOR: return x ^ y;
+        case IR_ANDN: return x & ~y;
+        case IR_MUL: return x * y;
+        case IR_SHL: return x << (y & 63);
+        case IR_SHR: return x >> (y & 63);
+        case IR_SAR: return (uint64_t)((int64_t)x >> (y & 63));
+        case IR_ROL: return (y & 63) ? (x << (y & 63)) | (x >> (64 - (y & 63))) : x;
+        default: return (y & 63) ? (x >> (y & 63)) | (x << (64 - (y & 63))) : x;
+    }
+}
+
+// Whether `u` is `x ^ ~0`, the complement of x
+static bool is_not(const Ir_Block* ir, const Ir_Uop* u) {
+    return u->op == IR_XOR && ir->uops[u->b].op == IR_CONST && ir->uops[u->b].imm == ~0ull;
+}
+
+// Value `op x, c` reduces to for a constant c, IR_NONE when it does not. Absorbing constants turn `u` into one.
+static uint16_t fold_identity(Ir_Uop* u, uint16_t x, uint64_t c) {
+    switch (u->op) {
+        case IR_ADD:
+        case IR_SUB:
+        case IR_XOR: return c == 0 ? x : IR_NONE;
+        case IR_OR:
+            if (c == ~0ull) make_const(u, c);
+            return c == 0 ? x : IR_NONE;
+        case IR_ANDN:
+            if (c == ~0ull) make_const(u, 0);
+            return c == 0 ? x : IR_NONE;
+        case IR_AND:
+            if (c == 0) make_const(u, 0);
+            return c == ~0ull ? x : IR_NONE;
+        case IR_MUL:
+            if (c == 0) make_const(u, 0);
+            return c == 1 ? x : IR_NONE;
+        default: return (c & 63) == 0 ? x : IR_NONE; // Shifts and rotates
+    }
+}
+
+// Constant folding of ALU micro-ops. Returns the existing value `u` computes, or IR_NONE with `u`
+// left as is or turned into an IR_CONST.
+static uint16_t fold_alu(const Ir_Block* ir, Ir_Uop* u) {
+    const Ir_Uop* x = &ir->uops[u->a];
+    const Ir_Uop* y = &ir->uops[u->b];
+    if (x->op == IR_CONST && y->op == IR_CONST) {
+        make_const(u, eval_alu(u->op, x->imm, y->imm));
+        return IR_NONE;
+    }
+    if (u->a == u->b) {
+        if (u->op == IR_SUB || u->op == IR_XOR || u->op == IR_ANDN) make_const(u, 0);
+        else if (u->op == IR_AND || u->op == IR_OR) return u->a;
+        return IR_NONE;
+    }
+    // Shifting zero, or all ones arithmetically or around, changes nothing
+    if (x->op == IR_CONST && ir_is_shift(u->op) && (x->imm == 0 || (x->imm == ~0ull && u->op >= IR_SAR))) return u->a;
+    if (y->op == IR_CONST) {
+        // ~~x is x
+        if (u->op == IR_XOR && y->imm == ~0ull && is_not(ir, x)) return x->a;
+        return fold_identity(u, u->a, y->imm);
+    }
+    if (x->op == IR_CONST && is_commutative(u->op)) return fold_identity(u, u->b, x->imm);
+
+    // x & ~y is a single ANDN, the complement is dropped when nothing else uses it
+    if (u->op == IR_AND && is_not(ir, y)) {
+        u->op = IR_ANDN;
+        u->b = y->a;
+    } else if (u->op == IR_AND && is_not(ir, x)) {
+        u->op = IR_ANDN;
+        u->a = u->b;
+        u->b = x->a;
+    }
+    return IR_NONE;
+}
+
+#define VN_TABLE 1024 // Power of two above PVCPU_IR_MAX_UOPS, never fills up
+
+static uint32_t vn_hash(uint8_t op, uint16_t a, uint16_t b, uint64_t imm) {
+    uint64_t h = imm * 0x9E3779B97F4A7C15ull;
+    h ^= ((uint64_t)op << 32) | ((uint64_t)a << 16) | b;
+    h *= 0xFF51AFD7ED558CCDull;
+    return (uint32_t)(h >> 40) & (VN_TABLE - 1);
+}
+
+// Existing value computing `op a, b` with `imm`, IR_NONE when there is none yet. `slot` gets where to add it.
+static uint16_t vn_find(const Ir_Block* ir, const uint16_t* table, uint8_t op, uint16_t a, uint16_t b, uint64_t imm, uint32_t* slot) {
+    uint32_t s = vn_hash(op, a, b, imm);
+    while (table[s] != IR_NONE) {
+        const Ir_Uop* u = &ir->uops[table[s]];
+        if (u->op == op && u->a == a && u->b == b && u->imm == imm) break;
+        s = (s + 1) & (VN_TABLE - 1);
+    }
+    if (slot != NULL) *slot = s;
+    return table[s];
+}
+
+// Local value numbering with constant propagation. Guest register reads reuse whatever was last read
+// from or written to that register, so constants flow through registers into the ALU ops using them,
+// which fold away. Writes of the value a register already holds and duplicate computations are dropped.
+static void pass_value_numbering(Ir_Block* ir) {
+    uint16_t repl[PVCPU_IR_MAX_UOPS];
+    uint16_t table[VN_TABLE];
+    uint16_t regs[PVCPU_REG_PC + 1];
+    memset(table, 0xFF, sizeof(table));
+    memset(regs, 0xFF, sizeof(regs));
+
+    for (size_t i = 0; i < ir->count; i++) {
+        Ir_Uop* u = &ir->uops[i];
+        repl[i] = (uint16_t)i;
+        if (u->a != IR_NONE) u->a = repl[u->a];
+        if (u->b != IR_NONE) u->b = repl[u->b];
+
+        if (u->op == IR_GET) {
+            if (regs[u->reg] != IR_NONE) {
+                repl[i] = regs[u->reg];
+                kill_uop(u);
+            } else {
+                regs[u->reg] = (uint16_t)i;
+            }
+            continue;
+        }
+        if (u->op == IR_SET) {
+            if (regs[u->reg] == u->a) kill_uop(u);
+            else regs[u->reg] = u->a;
+            continue;
+        }
+        if (ir_is_alu(u->op)) {
+            uint16_t same = fold_alu(ir, u);
+            if (same != IR_NONE) {
+                repl[i] = same;
+                kill_uop(u);
+                continue;
+            }
+        }
+        if (u->op != IR_CONST && !ir_is_alu(u->op)) continue;
+
+        // Operands keep their order, the backend computes `a <op> b` in place of a
+        uint32_t slot;
+        uint16_t found = vn_find(ir, table, u->op, u->a, u->b, u->imm, &slot);
+        if (found == IR_NONE && is_commutative(u->op)) found = vn_find(ir, table, u->op, u->b, u->a, u->imm, NULL);
+        if (found != IR_NONE) {
+            repl[i] = found;
+            kill_uop(u);
+        } else {
+            table[slot] = (uint16_t)i;
+        }
+    }
+}
+
+// Compares of constants become known flags, and the branches reading them either go away or become
+// the block's exit, dropping everything after it
+static void pass_fold_branches(Ir_Block* ir) {
+    for (size_t i = 0; i < ir->count; i++) {
+        Ir_Uop* u = &ir->uops[i];
+        if (u->op == IR_FLAGS) {
+            if (u->a != IR_NONE && ir->uops[u->a].op == IR_CONST && ir->uops[u->b].op == IR_CONST) {
+                u->imm = pvcpu_compare_flags(u->cond, ir->uops[u->a].imm, ir->uops[u->b].imm);
+                u->a = IR_NONE;
+                u->b = IR_NONE;
+            }
+            continue;
+        }
+        if (u->op != IR_BRANCH || u->b == IR_NONE || ir->uops[u->b].a != IR_NONE) continue;
+
+        const Ir_Uop* flags = &ir->uops[u->b];
+        bool taken = ((flags->imm & (u->cond & ~IR_COND_INVERT)) != 0) != ((u->cond & IR_COND_INVERT) != 0);
+        if (!taken) {
+            kill_uop(u);
+            continue;
+        }
+        u->op = IR_EXIT;
+        u->cond = 0;
+        u->b = IR_NONE;
+        for (size_t j = i + 1; j < ir->count; j++) kill_uop(&ir->uops[j]);
+        return;
+    }
+}
+
+// A compare is dropped when another one overwrites the flags before anything can observe them
+static void pass_dead_flags(Ir_Block* ir) {
+    size_t pending = IR_NONE;
+    for (size_t i = 0; i < ir->count; i++) {
+        Ir_Uop* u = &ir->uops[i];
+        if (u->op == IR_FLAGS) {
+            if (pending != IR_NONE) kill_uop(&ir->uops[pending]);
+            pending = i;
+        } else if (ir_may_exit(u->op)) {
+            pending = IR_NONE;
+        }
+    }
+}
+
+// Backward guest register liveness. A write overwritten before anything can observe it is dropped,
+// one only side exits can observe before it is overwritten is marked lazy and written back on those exits.
+static void pass_dead_stores(Ir_Block* ir) {
+    uint64_t dead = 0; // Overwritten before the next observable point
+    uint64_t lazy = 0; // Overwritten before the next point that is not a side exit
+    uint16_t next_set[PVCPU_GUEST_REGS];
+
+    for (size_t i = ir->count; i-- > 0;) {
+        Ir_Uop* u = &ir->uops[i];
+        uint64_t bit = 1ull << u->reg;
+        if (u->op == IR_SET) {
+            if (dead & bit) {
+                kill_uop(u);
+                continue;
+            }
+            if (lazy & bit) {
+                u->cond = IR_SET_LAZY;
+                u->imm = next_set[u->reg];
+            }
+            dead |= bit;
+            lazy |= bit;
+            next_set[u->reg] = (uint16_t)i;
+        } else if (u->op == IR_GET) {
+            dead &= ~bit;
+            lazy &= ~bit;
+        } else if (ir_is_side_exit(u->op)) {
+            dead = 0;
+        } else if (ir_may_exit(u->op)) {
+            dead = 0;
+            lazy = 0;
+        }
+    }
+}
+
+// Drops pure micro-ops whose value nothing uses
+static void pass_dead_code(Ir_Block* ir) {
+    uint16_t uses[PVCPU_IR_MAX_UOPS];
+    ir_count_uses(ir, uses);
+
+    for (size_t i = ir->count; i-- > 0;) {
+        Ir_Uop* u = &ir->uops[i];
+        if (!ir_is_pure(u->op) || uses[i] != 0) continue;
+        if (u->a != IR_NONE) uses[u->a]--;
+        if (u->b != IR_NONE) uses[u->b]--;
+        kill_uop(u);
+    }
+}
+
+typedef void (*Ir_Pass)(Ir_Block* ir);
+
+// Dead flags and dead stores run before dead code so the operands of what they drop go too
+static const Ir_Pass passes[] = {
+    pass_value_numbering,
+    pass_fold_branches,
+    pass_dead_flags,
+    pass_dead_stores,
+    pass_dead_code
+};
+
+void ir_optimize(Ir_Block* ir) {
+    for (size_t i = 0; i < sizeof(passes) / sizeof(passes[0]); i++) {
+        passes[i](ir);
+    }
+}
@@ -4,117 +4,1222 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <pvcpu-codecache.h>
 #include <pvcpu-jit.h>
 #include <pvcpu-helpers.h>
 #include <pvcpu-isa.h>
+#include <pvcpu-ir.h>
+#include <pvcpu-regalloc.h>
+#include <pvcpu-guestmem.h>
+#include <pvcpu-tcache.h>
+#include <pvcpu-runtime.h>
 
-typedef void (*PVCpu_Handler)(Jit_Buf* buf, PVCpu_Inst* inst, uint64_t value, uint64_t* extflags, int extflag_count);
-static PVCpu_Handler handlers[4096]; // 12-bits
+#define LOC_NONE -1 // Constants are materialized where they are used
+#define LOC_SLOT 16 // LOC_SLOT + n is frame slot n
 
-typedef void (*JitFn)(PVCpu_State*);
+// Host registers the backend computes values in, everything else is taken by the allocator or rbx/rsp
+static const int scratch_pool[] = {HOST_RAX, HOST_RCX, HOST_RDX, HOST_R10, HOST_R11};
+#define SCRATCH_COUNT (sizeof(scratch_pool) / sizeof(scratch_pool[0]))
 
-static void load_pvcpu_reg(Jit_Buf* buf, int host_reg, int pvcpu_reg) {
-    #ifdef __x86_64__
-        uint32_t offset = offsetof(PVCpu_State, regs) + pvcpu_reg * 8;
-
-        emit_u8(buf, 0b01001000); // REX.W = 1
-        emit_u8(buf, 0x8B); // mov r64, r/m64
-        #ifdef _WIN32
-        uint8_t modrm = 0b10000001 | ((host_reg & 7) << 3); // RCX
-        #else
-        uint8_t modrm = 0b10000111 | ((host_reg & 7) << 3); // RDI
-        #endif
-        emit_u8(buf, modrm); // modrm [rdi + disp32]
-        emit_u32(buf, offset);
-    #endif
+typedef struct {
+    Jit_Buf* buf;
+    Reg_Alloc* ra;
+    const Ir_Block* ir;
+    PVCpu_Block* block; // Block being translated, collects the patchable exits
+    uint64_t pc; // Guest address of the micro-op being emitted, exceptions are raised there
+    size_t at; // Micro-op being emitted
+    size_t memsize; // Guest memory size, fixed for the whole run
+    const uint8_t* flags_stub; // See emit_flags_stub()
+    bool guarded; // Guest memory has a guard zone, accesses need no bounds check (see Guest_Mem)
+    uint8_t span_shift;
+    PVCpu_Host_Features host; // Extensions the generated code may use
+    bool fuel; // Metered, the body charges `inst_count` up front and early exits refund what they skip
+    uint32_t inst_count;
+    bool failed; // Ran out of frame slots, the block stays interpreted
+    bool relocating; // The code is moved later, absolute addresses are recorded (see emit_abs())
+    const uint8_t* entry;
+
+    Jit_Buf cold; // Pads of the guarded accesses, copied behind the block once it is done
+    const uint8_t* pads; // Where they ended up
+    size_t guard_count;
+    const uint8_t* guard_site[PVCPU_IR_MAX_UOPS]; // Faulting access
+    uint32_t guard_pad[PVCPU_IR_MAX_UOPS]; // Offset of its pad in `cold`
+    size_t reloc_count;
+    PVCpu_Reloc relocs[PVCPU_IR_MAX_UOPS * 2]; // At most a helper or flags stub call and a chain exit per micro-op
+    bool reloc_cold[PVCPU_IR_MAX_UOPS * 2]; // Offset is into `cold` until the pads are placed
+
+    int8_t loc[PVCPU_IR_MAX_UOPS]; // Host register or frame slot holding each value
+    uint16_t last_use[PVCPU_IR_MAX_UOPS];
+    uint16_t owner[16]; // Value held by each scratch register, IR_NONE when free
+    uint16_t guest_val[PVCPU_GUEST_REGS]; // Value each allocated guest register's host register holds
+    uint16_t slot_owner[PVCPU_RA_SLOTS];
+    uint16_t pending[PVCPU_GUEST_REGS]; // Value of each lazy write to an unallocated guest register, stored on side exits only
+} Jit_Ctx;
+
+// Unlinked chain exit: alignment + jmp + PC and exit stores + epilogue
+#define STUB_MAX (3 + 5 + 34 + PVCPU_RA_EPILOGUE_MAX)
+// Spill + lazy writes, each at worst a movabs and a store
+#define WRITEBACK_MAX (PVCPU_RA_SPILL_MAX + PVCPU_GUEST_REGS * 17)
+// Leaving a block: target + refund + write-back + stub, also covers the dynamic PC store + epilogue
+#define EXIT_MAX (10 + 7 + WRITEBACK_MAX + STUB_MAX)
+// Helper call: target + refund + write-back + PC store + arguments + call + exit check + stub + epilogue
+#define HELPER_EXIT_MAX (10 + 7 + WRITEBACK_MAX + 24 + 32 + 12 + 13 + STUB_MAX + PVCPU_RA_EPILOGUE_MAX)
+// Operands, evictions and relocations of one micro-op besides its exits
+#define UOP_MAX 128
+// Shadow return stack: a call's push + the exit it returns through, or a return's prediction
+#define RAS_MAX (64 + 3 + 5 + STUB_MAX)
+// Fuel check in front of the body + the stub leaving when too little is left
+#define FUEL_CHECK_MAX (7 + 6 + 7 + 10 + 7 + PVCPU_RA_EPILOGUE_MAX)
+
+static int32_t reg_offset(int pvcpu_reg) {
+    return (int32_t)(offsetof(PVCpu_State, regs) + pvcpu_reg * 8);
 }
 
-static void store_pvcpu_reg(Jit_Buf* buf, int pvcpu_reg, int host_reg) {
-    #ifdef __x86_64__
-        uint32_t offset = offsetof(PVCpu_State, regs) + pvcpu_reg * 8;
-
-        emit_u8(buf, 0b01001000); // REX.W = 1
-        emit_u8(buf, 0x89); // mov r/m64, r64
-        #ifdef _WIN32
-        uint8_t modrm = 0b10000001 | ((host_reg & 7) << 3); // RCX
-        #else
-        uint8_t modrm = 0b10000111 | ((host_reg & 7) << 3); // RDI
-        #endif
-        emit_u8(buf, modrm);
-        emit_u32(buf, offset);
-    #endif
+static bool is_scratch(int host) {
+    for (size_t i = 0; i < SCRATCH_COUNT; i++) {
+        if (scratch_pool[i] == host) return true;
+    }
+    return false;
+}
+
+static bool in_reg(const Jit_Ctx* ctx, uint16_t v) {
+    return ctx->loc[v] >= 0 && ctx->loc[v] < LOC_SLOT;
+}
+
+// Constant that can be encoded as a sign extended imm32 instead of a register
+static bool is_imm32(const Jit_Ctx* ctx, uint16_t v) {
+    const Ir_Uop* u = &ctx->ir->uops[v];
+    return u->op == IR_CONST && !in_reg(ctx, v) && (int64_t)u->imm == (int32_t)u->imm;
+}
+
+static uint32_t reg_mask(const Jit_Ctx* ctx, uint16_t v) {
+    return v != IR_NONE && in_reg(ctx, v) ? 1u << ctx->loc[v] : 0;
+}
+
+static void place(Jit_Ctx* ctx, uint16_t v, int host) {
+    ctx->loc[v] = (int8_t)host;
+    if (is_scratch(host)) ctx->owner[host] = v;
+}
+
+// Parks the value of scratch register `host` in a frame slot, constants are simply forgotten
+static void evict(Jit_Ctx* ctx, int host) {
+    uint16_t v = ctx->owner[host];
+    ctx->owner[host] = IR_NONE;
+    ctx->loc[v] = LOC_NONE;
+    if (ctx->ir->uops[v].op == IR_CONST) return;
+
+    for (int s = 0; s < PVCPU_RA_SLOTS; s++) {
+        if (ctx->slot_owner[s] != IR_NONE) continue;
+        emit_store64(ctx->buf, HOST_RSP, ra_slot(s), host);
+        ctx->slot_owner[s] = v;
+        ctx->loc[v] = (int8_t)(LOC_SLOT + s);
+        return;
+    }
+    ctx->failed = true;
+}
+
+// Free scratch register outside `pinned`, evicting the value needed furthest ahead when all are taken
+static int take_scratch(Jit_Ctx* ctx, uint32_t pinned) {
+    int victim = -1;
+    for (size_t i = 0; i < SCRATCH_COUNT; i++) {
+        int r = scratch_pool[i];
+        if (pinned & (1u << r)) continue;
+        if (ctx->owner[r] == IR_NONE) return r;
+        if (victim < 0 || ctx->last_use[ctx->owner[r]] > ctx->last_use[ctx->owner[victim]]) victim = r;
+    }
+    if (victim < 0) {
+        ctx->failed = true;
+        return HOST_RAX;
+    }
+    evict(ctx, victim);
+    return victim;
+}
+
+// Host register holding `v`, materializing constants and reloading parked values
+static int value_reg(Jit_Ctx* ctx, uint16_t v, uint32_t pinned) {
+    int l = ctx->loc[v];
+    if (l >= 0 && l < LOC_SLOT) return l;
+
+    int r = take_scratch(ctx, pinned);
+    if (l >= LOC_SLOT) {
+        emit_load64(ctx->buf, r, HOST_RSP, ra_slot(l - LOC_SLOT));
+        ctx->slot_owner[l - LOC_SLOT] = IR_NONE;
+    } else {
+        emit_movimm64(ctx->buf, r, ctx->ir->uops[v].imm);
+    }
+    place(ctx, v, r);
+    return r;
+}
+
+// Moves live values out of `host` before it is overwritten, except `keep`
+static void vacate(Jit_Ctx* ctx, int host, uint16_t keep) {
+    for (size_t v = 0; v < ctx->at; v++) {
+        if (v == keep || ctx->loc[v] != host || ctx->last_use[v] <= ctx->at) continue;
+        int r = take_scratch(ctx, 1u << host);
+        emit_mov64(ctx->buf, r, host);
+        place(ctx, (uint16_t)v, r);
+    }
+}
+
+// Frees the registers and slots of values that are not used past the current micro-op
+static void release_dead(Jit_Ctx* ctx) {
+    for (int r = 0; r < 16; r++) {
+        if (ctx->owner[r] != IR_NONE && ctx->last_use[ctx->owner[r]] <= ctx->at) ctx->owner[r] = IR_NONE;
+    }
+    for (int s = 0; s < PVCPU_RA_SLOTS; s++) {
+        if (ctx->slot_owner[s] != IR_NONE && ctx->last_use[ctx->slot_owner[s]] <= ctx->at) ctx->slot_owner[s] = IR_NONE;
+    }
+}
+
+// Makes PVCpu_State architectural on the way out: spills dirty registers and stores the pending lazy
+// writes. Only clobbers a temporary other than `busy`, and tracks nothing since the path leaves the block.
+static void emit_writeback(Jit_Ctx* ctx, int busy) {
+    ra_emit_spill(ctx->buf, ctx->ra);
+
+    // Values already in registers first, the temporary may be holding one of them
+    for (int g = 0; g < PVCPU_GUEST_REGS; g++) {
+        uint16_t v = ctx->pending[g];
+        if (v != IR_NONE && in_reg(ctx, v)) emit_store64(ctx->buf, PVCPU_HOST_STATE, reg_offset(g), ctx->loc[v]);
+    }
+    int temp = busy == HOST_R11 ? HOST_R10 : HOST_R11;
+    for (int g = 0; g < PVCPU_GUEST_REGS; g++) {
+        uint16_t v = ctx->pending[g];
+        if (v == IR_NONE || in_reg(ctx, v)) continue;
+        if (is_imm32(ctx, v)) {
+            emit_op_mi(ctx->buf, X86_MOV, 8, x86_mem(PVCPU_HOST_STATE, reg_offset(g)), (int32_t)ctx->ir->uops[v].imm);
+            continue;
+        }
+        if (ctx->loc[v] >= LOC_SLOT) emit_load64(ctx->buf, temp, HOST_RSP, ra_slot(ctx->loc[v] - LOC_SLOT));
+        else emit_movimm64(ctx->buf, temp, ctx->ir->uops[v].imm);
+        emit_store64(ctx->buf, PVCPU_HOST_STATE, reg_offset(g), temp);
+    }
+}
+
+// Loads the absolute host address `value`. When the code is persisted or compiled ahead of time it is
+// always a full movabs whose imm64 is recorded, so it can be rewritten wherever the code ends up.
+static void emit_abs(Jit_Ctx* ctx, int dst, uint8_t kind, uint8_t arg, const void* value) {
+    if (!ctx->relocating) {
+        emit_movimm64(ctx->buf, dst, (uint64_t)(uintptr_t)value);
+        return;
+    }
+    if (ctx->reloc_count == sizeof(ctx->relocs) / sizeof(ctx->relocs[0])) {
+        ctx->failed = true;
+        return;
+    }
+    uint8_t* field = emit_movabs64(ctx->buf, dst, (uint64_t)(uintptr_t)value);
+    bool cold = ctx->buf == &ctx->cold;
+    PVCpu_Reloc* r = &ctx->relocs[ctx->reloc_count];
+    r->offset = (uint32_t)(field - (cold ? ctx->cold.exec : ctx->entry));
+    r->kind = kind;
+    r->arg = arg;
+    ctx->reloc_cold[ctx->reloc_count++] = cold;
+}
+
+// Patchable exit to a known guest address, the state must have been written back already.
+// Until the dispatcher links it the jump falls straight into a stub returning to the dispatcher.
+static void emit_chain_exit(Jit_Ctx* ctx, uint64_t target) {
+    PVCpu_Block_Exit* exit = &ctx->block->exits[ctx->block->exit_count++];
+
+    // Keep the rel32 4 byte aligned so relinking is a single atomic store
+    while (((uintptr_t)jit_pos(ctx->buf) + 1) & 3) emit_u8(ctx->buf, 0x90); // nop
+    exit->site = emit_jmp32(ctx->buf);
+    exit->stub = jit_pos(ctx->buf);
+    exit->target = target;
+    exit->block = ctx->block;
+    exit->linked = NULL;
+    exit->next_in = NULL;
+
+    emit_movimm64(ctx->buf, HOST_RAX, target);
+    emit_store64(ctx->buf, PVCPU_HOST_STATE, reg_offset(PVCPU_REG_PC), HOST_RAX);
+    emit_abs(ctx, HOST_RAX, PVCPU_RELOC_EXIT, (uint8_t)(exit - ctx->block->exits), exit);
+    emit_store64(ctx->buf, PVCPU_HOST_STATE, offsetof(PVCpu_State, last_exit), HOST_RAX);
+    ra_emit_epilogue(ctx->buf, ctx->ra);
+}
+
+// Leaves the block continuing at the guest address held in `target`
+static void emit_exit(Jit_Ctx* ctx, int target) {
+    emit_writeback(ctx, target);
+    emit_store64(ctx->buf, PVCPU_HOST_STATE, reg_offset(PVCPU_REG_PC), target);
+    ra_emit_epilogue(ctx->buf, ctx->ra);
+}
+
+static void emit_exit_to(Jit_Ctx* ctx, uint64_t pc) {
+    emit_writeback(ctx, -1);
+    emit_chain_exit(ctx, pc);
+}
+
+// Pushes return address `ret` onto the shadow return stack, returns the rel32 field of the address
+// of the exit the return comes back through, which is emitted later
+static uint8_t* emit_ras_push(Jit_Ctx* ctx, uint64_t ret) {
+    int n = take_scratch(ctx, 0);
+    int t = take_scratch(ctx, 1u << n);
+    emit_load64(ctx->buf, n, PVCPU_HOST_STATE, offsetof(PVCpu_State, ras_top));
+    emit_op_rm(ctx->buf, X86_LEA, t, x86_mem(n, 1));
+    emit_store64(ctx->buf, PVCPU_HOST_STATE, offsetof(PVCpu_State, ras_top), t);
+    emit_op_ri(ctx->buf, X86_AND, n, PVCPU_RAS_SIZE - 1);
+    emit_shift_ri(ctx->buf, X86_SHL, n, 4);
+    emit_movimm64(ctx->buf, t, ret);
+    emit_op_mr(ctx->buf, X86_MOV, x86_mem_indexed(PVCPU_HOST_STATE, n, 0, offsetof(PVCpu_State, ras)), t);
+    uint8_t* field = emit_lea_rip32(ctx->buf, t);
+    emit_op_mr(ctx->buf, X86_MOV, x86_mem_indexed(PVCPU_HOST_STATE, n, 0, offsetof(PVCpu_State, ras) + 8), t);
+    return field;
+}
+
+// Leaves the block returning to the guest address held in `target`. When the newest shadow return
+// stack entry predicted it, this jumps through the exit of the calling block instead of the dispatcher.
+static void emit_return(Jit_Ctx* ctx, int target) {
+    _Static_assert(sizeof(PVCpu_Ras_Entry) == 16, "entries are indexed with a shift");
+    emit_writeback(ctx, target);
+    emit_store64(ctx->buf, PVCPU_HOST_STATE, reg_offset(PVCPU_REG_PC), target);
+
+    int n = target == HOST_RAX ? HOST_RCX : HOST_RAX;
+    emit_load64(ctx->buf, n, PVCPU_HOST_STATE, offsetof(PVCpu_State, ras_top));
+    emit_op_rr(ctx->buf, X86_TEST, n, n);
+    uint8_t* empty = emit_jcc32(ctx->buf, X86_CC_E);
+    emit_op_ri(ctx->buf, X86_SUB, n, 1);
+    emit_store64(ctx->buf, PVCPU_HOST_STATE, offsetof(PVCpu_State, ras_top), n);
+    emit_op_ri(ctx->buf, X86_AND, n, PVCPU_RAS_SIZE - 1);
+    emit_shift_ri(ctx->buf, X86_SHL, n, 4);
+    emit_op_rm(ctx->buf, X86_CMP, target, x86_mem_indexed(PVCPU_HOST_STATE, n, 0, offsetof(PVCpu_State, ras)));
+    uint8_t* miss = emit_jcc32(ctx->buf, X86_CC_NE);
+    emit_jmp_mem(ctx->buf, x86_mem_indexed(PVCPU_HOST_STATE, n, 0, offsetof(PVCpu_State, ras) + 8));
+
+    jit_patch_rel32(ctx->buf, empty, jit_pos(ctx->buf));
+    jit_patch_rel32(ctx->buf, miss, jit_pos(ctx->buf));
+    ra_emit_epilogue(ctx->buf, ctx->ra);
+}
+
+#ifdef _WIN32
+static const int arg_regs[3] = {HOST_RCX, HOST_RDX, HOST_R8};
+#else
+static const int arg_regs[3] = {HOST_RDI, HOST_RSI, HOST_RDX};
+#endif
+
+// Calls a runtime helper taking (state, arg1, arg2) with the guest state written back.
+// arg2 comes from host register `arg2_host`, or is the constant `arg2` when that is -1.
+static void emit_helper_call(Jit_Ctx* ctx, uint8_t helper, uint64_t arg1, int arg2_host, uint64_t arg2) {
+    emit_writeback(ctx, arg2_host);
+    if (arg2_host >= 0) emit_mov64(ctx->buf, arg_regs[2], arg2_host);
+    else emit_movimm64(ctx->buf, arg_regs[2], arg2);
+    // PC of the instruction, for exceptions raised by the helper
+    emit_movimm64(ctx->buf, HOST_RCX, ctx->pc);
+    emit_store64(ctx->buf, PVCPU_HOST_STATE, reg_offset(PVCPU_REG_PC), HOST_RCX);
+
+    emit_movimm64(ctx->buf, arg_regs[1], arg1);
+    emit_mov64(ctx->buf, arg_regs[0], PVCPU_HOST_STATE);
+    emit_abs(ctx, HOST_RAX, helper, 0, pvcpu_helper(helper));
+    emit_call_reg(ctx->buf, HOST_RAX);
+}
+
+// Leaves the block through a helper which sets PC itself
+static void emit_helper_exit(Jit_Ctx* ctx, uint8_t helper, uint64_t arg1, int arg2_host, uint64_t arg2) {
+    emit_helper_call(ctx, helper, arg1, arg2_host, arg2);
+    ra_emit_epilogue(ctx->buf, ctx->ra);
+}
+
+// Gives back the fuel of the instructions behind the current one when the path leaves the block here
+static void emit_refund(Jit_Ctx* ctx) {
+    uint32_t skipped = ctx->inst_count - ctx->ir->uops[ctx->at].retired;
+    if (ctx->fuel && skipped > 0) emit_op_ri(ctx->buf, X86_ADD, PVCPU_HOST_FUEL, (int32_t)skipped);
+}
+
+// The faulting instruction counts as run
+static void emit_raise(Jit_Ctx* ctx, uint64_t code) {
+    emit_refund(ctx);
+    emit_helper_exit(ctx, PVCPU_RELOC_HELPER_RAISE, ctx->pc, -1, code);
 }
 
-static void op_add(Jit_Buf* buf, PVCpu_Inst* inst, uint64_t value, uint64_t* extflags, int extflag_count) {
-    // add [dest], [src] & add [mem], [src] & add [dest], [mem] & add [dest], imm
-    if (inst->mode == REG_REG) {
-        #ifdef __x86_64__
-            load_pvcpu_reg(buf, 0, inst->src);
-            load_pvcpu_reg(buf, 3, inst->dest);
-            emit_u8(buf, 0b01001000); // REX.W = 1
-            emit_u8(buf, 0x01); // add r/m64, r64
-            emit_u8(buf, 0b11011000); // modrm:rbx, rax
+// Leaves the block to the guest address `target`, chained when it is a constant.
+// `target_host` has to be loaded up front when it is not, so a conditional exit leaves no state behind.
+static void emit_leave(Jit_Ctx* ctx, uint16_t target, int target_host) {
+    const Ir_Uop* t = &ctx->ir->uops[target];
+    emit_refund(ctx);
+    if (t->op == IR_CONST) emit_exit_to(ctx, t->imm);
+    else emit_exit(ctx, target_host);
+}
+
+static int leave_target(Jit_Ctx* ctx, uint16_t target) {
+    if (ctx->ir->uops[target].op == IR_CONST) return -1;
+    return value_reg(ctx, target, 0);
+}
+
+static void uop_get(Jit_Ctx* ctx, const Ir_Uop* u) {
+    int host = ra_host(ctx->ra, u->reg);
+    if (host >= 0) {
+        ctx->loc[ctx->at] = (int8_t)host;
+        ctx->guest_val[u->reg] = (uint16_t)ctx->at;
+        return;
+    }
+    int r = take_scratch(ctx, 0);
+    emit_load64(ctx->buf, r, PVCPU_HOST_STATE, reg_offset(u->reg));
+    place(ctx, (uint16_t)ctx->at, r);
+}
+
+static void uop_set(Jit_Ctx* ctx, const Ir_Uop* u) {
+    int host = ra_host(ctx->ra, u->reg);
+    if (host < 0) {
+        // Overwritten before anything but a side exit reads it, the side exits store it themselves
+        if (u->cond & IR_SET_LAZY) {
+            ctx->pending[u->reg] = u->a;
+            return;
+        }
+        ctx->pending[u->reg] = IR_NONE;
+        if (is_imm32(ctx, u->a)) {
+            emit_op_mi(ctx->buf, X86_MOV, 8, x86_mem(PVCPU_HOST_STATE, reg_offset(u->reg)), (int32_t)ctx->ir->uops[u->a].imm);
+        } else {
+            emit_store64(ctx->buf, PVCPU_HOST_STATE, reg_offset(u->reg), value_reg(ctx, u->a, 0));
+        }
+        return;
+    }
+
+    if (ctx->loc[u->a] != host) {
+        vacate(ctx, host, u->a);
+        if (ctx->ir->uops[u->a].op == IR_CONST && !in_reg(ctx, u->a)) {
+            emit_movimm64(ctx->buf, host, ctx->ir->uops[u->a].imm);
+        } else {
+            int src = value_reg(ctx, u->a, 0);
+            emit_mov64(ctx->buf, host, src);
+            // The guest register becomes the value's home, freeing the scratch register
+            if (is_scratch(src)) {
+                ctx->owner[src] = IR_NONE;
+                ctx->loc[u->a] = (int8_t)host;
+            }
+        }
+    }
+    ctx->guest_val[u->reg] = u->a;
+    ra_mark_dirty(ctx->ra, u->reg);
+}
 
-            store_pvcpu_reg(buf, inst->dest, 3);
-        #endif
+// Next micro-op that was not removed by a pass
+static const Ir_Uop* next_uop(const Jit_Ctx* ctx) {
+    for (size_t i = ctx->at + 1; i < ctx->ir->count; i++) {
+        if (ctx->ir->uops[i].op != IR_NOP) return &ctx->ir->uops[i];
     }
+    return NULL;
 }
 
-static void init_handlers() {
-    for (int i = 0; i < 4096; i++) {
-        handlers[i] = NULL;
+// Register the result of `a <op> b` is computed in, outside `pinned`. With `copy_a` it holds a already,
+// otherwise the caller reads a with value_reg() for a non destructive instruction.
+static int result_reg(Jit_Ctx* ctx, const Ir_Uop* u, uint32_t pinned, bool copy_a) {
+    uint16_t v = (uint16_t)ctx->at;
+    bool a_dies = ctx->last_use[u->a] == ctx->at;
+    int dst = -1;
+
+    // reg = reg <op> x is computed straight in the guest register's host register
+    const Ir_Uop* next = next_uop(ctx);
+    if (next != NULL && next->op == IR_SET && next->a == v) {
+        int host = ra_host(ctx->ra, next->reg);
+        if (host >= 0 && ctx->guest_val[next->reg] == u->a && !(pinned & (1u << host))) {
+            dst = host;
+            vacate(ctx, host, IR_NONE);
+        }
+    }
+    if (dst < 0 && a_dies && in_reg(ctx, u->a) && is_scratch(ctx->loc[u->a]) && !(pinned & (1u << ctx->loc[u->a]))) dst = ctx->loc[u->a];
+    if (dst < 0) {
+        dst = take_scratch(ctx, pinned | reg_mask(ctx, u->a) | reg_mask(ctx, u->b));
+        ctx->owner[dst] = v; // Claimed before materializing a, which may need another register
+        if (!copy_a) {
+            // Read by the caller
+        } else if (ctx->ir->uops[u->a].op == IR_CONST && !in_reg(ctx, u->a)) {
+            emit_movimm64(ctx->buf, dst, ctx->ir->uops[u->a].imm);
+        } else {
+            emit_mov64(ctx->buf, dst, value_reg(ctx, u->a, pinned | (1u << dst) | reg_mask(ctx, u->b)));
+        }
     }
+    place(ctx, v, dst);
+    return dst;
+}
 
-    handlers[OP_ADD] = op_add;
+static void uop_alu(Jit_Ctx* ctx, const Ir_Uop* u) {
+    // Host instruction of each ALU micro-op, indexed from IR_ADD
+    static const X86_Op alu_ops[] = {X86_ADD, X86_SUB, X86_AND, X86_OR, X86_XOR};
+    int dst = result_reg(ctx, u, 0, true);
+
+    int i = u->op - IR_ADD;
+    if (u->op == IR_XOR && ctx->ir->uops[u->b].op == IR_CONST && ctx->ir->uops[u->b].imm == ~0ull) {
+        emit_not(ctx->buf, dst);
+    } else if (is_imm32(ctx, u->b)) {
+        emit_op_ri(ctx->buf, alu_ops[i], dst, (int32_t)ctx->ir->uops[u->b].imm);
+    } else {
+        emit_op_rr(ctx->buf, alu_ops[i], dst, value_reg(ctx, u->b, 1u << dst));
+    }
 }
 
-void pvcpu_run(PVCpu_Inst* insts, uint64_t* values, uint64_t** extflags, int* extflag_count, size_t inst_num, size_t inst_cap, size_t memsize, size_t instsize, uint8_t run_code) {
-    init_handlers();
-    
-    Jit_Buf buf = {0};
-    PVCpu_State cpu_state = {0};
-    jit_init(&buf, instsize);
-    if (buf.data == NULL) {
-        perror("Error: Instruction memory allocation failed!");
+// a & ~b, a single andn with BMI1
+static void uop_andn(Jit_Ctx* ctx, const Ir_Uop* u) {
+    if (ctx->host.bmi1) {
+        int dst = result_reg(ctx, u, 0, false);
+        int b = value_reg(ctx, u->b, (1u << dst) | reg_mask(ctx, u->a));
+        emit_andn(ctx->buf, dst, b, value_reg(ctx, u->a, (1u << dst) | (1u << b)));
         return;
     }
-    cpu_state.memory = (uint8_t*)malloc(memsize);
-    if (cpu_state.memory == NULL) {
-        perror("Error: Memory allocation failed!");
-        free(buf.data);
+
+    int dst = result_reg(ctx, u, 0, true);
+    int b = value_reg(ctx, u->b, 1u << dst);
+    // A dying b is complemented in place
+    if (ctx->last_use[u->b] != ctx->at || !is_scratch(b)) {
+        int t = take_scratch(ctx, (1u << dst) | (1u << b));
+        emit_mov64(ctx->buf, t, b);
+        b = t;
+    }
+    emit_not(ctx->buf, b);
+    emit_op_rr(ctx->buf, X86_AND, dst, b);
+}
+
+// Low 64 bits of a * b, the same signed or unsigned. A constant b takes the three operand form, which
+// leaves a alone.
+static void uop_mul(Jit_Ctx* ctx, const Ir_Uop* u) {
+    if (is_imm32(ctx, u->b)) {
+        int dst = result_reg(ctx, u, 0, false);
+        emit_imul_imm(ctx->buf, dst, value_reg(ctx, u->a, 1u << dst), (int32_t)ctx->ir->uops[u->b].imm);
         return;
     }
-    cpu_state.memsize = memsize;
+    int dst = result_reg(ctx, u, 0, true);
+    emit_imul(ctx->buf, dst, value_reg(ctx, u->b, 1u << dst));
+}
 
-    for (size_t i = 0; i < inst_num; i++) {
-        PVCpu_Inst* inst = &insts[i];
-        if (inst->opcode > 4096) continue; // Just continue so the code doesn't break incase they run it! (Though validator will catch it)
-        handlers[inst->opcode](&buf, inst, values[i], extflags[i], extflag_count[i]);
+// Makes scratch register `host` available to an instruction using it implicitly (shift counts, divides),
+// moving its live value to a scratch register outside `pinned`
+static void free_fixed(Jit_Ctx* ctx, int host, uint32_t pinned) {
+    uint16_t v = ctx->owner[host];
+    if (v == IR_NONE) return;
+    ctx->owner[host] = IR_NONE;
+    if (ctx->last_use[v] <= ctx->at) return;
+    int r = take_scratch(ctx, pinned | (1u << host));
+    emit_mov64(ctx->buf, r, host);
+    place(ctx, v, r);
+}
+
+// Shifts and rotates, the host masks the count to 6 bits like the guest does. BMI2 has non destructive
+// forms that also leave rcx alone: shlx/shrx/sarx for variable counts and rorx for constant rotates.
+static void uop_shift(Jit_Ctx* ctx, const Ir_Uop* u) {
+    // Host instruction of each shift micro-op, indexed from IR_SHL
+    static const X86_Shift shift_ops[] = {X86_SHL, X86_SHR, X86_SAR, X86_ROL, X86_ROR};
+    X86_Shift op = shift_ops[u->op - IR_SHL];
+    bool rotate = u->op == IR_ROL || u->op == IR_ROR;
+    const Ir_Uop* count = &ctx->ir->uops[u->b];
 
-        if (buf.size > buf.capacity) {
-            fprintf(stderr, "Error: Not enough memory to store instructions, maybe try allocating a bit more?\n");
-            free(buf.data);
-            free(cpu_state.memory);
+    if (count->op == IR_CONST && !in_reg(ctx, u->b)) {
+        uint8_t c = (uint8_t)(count->imm & 63);
+        if (rotate && ctx->host.bmi2) {
+            int dst = result_reg(ctx, u, 0, false);
+            // rol by c is ror by 64 - c
+            emit_rorx(ctx->buf, dst, value_reg(ctx, u->a, 1u << dst), (uint8_t)((u->op == IR_ROR ? c : 64 - c) & 63));
             return;
         }
+        emit_shift_ri(ctx->buf, op, result_reg(ctx, u, 0, true), c);
+        return;
+    }
+
+    if (!rotate && ctx->host.bmi2) {
+        int dst = result_reg(ctx, u, 0, false);
+        int b = value_reg(ctx, u->b, (1u << dst) | reg_mask(ctx, u->a));
+        emit_shiftx(ctx->buf, op, dst, value_reg(ctx, u->a, (1u << dst) | (1u << b)), b);
+        return;
+    }
+
+    int dst = result_reg(ctx, u, 1u << HOST_RCX, true);
+    if (ctx->loc[u->b] != HOST_RCX) {
+        free_fixed(ctx, HOST_RCX, (1u << dst) | reg_mask(ctx, u->b));
+        emit_mov64(ctx->buf, HOST_RCX, value_reg(ctx, u->b, (1u << dst) | (1u << HOST_RCX)));
+    }
+    emit_shift_cl(ctx->buf, op, dst);
+}
+
+// Records the compare in PVCpu_State, branches of the block compare again on the host
+static void uop_flags(Jit_Ctx* ctx, const Ir_Uop* u) {
+    if (u->a == IR_NONE) {
+        emit_op_mi(ctx->buf, X86_MOV, 8, x86_mem(PVCPU_HOST_STATE, offsetof(PVCpu_State, flags)), (int32_t)u->imm);
+        emit_op_mi(ctx->buf, X86_MOV, 4, x86_mem(PVCPU_HOST_STATE, offsetof(PVCpu_State, flags_op)), 0);
+        return;
+    }
+
+    const uint16_t operands[2] = {u->a, u->b};
+    const int32_t offsets[2] = {offsetof(PVCpu_State, flags_a), offsetof(PVCpu_State, flags_b)};
+    for (int i = 0; i < 2; i++) {
+        uint16_t v = operands[i];
+        if (is_imm32(ctx, v)) emit_op_mi(ctx->buf, X86_MOV, 8, x86_mem(PVCPU_HOST_STATE, offsets[i]), (int32_t)ctx->ir->uops[v].imm);
+        else emit_store64(ctx->buf, PVCPU_HOST_STATE, offsets[i], value_reg(ctx, v, 0));
+    }
+    emit_op_mi(ctx->buf, X86_MOV, 4, x86_mem(PVCPU_HOST_STATE, offsetof(PVCpu_State, flags_op)), u->cond);
+}
+
+// Host condition code equivalent to a jcc mask after `cmp a, b` (or `test a, b`), -1 when there is none
+static int host_cc(uint8_t opcode, uint8_t mask) {
+    bool u = opcode == OP_UCMP;
+    switch (mask) {
+        case PVCPU_FLAG_Z: return X86_CC_E;
+        case PVCPU_FLAG_L: return u ? X86_CC_B : X86_CC_L;
+        case PVCPU_FLAG_G: return u ? X86_CC_A : X86_CC_G;
+        case PVCPU_FLAG_L | PVCPU_FLAG_Z: return u ? X86_CC_BE : X86_CC_LE;
+        case PVCPU_FLAG_G | PVCPU_FLAG_Z: return u ? X86_CC_AE : X86_CC_GE;
+        case PVCPU_FLAG_L | PVCPU_FLAG_G: return X86_CC_NE;
+        default: return -1;
+    }
+}
+
+// Compares a with b of `flags` on the host, test clears OF so signed conditions read the sign of a & b
+static void emit_compare(Jit_Ctx* ctx, const Ir_Uop* flags) {
+    int a = value_reg(ctx, flags->a, reg_mask(ctx, flags->b));
+    if (flags->cond != OP_TEST && is_imm32(ctx, flags->b)) {
+        emit_op_ri(ctx->buf, X86_CMP, a, (int32_t)ctx->ir->uops[flags->b].imm);
+    } else {
+        emit_op_rr(ctx->buf, flags->cond == OP_TEST ? X86_TEST : X86_CMP, a, value_reg(ctx, flags->b, 1u << a));
+    }
+}
+
+// Leaves `t` = addr + 8 when [addr, addr + 8) lies in guest memory, raising `code` otherwise
+static void emit_bounds_check(Jit_Ctx* ctx, int addr, int t, uint64_t code) {
+    emit_mov64(ctx->buf, t, addr);
+    emit_op_ri(ctx->buf, X86_ADD, t, 8);
+    uint8_t* wrapped = emit_jcc32(ctx->buf, X86_CC_C);
+    emit_op_rm(ctx->buf, X86_CMP, t, x86_mem(PVCPU_HOST_STATE, offsetof(PVCpu_State, memsize)));
+    uint8_t* inside = emit_jcc32(ctx->buf, X86_CC_BE);
+    jit_patch_rel32(ctx->buf, wrapped, jit_pos(ctx->buf));
+    emit_raise(ctx, code);
+    jit_patch_rel32(ctx->buf, inside, jit_pos(ctx->buf));
+}
+
+// Leaves the host address of guest address `addr` in `t`. Addresses past the guarded span are mapped
+// to the start of the guard zone, everything else either lies in guest memory or faults.
+static void emit_guest_addr(Jit_Ctx* ctx, int addr, int t) {
+    if (ctx->span_shift == 32) {
+        emit_mov32(ctx->buf, t, addr);
+        emit_op_rr(ctx->buf, X86_CMP, t, addr);
+    } else {
+        emit_mov64(ctx->buf, t, addr);
+        emit_shift_ri(ctx->buf, X86_SHR, t, ctx->span_shift); // Sets ZF when the result is zero
+        emit_mov64(ctx->buf, t, addr);
+    }
+    emit_cmov_rm(ctx->buf, X86_CC_NE, t, x86_mem(PVCPU_HOST_STATE, offsetof(PVCpu_State, memsize)));
+    emit_op_rm(ctx->buf, X86_ADD, t, x86_mem(PVCPU_HOST_STATE, offsetof(PVCpu_State, memory)));
+}
+
+// Raises `code` when the instruction emitted next faults: an access on the guard zone or a divide by zero.
+// The pad sees the state of the micro-op as it is at the fault, so nothing may move in between.
+static void emit_guard_pad(Jit_Ctx* ctx, uint64_t code) {
+    Jit_Buf* buf = ctx->buf;
+    ctx->guard_pad[ctx->guard_count] = (uint32_t)ctx->cold.size;
+    ctx->buf = &ctx->cold;
+    emit_raise(ctx, code);
+    ctx->buf = buf;
+    ctx->guard_site[ctx->guard_count++] = jit_pos(buf);
+}
+
+// Constant address inside guest memory that fits a disp32, which needs no bounds check
+static bool known_addr(const Jit_Ctx* ctx, uint16_t v, int32_t* disp) {
+    const Ir_Uop* a = &ctx->ir->uops[v];
+    if (a->op != IR_CONST || a->imm > INT32_MAX || a->imm > ctx->memsize || ctx->memsize - a->imm < 8) return false;
+    *disp = (int32_t)a->imm;
+    return true;
+}
+
+static void uop_load(Jit_Ctx* ctx, const Ir_Uop* u) {
+    int32_t disp;
+    if (known_addr(ctx, u->a, &disp)) {
+        int t = take_scratch(ctx, 0);
+        emit_load64(ctx->buf, t, PVCPU_HOST_STATE, offsetof(PVCpu_State, memory));
+        emit_load64(ctx->buf, t, t, disp);
+        place(ctx, (uint16_t)ctx->at, t);
+        return;
+    }
+
+    int addr = value_reg(ctx, u->a, 0);
+    int t = take_scratch(ctx, 1u << addr);
+    if (ctx->guarded) {
+        emit_guest_addr(ctx, addr, t);
+        emit_guard_pad(ctx, u->imm);
+        emit_load64(ctx->buf, t, t, 0);
+        place(ctx, (uint16_t)ctx->at, t);
+        return;
+    }
+    emit_bounds_check(ctx, addr, t, u->imm);
+    emit_load64(ctx->buf, t, PVCPU_HOST_STATE, offsetof(PVCpu_State, memory));
+    emit_op_rm(ctx->buf, X86_MOV, t, x86_mem_indexed(t, addr, 0, 0));
+    place(ctx, (uint16_t)ctx->at, t);
+}
+
+static void uop_store(Jit_Ctx* ctx, const Ir_Uop* u) {
+    int32_t disp;
+    if (known_addr(ctx, u->a, &disp)) {
+        int src = value_reg(ctx, u->b, 0);
+        int t = take_scratch(ctx, 1u << src);
+        emit_load64(ctx->buf, t, PVCPU_HOST_STATE, offsetof(PVCpu_State, memory));
+        // Never out of bounds, but it may still hit a protected code page
+        if (ctx->guarded) emit_guard_pad(ctx, u->imm);
+        emit_store64(ctx->buf, t, disp, src);
+        return;
+    }
+
+    int addr = value_reg(ctx, u->a, reg_mask(ctx, u->b));
+    int src = value_reg(ctx, u->b, 1u << addr);
+    int t = take_scratch(ctx, (1u << addr) | (1u << src));
+    if (ctx->guarded) {
+        emit_guest_addr(ctx, addr, t);
+        emit_guard_pad(ctx, u->imm);
+        emit_store64(ctx->buf, t, 0, src);
+        return;
+    }
+    emit_bounds_check(ctx, addr, t, u->imm);
+    emit_load64(ctx->buf, t, PVCPU_HOST_STATE, offsetof(PVCpu_State, memory));
+    emit_op_mr(ctx->buf, X86_MOV, x86_mem_indexed(t, addr, 0, 0), src);
+}
+
+// Unsigned rdx:rax / divisor. Guarded, a zero divisor takes the host #DE and the fault handler resumes
+// at the pad like for a guard zone access, otherwise it is tested for first.
+static void uop_div(Jit_Ctx* ctx, const Ir_Uop* u) {
+    const uint32_t fixed = (1u << HOST_RAX) | (1u << HOST_RDX);
+    const Ir_Uop* divisor = &ctx->ir->uops[u->b];
+
+    int d = value_reg(ctx, u->b, fixed | reg_mask(ctx, u->a));
+    if (fixed & (1u << d)) {
+        int t = take_scratch(ctx, fixed | reg_mask(ctx, u->a));
+        emit_mov64(ctx->buf, t, d);
+        ctx->owner[d] = IR_NONE;
+        place(ctx, u->b, t);
+        d = t;
+    }
+    free_fixed(ctx, HOST_RAX, fixed | (1u << d));
+    if (ctx->loc[u->a] != HOST_RAX) {
+        if (ctx->ir->uops[u->a].op == IR_CONST && !in_reg(ctx, u->a)) emit_movimm64(ctx->buf, HOST_RAX, ctx->ir->uops[u->a].imm);
+        else emit_mov64(ctx->buf, HOST_RAX, value_reg(ctx, u->a, fixed | (1u << d)));
+    }
+    free_fixed(ctx, HOST_RDX, fixed | (1u << d) | reg_mask(ctx, u->a));
+    emit_op_rr(ctx->buf, X86_XOR, HOST_RDX, HOST_RDX);
+
+    if (divisor->op != IR_CONST || divisor->imm == 0) {
+        if (ctx->guarded) {
+            emit_guard_pad(ctx, PVCPU_EXC_DIV_ZERO);
+        } else {
+            emit_op_rr(ctx->buf, X86_TEST, d, d);
+            uint8_t* nonzero = emit_jcc32(ctx->buf, X86_CC_NE);
+            emit_raise(ctx, PVCPU_EXC_DIV_ZERO);
+            jit_patch_rel32(ctx->buf, nonzero, jit_pos(ctx->buf));
+        }
+    }
+    emit_div(ctx->buf, d);
+    place(ctx, (uint16_t)ctx->at, HOST_RAX);
+}
+
+static void uop_branch(Jit_Ctx* ctx, const Ir_Uop* u) {
+    int target = leave_target(ctx, u->a);
+    const Ir_Uop* flags = u->b != IR_NONE ? &ctx->ir->uops[u->b] : NULL;
+    uint8_t mask = u->cond & ~IR_COND_INVERT;
+    int cc = flags != NULL && flags->a != IR_NONE ? host_cc(flags->cond, mask) : -1;
+
+    uint8_t* stay;
+    if (cc >= 0) {
+        // Compare and jump on the host flags, the recorded compare is only for whoever runs next
+        emit_compare(ctx, flags);
+        stay = emit_jcc32(ctx->buf, (u->cond & IR_COND_INVERT) ? cc : cc ^ 1);
+    } else {
+        // Flags from an earlier block may still be pending
+        emit_op_mi(ctx->buf, X86_CMP, 4, x86_mem(PVCPU_HOST_STATE, offsetof(PVCpu_State, flags_op)), 0);
+        uint8_t* ready = emit_jcc32(ctx->buf, X86_CC_E);
+        emit_push(ctx->buf, HOST_RAX);
+        emit_abs(ctx, HOST_RAX, PVCPU_RELOC_FLAGS_STUB, 0, ctx->flags_stub);
+        emit_call_reg(ctx->buf, HOST_RAX);
+        emit_pop(ctx->buf, HOST_RAX);
+        jit_patch_rel32(ctx->buf, ready, jit_pos(ctx->buf));
+        emit_op_mi(ctx->buf, X86_TEST, 1, x86_mem(PVCPU_HOST_STATE, offsetof(PVCpu_State, flags)), mask);
+        stay = emit_jcc32(ctx->buf, (u->cond & IR_COND_INVERT) ? X86_CC_NE : X86_CC_E);
+    }
+    emit_leave(ctx, u->a, target);
+    jit_patch_rel32(ctx->buf, stay, jit_pos(ctx->buf));
+}
+
+static void uop_exit(Jit_Ctx* ctx, const Ir_Uop* u) {
+    bool call = u->b != IR_NONE && ctx->ir->uops[u->b].op == IR_CONST;
+    uint8_t* back = call ? emit_ras_push(ctx, ctx->ir->uops[u->b].imm) : NULL;
+    int target = leave_target(ctx, u->a);
+    if (u->cond == IR_EXIT_RETURN && target >= 0) {
+        emit_refund(ctx);
+        emit_return(ctx, target);
+    } else {
+        emit_leave(ctx, u->a, target);
+    }
+    if (call) {
+        // Only ever entered from a predicted return, which wrote the state back already
+        emit_chain_exit(ctx, ctx->ir->uops[u->b].imm);
+        jit_patch_rel32(ctx->buf, back, ctx->block->exits[ctx->block->exit_count - 1].site - 1);
+    }
+}
+
+static void uop_raise(Jit_Ctx* ctx, const Ir_Uop* u) {
+    emit_raise(ctx, u->imm);
+}
+
+static void uop_const(Jit_Ctx* ctx, const Ir_Uop* u) {
+    (void)u;
+    ctx->loc[ctx->at] = LOC_NONE;
+}
+
+typedef void (*Uop_Emitter)(Jit_Ctx* ctx, const Ir_Uop* u);
+static const Uop_Emitter emitters[IR_OP_COUNT] = {
+    [IR_CONST] = uop_const,
+    [IR_GET] = uop_get,
+    [IR_SET] = uop_set,
+    [IR_ADD] = uop_alu,
+    [IR_SUB] = uop_alu,
+    [IR_AND] = uop_alu,
+    [IR_OR] = uop_alu,
+    [IR_XOR] = uop_alu,
+    [IR_ANDN] = uop_andn,
+    [IR_MUL] = uop_mul,
+    [IR_SHL] = uop_shift,
+    [IR_SHR] = uop_shift,
+    [IR_SAR] = uop_shift,
+    [IR_ROL] = uop_shift,
+    [IR_ROR] = uop_shift,
+    [IR_LOAD] = uop_load,
+    [IR_STORE] = uop_store,
+    [IR_DIV] = uop_div,
+    [IR_FLAGS] = uop_flags,
+    [IR_BRANCH] = uop_branch,
+    [IR_EXIT] = uop_exit,
+    [IR_RAISE] = uop_raise,
+};
+
+// Worst case host bytes of one micro-op
+static size_t uop_max_len(const Ir_Uop* u) {
+    switch (u->op) {
+        case IR_NOP: return 0;
+        case IR_LOAD:
+        case IR_STORE:
+        case IR_DIV: return UOP_MAX + 10 + HELPER_EXIT_MAX;
+        case IR_BRANCH: return UOP_MAX + EXIT_MAX;
+        case IR_EXIT: return UOP_MAX + EXIT_MAX + RAS_MAX;
+        case IR_RAISE: return UOP_MAX + 10 + HELPER_EXIT_MAX;
+        default: return UOP_MAX;
+    }
+}
+
+// Emits the optimized IR of `block`, false when the backend gave up
+static bool emit_block(Jit_Ctx* ctx) {
+    const Ir_Block* ir = ctx->ir;
+    for (size_t i = 0; i < ir->count; i++) {
+        const Ir_Uop* u = &ir->uops[i];
+        ctx->loc[i] = LOC_NONE;
+        ctx->last_use[i] = (uint16_t)i;
+        if (u->a != IR_NONE) ctx->last_use[u->a] = (uint16_t)i;
+        if (u->b != IR_NONE) ctx->last_use[u->b] = (uint16_t)i;
+    }
+    for (size_t i = 0; i < ir->count; i++) {
+        const Ir_Uop* u = &ir->uops[i];
+        // Branches compare the operands of their flags again
+        if (u->op == IR_BRANCH && u->b != IR_NONE && ir->uops[u->b].a != IR_NONE) {
+            const Ir_Uop* flags = &ir->uops[u->b];
+            if (ctx->last_use[flags->a] < i) ctx->last_use[flags->a] = (uint16_t)i;
+            if (ctx->last_use[flags->b] < i) ctx->last_use[flags->b] = (uint16_t)i;
+        }
+        // A lazily written value stays around for the side exits until its guest register is overwritten
+        if (u->op != IR_SET || !(u->cond & IR_SET_LAZY) || ra_host(ctx->ra, u->reg) >= 0) continue;
+        if (ctx->last_use[u->a] < u->imm) ctx->last_use[u->a] = (uint16_t)u->imm;
     }
+    memset(ctx->owner, 0xFF, sizeof(ctx->owner));
+    memset(ctx->slot_owner, 0xFF, sizeof(ctx->slot_owner));
+    memset(ctx->guest_val, 0xFF, sizeof(ctx->guest_val));
+    memset(ctx->pending, 0xFF, sizeof(ctx->pending));
 
-    JitFn entry = (JitFn)buf.data;
-    
+    ctx->entry = jit_pos(ctx->buf);
+    ra_emit_prologue(ctx->buf, ctx->ra);
+    ctx->block->body = jit_pos(ctx->buf);
+    // Chained entries are where the fuel gets checked, the dispatcher checks it before entering through the prologue
+    uint8_t* short_of_fuel = NULL;
+    if (ctx->fuel && ctx->inst_count > 0) {
+        emit_op_ri(ctx->buf, X86_SUB, PVCPU_HOST_FUEL, (int32_t)ctx->inst_count);
+        short_of_fuel = emit_jcc32(ctx->buf, X86_CC_B);
+    }
+    ra_emit_load(ctx->buf, ctx->ra);
+
+    for (ctx->at = 0; ctx->at < ir->count && !ctx->failed; ctx->at++) {
+        const Ir_Uop* u = &ir->uops[ctx->at];
+        if (u->op == IR_NOP) continue;
+        ctx->pc = u->pc;
+        emitters[u->op](ctx, u);
+        release_dead(ctx);
+    }
+    if (ctx->failed) return false;
+
+    // Back to the dispatcher, which runs whatever fuel is left instruction by instruction
+    if (short_of_fuel != NULL) {
+        jit_patch_rel32(ctx->buf, short_of_fuel, jit_pos(ctx->buf));
+        emit_op_ri(ctx->buf, X86_ADD, PVCPU_HOST_FUEL, (int32_t)ctx->inst_count);
+        emit_movimm64(ctx->buf, HOST_RAX, ctx->block->pc);
+        emit_store64(ctx->buf, PVCPU_HOST_STATE, reg_offset(PVCPU_REG_PC), HOST_RAX);
+        ra_emit_epilogue(ctx->buf, ctx->ra);
+    }
+
+    // Pads are only reached through the fault handler, keep them out of the way
+    ctx->pads = jit_pos(ctx->buf);
+    if (ctx->cold.size > 0) {
+        memcpy(ctx->buf->data + ctx->buf->size, ctx->cold.data, ctx->cold.size);
+        ctx->buf->size += ctx->cold.size;
+    }
+    for (size_t i = 0; i < ctx->reloc_count; i++) {
+        if (ctx->reloc_cold[i]) ctx->relocs[i].offset += (uint32_t)(ctx->pads - ctx->entry);
+    }
+    return true;
+}
+
+// Shared routine computing PVCpu_State.flags from a pending compare, called with rbx holding the state.
+// Preserves every register so translated code can call it from anywhere.
+static void emit_flags_stub(Jit_Buf* buf) {
+    emit_push(buf, HOST_RAX);
+    emit_push(buf, HOST_RCX);
+    emit_push(buf, HOST_RDX);
+    emit_load64(buf, HOST_RAX, PVCPU_HOST_STATE, offsetof(PVCpu_State, flags_a));
+    emit_load64(buf, HOST_RCX, PVCPU_HOST_STATE, offsetof(PVCpu_State, flags_b));
+    emit_op_mi(buf, X86_CMP, 4, x86_mem(PVCPU_HOST_STATE, offsetof(PVCpu_State, flags_op)), OP_UCMP);
+    uint8_t* is_ucmp = emit_jcc32(buf, X86_CC_E);
+    emit_op_mi(buf, X86_CMP, 4, x86_mem(PVCPU_HOST_STATE, offsetof(PVCpu_State, flags_op)), OP_TEST);
+    uint8_t* is_test = emit_jcc32(buf, X86_CC_E);
+    emit_op_rr(buf, X86_CMP, HOST_RAX, HOST_RCX);
+    uint8_t* cmp_done = emit_jmp32(buf);
+    jit_patch_rel32(buf, is_test, jit_pos(buf));
+    emit_op_rr(buf, X86_TEST, HOST_RAX, HOST_RCX);
+    jit_patch_rel32(buf, cmp_done, jit_pos(buf));
+    emit_setcc(buf, X86_CC_E, HOST_RDX);
+    emit_setcc(buf, X86_CC_L, HOST_RAX);
+    emit_setcc(buf, X86_CC_G, HOST_RCX);
+    uint8_t* signed_done = emit_jmp32(buf);
+    jit_patch_rel32(buf, is_ucmp, jit_pos(buf));
+    emit_op_rr(buf, X86_CMP, HOST_RAX, HOST_RCX);
+    emit_setcc(buf, X86_CC_E, HOST_RDX);
+    emit_setcc(buf, X86_CC_B, HOST_RAX);
+    emit_setcc(buf, X86_CC_A, HOST_RCX);
+    jit_patch_rel32(buf, signed_done, jit_pos(buf));
+
+    // flags = Z | L << 1 | G << 2
+    emit_op_rm(buf, X86_LEA, HOST_RDX, x86_mem_indexed(HOST_RDX, HOST_RAX, 1, 0));
+    emit_op_rm(buf, X86_LEA, HOST_RDX, x86_mem_indexed(HOST_RDX, HOST_RCX, 2, 0));
+    emit_store64(buf, PVCPU_HOST_STATE, offsetof(PVCpu_State, flags), HOST_RDX);
+    emit_op_mi(buf, X86_MOV, 4, x86_mem(PVCPU_HOST_STATE, offsetof(PVCpu_State, flags_op)), 0);
+    emit_pop(buf, HOST_RDX);
+    emit_pop(buf, HOST_RCX);
+    emit_pop(buf, HOST_RAX);
+    emit_ret(buf);
+}
+
+#define FLAGS_STUB_MAX 160
+
+const uint8_t* pvcpu_flags_stub(PVCpu_Runtime* rt) {
+    #ifdef __x86_64__
+        // Goes in front of the first block that needs it
+        if (rt->flags_stub == NULL && jit_reserve(&rt->buf, FLAGS_STUB_MAX)) {
+            rt->flags_stub = jit_pos(&rt->buf);
+            emit_flags_stub(&rt->buf);
+        }
+    #endif
+    return rt->flags_stub;
+}
+
+// A block translated into memory of its own, see pvcpu_job_compile()
+struct Jit_Job {
+    PVCpu_Block* block; // Left alone until pvcpu_job_install(), it may keep running meanwhile
+    PVCpu_Block shadow; // Translated in place of `block`
+    PVCpu_Decoded_Block* db; // Decoded by pvcpu_job_new(), consumed by the compile
+    Code_Cache cc; // rw == rx, nothing in it is ever executed
+    Jit_Buf buf;
+    bool emitted;
+    size_t guard_count;
+    const uint8_t* guard_site[PVCPU_IR_MAX_UOPS];
+    const uint8_t* guard_pad[PVCPU_IR_MAX_UOPS];
+};
+
+static PVCpu_Decoded_Block* decode(PVCpu_Runtime* rt, uint64_t pc) {
+    PVCpu_Decoded_Block* db = malloc(sizeof(PVCpu_Decoded_Block));
+    if (db == NULL) return NULL;
+    if (rt->traces) pvcpu_decode_trace(rt, pc, db);
+    else pvcpu_decode_block(rt, pc, db);
+    // A trace may reach onto pages no block was decoded from yet
+    gm_protect_code(&rt->mem, db->span_start, db->span_end);
+    return db;
+}
+
+// Translates `db` into `block` and the code cache, or into `job`'s own buffer when there is one. Frees `db`.
+// A job always records its relocations, the exit records the code points at belong to the shadow block.
+static bool translate(PVCpu_Runtime* rt, PVCpu_Block* block, PVCpu_Decoded_Block* db, Jit_Job* job) {
+    if (db == NULL) return false;
+    // Whatever got decoded counts, even where the translation stops short of it
+    if (db->span_start < block->span_start) block->span_start = db->span_start;
+    if (db->span_end > block->span_end) block->span_end = db->span_end;
+
+    // Stop in front of anything the front end cannot lower, the interpreter picks up from there
+    uint32_t fault = db->fault;
+    uint64_t end = db->end;
+    size_t count = db->count;
+    for (size_t i = 0; i < db->count; i++) {
+        if (!ir_can_lower(&db->insts[i])) {
+            count = i;
+            end = db->pcs[i];
+            fault = 0;
+            break;
+        }
+    }
+
+    Ir_Block* ir = NULL;
+    if (count > 0 || fault) {
+        ir = malloc(sizeof(Ir_Block));
+        if (ir == NULL) {
+            free(db);
+            return false;
+        }
+        ir_lower(ir, db, count, end, fault);
+        ir_optimize(ir);
+    }
+
+    Jit_Buf* buf = job != NULL ? &job->buf : &rt->buf;
+    Jit_Ctx* ctx = NULL;
+    Reg_Alloc ra;
+    if (ir != NULL) {
+        ctx = malloc(sizeof(Jit_Ctx));
+        if (ctx == NULL) {
+            free(ir);
+            free(db);
+            return false;
+        }
+        ra_alloc_block(&ra, ir, rt->fuel);
+        memset(ctx, 0, sizeof(Jit_Ctx));
+        ctx->buf = buf;
+        ctx->ra = &ra;
+        ctx->ir = ir;
+        ctx->block = block;
+        ctx->memsize = rt->state.memsize;
+        ctx->relocating = rt->keep_relocs || job != NULL;
+
+        size_t code_max = PVCPU_RA_PROLOGUE_MAX + PVCPU_RA_LOAD_MAX;
+        size_t cold_max = 0;
+        for (size_t i = 0; i < ir->count; i++) {
+            code_max += uop_max_len(&ir->uops[i]);
+            if (ir->uops[i].op == IR_LOAD || ir->uops[i].op == IR_STORE || ir->uops[i].op == IR_DIV) cold_max += HELPER_EXIT_MAX;
+        }
+        ctx->guarded = rt->mem.guarded;
+        ctx->span_shift = rt->mem.span_shift;
+        ctx->host = rt->host;
+        ctx->fuel = rt->fuel;
+        ctx->inst_count = (uint32_t)count;
+        if (ctx->fuel) code_max += FUEL_CHECK_MAX;
+        ctx->cold.data = ctx->guarded && cold_max ? malloc(cold_max) : NULL;
+        if (ctx->cold.data == NULL && ctx->guarded && cold_max) {
+            free(ctx);
+            free(ir);
+            free(db);
+            return false;
+        }
+        ctx->cold.exec = ctx->cold.data;
+        ctx->cold.capacity = cold_max;
+
+        // The pads end up behind the block as well
+        if (job != NULL) {
+            job->buf.data = malloc(code_max + cold_max);
+            job->cc.rw = job->cc.rx = job->buf.data;
+            job->buf.exec = job->buf.data;
+            job->buf.cc = &job->cc;
+            job->buf.capacity = code_max + cold_max;
+        }
+
+        // One reservation for the whole block keeps it contiguous in the code cache.
+        // Jobs only run once the flags stub exists, they never emit it.
+        ctx->flags_stub = job != NULL ? rt->flags_stub : pvcpu_flags_stub(rt);
+        if ((job != NULL && job->buf.data == NULL) || !jit_reserve(buf, code_max)) {
+            free(ctx->cold.data);
+            free(ctx);
+            free(ir);
+            free(db);
+            return false;
+        }
+        block->exit_count = 0;
+        block->incoming = NULL;
+    }
+
+    uint8_t* entry = jit_pos(buf);
+    size_t start = buf->size;
+    bool emitted = false;
     #ifdef __x86_64__
-        emit_u8(&buf, 0xC3); // ret just incase
+        if (ctx != NULL) {
+            emitted = emit_block(ctx);
+            // Whatever the backend gave up on is simply overwritten by the next block
+            if (!emitted) {
+                buf->size = start;
+                block->exit_count = 0;
+            }
+            for (size_t i = 0; emitted && i < ctx->guard_count; i++) {
+                const uint8_t* pad = ctx->pads + ctx->guard_pad[i];
+                if (job != NULL) {
+                    job->guard_site[i] = ctx->guard_site[i];
+                    job->guard_pad[i] = pad;
+                    job->guard_count = i + 1;
+                } else if (!gm_add_site(&rt->mem, ctx->guard_site[i], pad)) {
+                    free(ctx->cold.data);
+                    free(ctx);
+                    free(ir);
+                    free(db);
+                    return false;
+                }
+            }
+            if (emitted && ctx->reloc_count > 0) {
+                free(block->relocs);
+                block->relocs = malloc(ctx->reloc_count * sizeof(PVCpu_Reloc));
+                if (block->relocs == NULL) {
+                    free(ctx->cold.data);
+                    free(ctx);
+                    free(ir);
+                    free(db);
+                    return false;
+                }
+                memcpy(block->relocs, ctx->relocs, ctx->reloc_count * sizeof(PVCpu_Reloc));
+                block->reloc_count = (uint32_t)ctx->reloc_count;
+            }
+        }
     #endif
+    if (ctx != NULL) free(ctx->cold.data);
+    free(ctx);
+    free(ir);
+    if (job != NULL) job->emitted = emitted;
 
-    if (run_code == 1) entry(&cpu_state);
-    else {
-        printf("Host Code generation completed!\n");
-        printf("Dumping Code : \n");
-        for (size_t i = 0; i < buf.size; i++) {
-            printf("%02x ", buf.data[i]);
+    if (!emitted) {
+        // Only keep the leading run the JIT cannot handle, whatever follows becomes a block of its own
+        size_t keep = count > 0 || fault ? db->count : 1;
+        while (keep < db->count && !ir_can_lower(&db->insts[keep])) keep++;
+        if (keep < db->count) {
+            db->count = keep;
+            db->end = db->pcs[keep];
+            db->fault = 0;
+            if (!pvcpu_interp_prepare(block, db)) {
+                free(db);
+                return false;
+            }
         }
-        printf("\n");
+        block->tier = PVCPU_TIER_INTERP_ONLY;
+        free(db);
+        return true;
     }
 
-    free(cpu_state.memory);
-    free(buf.data);
+    block->end = end;
+    block->code = entry;
+    block->code_size = (size_t)(jit_pos(buf) - entry);
+    block->inst_count = (uint32_t)count;
+    block->fault = fault;
+    block->tier = PVCPU_TIER_JIT;
+    free(block->insts);
+    block->insts = NULL;
+    free(db);
+    // Jobs are translated off the guest thread, pvcpu_job_install() marks those
+    if (job == NULL) rt->cache_dirty = true;
+    return true;
+}
+
+bool pvcpu_translate_block(PVCpu_Runtime* rt, PVCpu_Block* block) {
+    return translate(rt, block, decode(rt, block->pc), NULL);
+}
+
+Jit_Job* pvcpu_job_new(PVCpu_Runtime* rt, PVCpu_Block* block) {
+    Jit_Job* job = calloc(1, sizeof(Jit_Job));
+    if (job == NULL) return NULL;
+    job->db = decode(rt, block->pc);
+    if (job->db == NULL) {
+        free(job);
+        return NULL;
+    }
+    job->block = block;
+    // Already now, the block is dropped when the code the job works from is written before the install
+    if (job->db->span_start < block->span_start) block->span_start = job->db->span_start;
+    if (job->db->span_end > block->span_end) block->span_end = job->db->span_end;
+    job->shadow.pc = block->pc;
+    job->shadow.end = block->end;
+    job->shadow.span_start = block->span_start;
+    job->shadow.span_end = block->span_end;
+    job->shadow.inst_count = block->inst_count;
+    job->shadow.fault = block->fault;
+    job->shadow.tier = block->tier;
+    return job;
+}
+
+bool pvcpu_job_compile(PVCpu_Runtime* rt, Jit_Job* job) {
+    if (rt->flags_stub == NULL) return false;
+    PVCpu_Decoded_Block* db = job->db;
+    job->db = NULL;
+    return translate(rt, &job->shadow, db, job);
+}
+
+PVCpu_Block* pvcpu_job_block(const Jit_Job* job) {
+    return job->block;
+}
+
+void pvcpu_job_free(Jit_Job* job) {
+    free(job->db);
+    free(job->shadow.insts);
+    free(job->shadow.relocs);
+    free(job->buf.data);
+    free(job);
+}
+
+bool pvcpu_job_install(PVCpu_Runtime* rt, Jit_Job* job) {
+    PVCpu_Block* block = job->block;
+    PVCpu_Block* shadow = &job->shadow;
+    bool ok = true;
+    if (job->emitted) {
+        // Same position relative to the alignment, chain exits rely on it
+        ok = jit_reserve(&rt->buf, shadow->code_size + PVCPU_CC_ALIGN);
+        if (ok) {
+            size_t skip = ((uintptr_t)shadow->code - (uintptr_t)jit_pos(&rt->buf)) & (PVCPU_CC_ALIGN - 1);
+            memset(rt->buf.data + rt->buf.size, 0x90, skip); // nop
+            rt->buf.size += skip;
+            uint8_t* entry = jit_pos(&rt->buf);
+            uint8_t* code = rt->buf.data + rt->buf.size;
+            memcpy(code, job->buf.data, shadow->code_size);
+            rt->buf.size += shadow->code_size;
+
+            // Everything else absolute in the code lives outside of it
+            for (uint32_t i = 0; i < shadow->reloc_count; i++) {
+                const PVCpu_Reloc* r = &shadow->relocs[i];
+                if (r->kind != PVCPU_RELOC_EXIT) continue;
+                uint64_t exit = (uint64_t)(uintptr_t)&block->exits[r->arg];
+                memcpy(code + r->offset, &exit, 8);
+            }
+            ptrdiff_t delta = entry - shadow->code;
+            for (uint32_t i = 0; i < shadow->exit_count; i++) {
+                block->exits[i] = shadow->exits[i];
+                block->exits[i].site += delta;
+                block->exits[i].stub += delta;
+                block->exits[i].block = block;
+            }
+            for (size_t i = 0; ok && i < job->guard_count; i++) {
+                ok = gm_add_site(&rt->mem, job->guard_site[i] + delta, job->guard_pad[i] + delta);
+            }
+
+            block->exit_count = shadow->exit_count;
+            block->incoming = NULL;
+            block->code = entry;
+            block->body = shadow->body + delta;
+            block->code_size = shadow->code_size;
+            free(block->relocs);
+            block->relocs = NULL;
+            block->reloc_count = 0;
+            if (rt->keep_relocs) {
+                block->relocs = shadow->relocs;
+                block->reloc_count = shadow->reloc_count;
+                shadow->relocs = NULL;
+            }
+            free(block->insts);
+            block->insts = NULL;
+        }
+    } else if (shadow->insts != NULL) {
+        // Cut short in front of what the JIT can translate
+        free(block->insts);
+        block->insts = shadow->insts;
+        shadow->insts = NULL;
+    }
+    if (ok) {
+        block->end = shadow->end;
+        block->span_start = shadow->span_start;
+        block->span_end = shadow->span_end;
+        block->inst_count = shadow->inst_count;
+        block->fault = shadow->fault;
+        block->tier = shadow->tier;
+        if (block->tier == PVCPU_TIER_JIT) rt->cache_dirty = true;
+    }
+    pvcpu_job_free(job);
+    return ok;
 }
@@ -0,0 +1,359 @@
+// Author: Pheonix Studios/AkshuDev
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include <pvcpu-runtime.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <unistd.h>
+#endif
+
+// Jobs handed out to whoever asks next, the calling thread included
+typedef struct {
+    PVCpu_Runtime* rt;
+    Jit_Job** jobs;
+    size_t count;
+    atomic_size_t next;
+    atomic_bool failed;
+} Jit_Batch;
+
+// Intrusive multi producer single consumer queue: pushing is a single exchange, so producers never
+// wait on each other or on the consumer. `tail` belongs to the consumer alone.
+typedef struct Jit_Node {
+    struct Jit_Node* _Atomic next;
+    Jit_Job* job;
+} Jit_Node;
+
+typedef struct {
+    Jit_Node* _Atomic head; // Last pushed
+    Jit_Node* tail; // Next to pop, `stub` while empty
+    Jit_Node stub;
+} Jit_Queue;
+
+#ifndef _WIN32
+struct Jit_Pool {
+    pthread_t threads[PVCPU_JIT_MAX_THREADS];
+    unsigned count;
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // A batch was posted or the pool is stopping
+    pthread_cond_t done; // The last worker left the batch
+    Jit_Batch* batch; // NULL once the caller is done with it, late workers then go back to sleep
+    uint64_t generation; // Batches posted so far
+    unsigned busy; // Workers inside `batch`
+    bool stopping;
+};
+#endif
+
+#ifndef _WIN32
+struct Jit_Compiler {
+    pthread_t thread;
+    sem_t pending; // Posted once per request and once to stop
+    atomic_bool stopping;
+    Jit_Queue requests; // Guest -> compiler
+    Jit_Queue done; // Compiler -> guest
+    PVCpu_Runtime* rt;
+};
+#endif
+
+#ifndef _WIN32
+static void queue_init(Jit_Queue* q) {
+    atomic_init(&q->stub.next, NULL);
+    atomic_init(&q->head, &q->stub);
+    q->tail = &q->stub;
+}
+
+static void queue_push(Jit_Queue* q, Jit_Node* node) {
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    Jit_Node* prev = atomic_exchange_explicit(&q->head, node, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+// NULL when empty, or when a push is halfway through and its node cannot be reached yet
+static Jit_Node* queue_pop(Jit_Queue* q) {
+    Jit_Node* tail = q->tail;
+    Jit_Node* next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (tail == &q->stub) {
+        if (next == NULL) return NULL;
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+    if (tail != atomic_load_explicit(&q->head, memory_order_acquire)) return NULL;
+
+    // The last node can only be handed out once something is behind it
+    queue_push(q, &q->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next == NULL) return NULL;
+    q->tail = next;
+    return tail;
+}
+#endif
+
+static void run_batch(Jit_Batch* batch) {
+    for (;;) {
+        size_t i = atomic_fetch_add(&batch->next, 1);
+        if (i >= batch->count) return;
+        if (!pvcpu_job_compile(batch->rt, batch->jobs[i])) atomic_store(&batch->failed, true);
+    }
+}
+
+#ifndef _WIN32
+static void* worker(void* arg) {
+    Jit_Pool* pool = (Jit_Pool*)arg;
+    uint64_t seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stopping && (pool->batch == NULL || pool->generation == seen)) pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->stopping) break;
+        seen = pool->generation;
+        Jit_Batch* batch = pool->batch;
+        pool->busy++;
+        pthread_mutex_unlock(&pool->lock);
+
+        run_batch(batch);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0) pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+#endif
+
+unsigned pvcpu_jit_threads() {
+    #ifndef _WIN32
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        if (n < 1) return 1;
+        return n > PVCPU_JIT_MAX_THREADS ? PVCPU_JIT_MAX_THREADS : (unsigned)n;
+    #else
+        return 1;
+    #endif
+}
+
+void pvcpu_pool_start(PVCpu_Runtime* rt, unsigned threads) {
+    rt->pool = NULL;
+    #ifndef _WIN32
+        if (threads > PVCPU_JIT_MAX_THREADS) threads = PVCPU_JIT_MAX_THREADS;
+        if (threads < 2) return;
+        Jit_Pool* pool = calloc(1, sizeof(Jit_Pool));
+        if (pool == NULL) return;
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->wake, NULL);
+        pthread_cond_init(&pool->done, NULL);
+
+        // The calling thread is one of them
+        for (unsigned i = 0; i + 1 < threads; i++) {
+            if (pthread_create(&pool->threads[i], NULL, worker, pool) != 0) break;
+            pool->count++;
+        }
+        if (pool->count == 0) {
+            pthread_cond_destroy(&pool->done);
+            pthread_cond_destroy(&pool->wake);
+            pthread_mutex_destroy(&pool->lock);
+            free(pool);
+            return;
+        }
+        rt->pool = pool;
+    #else
+        (void)threads;
+    #endif
+}
+
+void pvcpu_pool_stop(PVCpu_Runtime* rt) {
+    #ifndef _WIN32
+        Jit_Pool* pool = rt->pool;
+        if (pool == NULL) return;
+        pthread_mutex_lock(&pool->lock);
+        pool->stopping = true;
+        pthread_cond_broadcast(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+        for (unsigned i = 0; i < pool->count; i++) {
+            pthread_join(pool->threads[i], NULL);
+        }
+        pthread_cond_destroy(&pool->done);
+        pthread_cond_destroy(&pool->wake);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool);
+    #endif
+    rt->pool = NULL;
+}
+
+bool pvcpu_pool_compile(PVCpu_Runtime* rt, Jit_Job** jobs, size_t count) {
+    Jit_Batch batch;
+    batch.rt = rt;
+    batch.jobs = jobs;
+    batch.count = count;
+    atomic_init(&batch.next, 0);
+    atomic_init(&batch.failed, false);
+
+    #ifndef _WIN32
+        Jit_Pool* pool = count > 1 ? rt->pool : NULL;
+        if (pool != NULL) {
+            pthread_mutex_lock(&pool->lock);
+            pool->batch = &batch;
+            pool->generation++;
+            pthread_cond_broadcast(&pool->wake);
+            pthread_mutex_unlock(&pool->lock);
+        }
+        run_batch(&batch);
+        if (pool != NULL) {
+            pthread_mutex_lock(&pool->lock);
+            pool->batch = NULL;
+            while (pool->busy > 0) pthread_cond_wait(&pool->done, &pool->lock);
+            pthread_mutex_unlock(&pool->lock);
+        }
+    #else
+        run_batch(&batch);
+    #endif
+    return !atomic_load(&batch.failed);
+}
+
+bool pvcpu_translate_blocks(PVCpu_Runtime* rt, PVCpu_Block** blocks, size_t count) {
+    if (count > 0 && !cc_begin_write(&rt->cache)) return false;
+
+    // A single block gains nothing from the detour through a job
+    Jit_Job** jobs = NULL;
+    if (rt->pool != NULL && count > 1 && pvcpu_flags_stub(rt) != NULL) jobs = malloc(count * sizeof(Jit_Job*));
+    if (jobs == NULL) {
+        bool ok = true;
+        for (size_t i = 0; i < count && ok; i++) {
+            ok = pvcpu_translate_block(rt, blocks[i]);
+        }
+        return ok;
+    }
+
+    size_t made = 0;
+    while (made < count && (jobs[made] = pvcpu_job_new(rt, blocks[made])) != NULL) made++;
+    bool ok = made == count && pvcpu_pool_compile(rt, jobs, count);
+
+    // Only this thread ever writes the code cache, blocks land in it in batch order
+    for (size_t i = 0; i < made; i++) {
+        if (!pvcpu_job_install(rt, jobs[i])) ok = false;
+    }
+    free(jobs);
+    return ok;
+}
+
+#ifndef _WIN32
+static void* compiler_main(void* arg) {
+    Jit_Compiler* compiler = (Jit_Compiler*)arg;
+    for (;;) {
+        while (sem_wait(&compiler->pending) != 0) {}
+        if (atomic_load(&compiler->stopping)) break;
+
+        // Every post stands for a pushed node, it is reachable as soon as its push completes
+        Jit_Node* node;
+        while ((node = queue_pop(&compiler->requests)) == NULL) sched_yield();
+        // A failed compile leaves the block as it was, installing it just clears the request
+        pvcpu_job_compile(compiler->rt, node->job);
+        queue_push(&compiler->done, node);
+    }
+    return NULL;
+}
+#endif
+
+void pvcpu_compiler_start(PVCpu_Runtime* rt) {
+    rt->compiler = NULL;
+    #ifndef _WIN32
+        if (pvcpu_flags_stub(rt) == NULL) return;
+        Jit_Compiler* compiler = calloc(1, sizeof(Jit_Compiler));
+        if (compiler == NULL) return;
+        compiler->rt = rt;
+        atomic_init(&compiler->stopping, false);
+        queue_init(&compiler->requests);
+        queue_init(&compiler->done);
+        if (sem_init(&compiler->pending, 0, 0) != 0) {
+            free(compiler);
+            return;
+        }
+        if (pthread_create(&compiler->thread, NULL, compiler_main, compiler) != 0) {
+            sem_destroy(&compiler->pending);
+            free(compiler);
+            return;
+        }
+        rt->compiler = compiler;
+    #endif
+}
+
+bool pvcpu_compiler_request(PVCpu_Runtime* rt, PVCpu_Block* block) {
+    #ifndef _WIN32
+        Jit_Node* node = malloc(sizeof(Jit_Node));
+        Jit_Job* job = node != NULL ? pvcpu_job_new(rt, block) : NULL;
+        if (job == NULL) {
+            free(node);
+            return false;
+        }
+        node->job = job;
+        block->compiling = true;
+        queue_push(&rt->compiler->requests, node);
+        sem_post(&rt->compiler->pending);
+        return true;
+    #else
+        (void)rt;
+        (void)block;
+        return false;
+    #endif
+}
+
+bool pvcpu_compiler_install(PVCpu_Runtime* rt) {
+    #ifndef _WIN32
+        Jit_Node* node = queue_pop(&rt->compiler->done);
+        if (node == NULL) return true;
+
+        bool writable = cc_begin_write(&rt->cache);
+        bool ok = writable;
+        do {
+            PVCpu_Block* block = pvcpu_job_block(node->job);
+            if (block->dropped) {
+                // Its guest code was written meanwhile, the translation is stale
+                pvcpu_job_free(node->job);
+                tc_free(block);
+            } else {
+                // Without a writable cache the translation is dropped, the block stays in its tier
+                if (!writable) pvcpu_job_free(node->job);
+                else if (!pvcpu_job_install(rt, node->job)) ok = false;
+                block->compiling = false;
+            }
+            free(node);
+        } while ((node = queue_pop(&rt->compiler->done)) != NULL);
+        return cc_publish(&rt->cache) && ok;
+    #else
+        (void)rt;
+        return true;
+    #endif
+}
+
+void pvcpu_compiler_stop(PVCpu_Runtime* rt) {
+    #ifndef _WIN32
+        Jit_Compiler* compiler = rt->compiler;
+        if (compiler == NULL) return;
+        atomic_store(&compiler->stopping, true);
+        sem_post(&compiler->pending);
+        pthread_join(compiler->thread, NULL);
+
+        // Nothing is pushed anymore, both queues pop down to empty
+        pvcpu_compiler_install(rt);
+        Jit_Node* node;
+        while ((node = queue_pop(&compiler->requests)) != NULL) {
+            PVCpu_Block* block = pvcpu_job_block(node->job);
+            block->compiling = false;
+            if (block->dropped) tc_free(block);
+            pvcpu_job_free(node->job);
+            free(node);
+        }
+        sem_destroy(&compiler->pending);
+        free(compiler);
+    #endif
+    rt->compiler = NULL;
+}
@@ -9,8 +9,10 @@
 #include <pvcpu-jit.h>
 #include <pvcpu-validator.h>
 #include <pvcpu-helpers.h>
+#include <pvcpu-host.h>
 
 #include <extra.h>
+#include <reader.h>
 
 #define PVCPU_USAGE "Usage: pvcpu command <OPTIONAL:input> <OPTIONAL:--[OPTIONS]>"
 
@@ -44,9 +46,39 @@ static uint8_t* read_file(const char* filename, size_t* out_size) {
     return buf;
 }
 
+// Byte count with an optional K, M or G suffix
+static size_t parse_size(const char* s) {
+    char* end;
+    size_t n = strtoull(s, &end, 0);
+    switch (*end) {
+        case 'K': case 'k': return n << 10;
+        case 'M': case 'm': return n << 20;
+        case 'G': case 'g': return n << 30;
+        default: return n;
+    }
+}
+
 static void print_help() {
     printf(PVCPU_USAGE "\n\nCommands:\n");
     printf("run <file>      - Run a PVCpu binary\n");
+    printf("    --dump      - Dump the generated host code instead of running it\n");
+    printf("    --regs      - Print the guest registers after running\n");
+    printf("    --mem <n>   - Guest memory size in bytes, K/M/G suffixes allowed, pages are committed as the guest touches them\n");
+    printf("    --jit <n>   - Interpreted executions before a block is translated, 0 translates everything\n");
+    printf("    --traces    - Translate hot paths across branches as superblocks\n");
+    printf("    --baseline  - Compile blocks from stencils before they get hot instead of interpreting them\n");
+    printf("    --cache <d> - Keep translated code in directory <d> and reuse it when the same program runs again\n");
+    printf("    --jit-threads <n> - Threads translating blocks, one per CPU by default. With more than one hot blocks\n");
+    printf("                        are translated in the background, 1 translates them on the guest thread\n");
+    printf("    --host-features <list> - Host CPU extensions translated code may use, detected by default. Comma separated\n");
+    printf("                        from native, none, bmi1, bmi2, lzcnt, popcnt, adx, avx2, avx512f, erms and fsrm,\n");
+    printf("                        -<name> removes one\n");
+    printf("    --fuel <n>  - Stop after <n> guest instructions with exit status 3 and report how many ran\n");
+    printf("aot <file>      - Compile a PVCpu binary or ELF to a native x86-64 Linux executable\n");
+    printf("    -o <out>    - Output file, a.out by default\n");
+    printf("    --mem <n>   - Guest memory size of the executable\n");
+    printf("    --jit-threads <n> - Threads translating the program, one per CPU by default\n");
+    printf("    --host-features <list> - CPU extensions the executable may use, those of this CPU by default\n");
     printf("check <value>   - Debug command\n");
     printf("help            - Display this message\n");
 }
@@ -54,15 +86,39 @@ static void print_help() {
 typedef struct {
     bool help;
     bool run;
+    bool aot;
     bool check;
     bool error;
 
+    bool dump;
+    bool regs;
+    bool traces;
+    bool baseline;
+    size_t memsize;
+    uint32_t jit_threshold;
+    unsigned jit_threads;
+    PVCpu_Host_Features host;
+    uint64_t fuel;
+
     char* run_input;
     char* check_input;
+    char* cache_dir;
+    char* aot_output;
 } Args_t;
 
+static void parse_host_features(Args_t* args, const char* spec) {
+    const char* bad = NULL;
+    if (!pvcpu_host_parse(&args->host, spec, &bad)) {
+        fprintf(stderr, "Unknown host feature '%s'\n", bad);
+        args->error = true;
+    }
+}
+
 static void parse_args(Args_t* args, int argc, char** argv) {
     memset(args, 0, sizeof(Args_t));
+    args->memsize = PVCPU_DEFAULT_MEMSIZE;
+    args->jit_threshold = PVCPU_DEFAULT_JIT_THRESHOLD;
+    pvcpu_host_detect(&args->host);
 
     if (argc < 2) {
         args->error = true;
@@ -83,6 +139,55 @@ static void parse_args(Args_t* args, int argc, char** argv) {
             return;
         }
         args->run_input = argv[2];
+
+        for (int i = 3; i < argc; i++) {
+            if (!strcmp(argv[i], "--dump")) args->dump = true;
+            else if (!strcmp(argv[i], "--regs")) args->regs = true;
+            else if (!strcmp(argv[i], "--traces")) args->traces = true;
+            else if (!strcmp(argv[i], "--baseline")) args->baseline = true;
+            else if (!strcmp(argv[i], "--cache") && i + 1 < argc) args->cache_dir = argv[++i];
+            else if (!strcmp(argv[i], "--mem") && i + 1 < argc) args->memsize = parse_size(argv[++i]);
+            else if (!strcmp(argv[i], "--jit") && i + 1 < argc) args->jit_threshold = (uint32_t)strtoul(argv[++i], NULL, 0);
+            else if (!strcmp(argv[i], "--jit-threads") && i + 1 < argc) args->jit_threads = (unsigned)strtoul(argv[++i], NULL, 0);
+            else if (!strcmp(argv[i], "--host-features") && i + 1 < argc) parse_host_features(args, argv[++i]);
+            else if (!strcmp(argv[i], "--fuel") && i + 1 < argc) args->fuel = strtoull(argv[++i], NULL, 0);
+            else {
+                fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+                args->error = true;
+                return;
+            }
+            if (args->error) return;
+        }
+
+        // Translated code runs right here, it would die on the first instruction this CPU lacks
+        PVCpu_Host_Features native;
+        pvcpu_host_detect(&native);
+        if (pvcpu_host_mask(&args->host) & ~pvcpu_host_mask(&native)) {
+            fprintf(stderr, "Warning: --host-features enables extensions this CPU does not support!\n");
+        }
+    }
+    else if (!strcmp(cmd, "aot")) {
+        args->aot = true;
+        if (argc < 3) {
+            fprintf(stderr, "aot requires <file>\n");
+            args->error = true;
+            return;
+        }
+        args->run_input = argv[2];
+        args->aot_output = "a.out";
+
+        for (int i = 3; i < argc; i++) {
+            if (!strcmp(argv[i], "-o") && i + 1 < argc) args->aot_output = argv[++i];
+            else if (!strcmp(argv[i], "--mem") && i + 1 < argc) args->memsize = parse_size(argv[++i]);
+            else if (!strcmp(argv[i], "--jit-threads") && i + 1 < argc) args->jit_threads = (unsigned)strtoul(argv[++i], NULL, 0);
+            else if (!strcmp(argv[i], "--host-features") && i + 1 < argc) parse_host_features(args, argv[++i]);
+            else {
+                fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+                args->error = true;
+                return;
+            }
+            if (args->error) return;
+        }
     }
     else if (!strcmp(cmd, "check")) {
         args->check = true;
@@ -113,77 +218,68 @@ int main(int argc, char** argv) {
     }
 
     // Route functions
-    if (args.run) {
+    if (args.help) {
+        print_help();
+    }
+    else if (args.run || args.aot) {
         size_t file_size = 0;
         uint8_t* program = read_file(args.run_input, &file_size);
         if (!program) {
             fprintf(stderr, "Error: Could not read file [%s]\n", args.run_input);
             return 4;
         }
+        if (args.aot && file_size >= 4 && !memcmp(program, "\x7f" "ELF", 4)) {
+            // Only the code section is compiled, it has to be linked at guest address 0
+            size_t code_size = 0;
+            size_t svaddr = 0;
+            if (r_get_arch((char*)program, file_size) != Arch_PVCpu) {
+                fprintf(stderr, "Error: [%s] is not a PVCpu ELF\n", args.run_input);
+                free(program);
+                return 5;
+            }
+            size_t code_off = r_get_codeoff((char*)program, file_size, &code_size, &svaddr);
+            if (code_size == 0 || svaddr != 0 || code_off > file_size || file_size - code_off < code_size) {
+                if (code_size != 0) fprintf(stderr, "Error: Code section of [%s] is not at address 0 or out of bounds\n", args.run_input);
+                free(program);
+                return 5;
+            }
+            memmove(program, program + code_off, code_size);
+            file_size = code_size;
+        }
 
-        size_t inst_cap = 2;
-        size_t inst_count = 0;
-        PVCpu_Inst* insts = calloc(inst_cap, sizeof(PVCpu_Inst));
-        uint64_t* inst_values = calloc(inst_cap, sizeof(uint64_t));
-        uint64_t** inst_extflags = calloc(inst_cap, sizeof(uint64_t*));
-        int* inst_extflags_count = calloc(inst_cap, sizeof(int));
-
+        // Only validated up front, the runtime decodes the code again as it reaches it
         size_t off = 0;
-        size_t idx = 0;
         while (off < file_size) {
-            if (inst_count + 1 > inst_cap) {
-                inst_cap *= 2;
-                insts = realloc(insts, inst_cap * sizeof(PVCpu_Inst));
-                inst_values = realloc(inst_values, inst_cap * sizeof(uint64_t));
-                inst_extflags = realloc(inst_extflags, inst_cap * sizeof(uint64_t*));
-                inst_extflags_count = realloc(inst_extflags_count, inst_cap * sizeof(int));
-            }
-            inst_extflags[idx] = calloc(2, sizeof(uint64_t));
-            size_t read_bytes = pvcpu_unpack_inst(program + off, file_size - off, &insts[idx], &inst_values[idx], inst_extflags[idx], &inst_extflags_count[idx]);
+            PVCpu_Inst inst = {0};
+            uint64_t value = 0;
+            uint64_t extflags[PVCPU_MAX_EXTFLAGS] = {0};
+            int extflags_count = 0;
+            size_t read_bytes = pvcpu_unpack_inst(program + off, file_size - off, &inst, &value, extflags, &extflags_count);
             if (read_bytes == 0 && file_size - off > 4) {
                 fprintf(stderr, "Error: Instruction unpacking failed!\n");
                 free(program);
-                free(insts);
-                free(inst_values);
-                for (size_t i = 0; i < inst_cap; i++) {
-                    free(inst_extflags[i]);
-                }
-                free(inst_extflags);
-                free(inst_extflags_count);
                 return 5;
             } else if (file_size - off < 4) {
                 break;
             }
-            off += read_bytes;
-            inst_count += 1;
-        }
-
-        // Validate
-        for (size_t i = 0; i < inst_count; i++) {
-            if (!pvcpu_validate_inst(&insts[i], inst_values[i], inst_cap, 0)) {
+            // Code is loaded at guest address 0, so the file offset is the guest address
+            if (!pvcpu_validate_inst(&inst, value, args.memsize, off)) {
                 fprintf(stderr, "Validation Failed: This might be a harmful file, DO NOT RUN!\n");
                 free(program);
-                free(insts);
-                free(inst_values);
-                for (size_t i = 0; i < inst_cap; i++) {
-                    free(inst_extflags[i]);
-                }
-                free(inst_extflags);
-                free(inst_extflags_count);
                 return 6;
             }
+            off += read_bytes;
         }
 
-        pvcpu_run(insts, inst_values, inst_extflags, inst_extflags_count, inst_count, inst_cap, 100, 128, 0);
+        PVCpu_Config config = {args.memsize, PVCPU_JIT_CHUNK, args.jit_threshold, 0, args.cache_dir, args.jit_threads, args.host, args.fuel};
+        if (!args.dump) config.run_code |= PVCPU_RUN_EXEC;
+        if (args.regs) config.run_code |= PVCPU_RUN_DUMP_REGS;
+        if (args.traces) config.run_code |= PVCPU_RUN_TRACES;
+        if (args.baseline) config.run_code |= PVCPU_RUN_BASELINE;
+        int ret = args.aot ? pvcpu_aot(program, file_size, &config, args.aot_output) : pvcpu_run(program, file_size, &config);
     
         free(program);
-        free(insts);
-        free(inst_values);
-        for (size_t i = 0; i < inst_cap; i++) {
-            free(inst_extflags[i]);
-        }
-        free(inst_extflags);
-        free(inst_extflags_count);
+        if (ret != 0) return ret;
     }
     else if (args.check) {
         printf("Checking something %s\n", args.check_input);
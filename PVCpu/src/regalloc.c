@@ -0,0 +1,131 @@
+// Author: Pheonix Studios/AkshuDev
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <pvcpu-isa.h>
+#include <pvcpu-jit.h>
+#include <pvcpu-helpers.h>
+#include <pvcpu-ir.h>
+#include <pvcpu-regalloc.h>
+
+// rax, rcx, rdx, r10 and r11 stay free as scratch for the backend
+static const int alloc_pool[] = {
+    HOST_R12, HOST_R13, HOST_R14, HOST_R15, HOST_RBP, // Callee saved, survive helper calls
+    HOST_R8, HOST_R9, HOST_RSI, HOST_RDI
+};
+#define ALLOC_POOL_SIZE (sizeof(alloc_pool) / sizeof(alloc_pool[0]))
+
+#ifdef _WIN32
+#define CALLEE_SAVED ((1 << HOST_RBX) | (1 << HOST_RBP) | (1 << HOST_RSI) | (1 << HOST_RDI) | (1 << HOST_R12) | (1 << HOST_R13) | (1 << HOST_R14) | (1 << HOST_R15))
+#define SHADOW_SPACE 32
+#else
+#define CALLEE_SAVED ((1 << HOST_RBX) | (1 << HOST_RBP) | (1 << HOST_R12) | (1 << HOST_R13) | (1 << HOST_R14) | (1 << HOST_R15))
+#define SHADOW_SPACE 0
+#endif
+
+static int32_t reg_offset(int guest) {
+    return (int32_t)(offsetof(PVCpu_State, regs) + guest * 8);
+}
+
+int32_t ra_slot(int slot) {
+    return SHADOW_SPACE + slot * 8;
+}
+
+void ra_init_frame(Reg_Alloc* ra, bool fuel) {
+    memset(ra, 0, sizeof(Reg_Alloc));
+    memset(ra->host, -1, sizeof(ra->host));
+    ra->fuel = fuel;
+
+    // Every block saves the same registers so chained blocks can jump into each other's bodies
+    ra->saved = CALLEE_SAVED;
+
+    int pushes = 0;
+    for (int r = 0; r < 16; r++) {
+        if (ra->saved & (1 << r)) pushes++;
+    }
+    // On entry rsp is 8 bytes off alignment because of the return address
+    ra->frame = ((pushes % 2) ? 0 : 8) + SHADOW_SPACE + PVCPU_RA_SLOTS * 8;
+}
+
+void ra_alloc_block(Reg_Alloc* ra, const Ir_Block* ir, bool fuel) {
+    uint32_t uses[PVCPU_ALLOC_REGS] = {0};
+    uint16_t value_uses[PVCPU_IR_MAX_UOPS];
+    uint64_t written = 0;
+
+    ra_init_frame(ra, fuel);
+    ir_count_uses(ir, value_uses);
+
+    // A read counts once per use of its value, the passes leave one IR_GET per register value
+    for (size_t i = 0; i < ir->count; i++) {
+        const Ir_Uop* u = &ir->uops[i];
+        if ((u->op != IR_GET && u->op != IR_SET) || u->reg >= PVCPU_ALLOC_REGS) continue;
+
+        if (u->op == IR_GET) {
+            uses[u->reg] += value_uses[i];
+            if (!(written & (1ull << u->reg))) ra->live_in |= 1ull << u->reg;
+        } else {
+            uses[u->reg]++;
+            written |= 1ull << u->reg;
+        }
+    }
+
+    // Hand the pool out to the most used registers, a register touched once gains nothing
+    for (size_t p = 0; p < ALLOC_POOL_SIZE; p++) {
+        if (fuel && alloc_pool[p] == PVCPU_HOST_FUEL) continue;
+        int best = -1;
+        for (int g = 1; g < PVCPU_ALLOC_REGS; g++) {
+            if (ra->host[g] >= 0 || uses[g] < 2) continue;
+            if (best < 0 || uses[g] > uses[best]) best = g;
+        }
+        if (best < 0) break;
+
+        ra->host[best] = (int8_t)alloc_pool[p];
+    }
+
+    uint64_t allocated = 0;
+    for (int g = 1; g < PVCPU_ALLOC_REGS; g++) {
+        if (ra->host[g] >= 0) allocated |= 1ull << g;
+    }
+    ra->live_in &= allocated;
+}
+
+void ra_emit_prologue(Jit_Buf* buf, const Reg_Alloc* ra) {
+    for (int r = 0; r < 16; r++) {
+        if (ra->saved & (1 << r)) emit_push(buf, r);
+    }
+    if (ra->frame) {
+        emit_op_ri(buf, X86_SUB, HOST_RSP, ra->frame);
+    }
+    #ifdef _WIN32
+        emit_mov64(buf, PVCPU_HOST_STATE, HOST_RCX);
+    #else
+        emit_mov64(buf, PVCPU_HOST_STATE, HOST_RDI);
+    #endif
+    if (ra->fuel) emit_load64(buf, PVCPU_HOST_FUEL, PVCPU_HOST_STATE, offsetof(PVCpu_State, fuel));
+}
+
+void ra_emit_epilogue(Jit_Buf* buf, const Reg_Alloc* ra) {
+    if (ra->fuel) emit_store64(buf, PVCPU_HOST_STATE, offsetof(PVCpu_State, fuel), PVCPU_HOST_FUEL);
+    if (ra->frame) {
+        emit_op_ri(buf, X86_ADD, HOST_RSP, ra->frame);
+    }
+    for (int r = 15; r >= 0; r--) {
+        if (ra->saved & (1 << r)) emit_pop(buf, r);
+    }
+    emit_ret(buf);
+}
+
+void ra_emit_load(Jit_Buf* buf, const Reg_Alloc* ra) {
+    for (int g = 1; g < PVCPU_ALLOC_REGS; g++) {
+        if (ra->live_in & (1ull << g)) emit_load64(buf, ra->host[g], PVCPU_HOST_STATE, reg_offset(g));
+    }
+}
+
+void ra_emit_spill(Jit_Buf* buf, const Reg_Alloc* ra) {
+    for (int g = 1; g < PVCPU_ALLOC_REGS; g++) {
+        if (ra->dirty & (1ull << g)) emit_store64(buf, PVCPU_HOST_STATE, reg_offset(g), ra->host[g]);
+    }
+}
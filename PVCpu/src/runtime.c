@@ -0,0 +1,594 @@
+// Author: Pheonix Studios/AkshuDev
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <pvcpu-isa.h>
+#include <pvcpu-codecache.h>
+#include <pvcpu-jit.h>
+#include <pvcpu-tcache.h>
+#include <pvcpu-validator.h>
+#include <pvcpu-ir.h>
+#include <pvcpu-runtime.h>
+
+typedef void (*JitFn)(PVCpu_State*);
+
+#define INST_MAX_SIZE (12 + PVCPU_MAX_EXTFLAGS * 8) // Bytes the decoder may read for one instruction
+
+// Appends the basic block at `pc` to `out`, stopping early when `out` is full
+static void decode_append(const PVCpu_Runtime* rt, uint64_t pc, PVCpu_Decoded_Block* out) {
+    if (pc < out->span_start) out->span_start = pc;
+    while (out->count < PVCPU_BLOCK_MAX_INSTS && pc < rt->code_size) {
+        size_t i = out->count;
+        out->extflag_count[i] = 0;
+        size_t read = pvcpu_unpack_inst(rt->state.memory + pc, rt->code_size - pc, &out->insts[i], &out->values[i], out->extflags[i], &out->extflag_count[i]);
+        if (read == 0 || !pvcpu_validate_inst(&out->insts[i], out->values[i], rt->state.memsize, pc)) {
+            out->fault = PVCPU_EXC_INVALID_INST;
+            // Whatever makes it invalid may be overwritten as well
+            uint64_t seen = rt->code_size - pc < INST_MAX_SIZE ? rt->code_size : pc + INST_MAX_SIZE;
+            if (seen > out->span_end) out->span_end = seen;
+            break;
+        }
+
+        out->pcs[i] = pc;
+        out->sizes[i] = (uint8_t)read;
+        out->count++;
+        pc += read;
+        if (pvcpu_is_block_end(out->insts[i].opcode)) break;
+    }
+    out->end = pc;
+    if (pc > out->span_end) out->span_end = pc;
+}
+
+void pvcpu_decode_block(const PVCpu_Runtime* rt, uint64_t pc, PVCpu_Decoded_Block* out) {
+    out->count = 0;
+    out->fault = 0;
+    out->span_start = out->span_end = pc;
+    decode_append(rt, pc, out);
+}
+
+void pvcpu_decode_trace(const PVCpu_Runtime* rt, uint64_t pc, PVCpu_Decoded_Block* out) {
+    uint64_t starts[PVCPU_TRACE_MAX_BLOCKS];
+    out->count = 0;
+    out->fault = 0;
+    out->span_start = out->span_end = pc;
+
+    for (int n = 0; n < PVCPU_TRACE_MAX_BLOCKS; n++) {
+        size_t first = out->count;
+        uint64_t end = out->end;
+        uint64_t span_start = out->span_start;
+        uint64_t span_end = out->span_end;
+        starts[n] = pc;
+        decode_append(rt, pc, out);
+        // Pages the guest keeps writing are interpreted, the trace stops in front of them
+        if (n > 0 && gm_code_writes(&rt->mem, out->span_start, out->span_end) >= PVCPU_CODE_WRITES_MAX) {
+            out->count = first;
+            out->end = end;
+            out->fault = 0;
+            out->span_start = span_start;
+            out->span_end = span_end;
+            return;
+        }
+        if (out->fault || out->count == first) return;
+
+        // Only static jumps are followed, calls, returns and register targets end the trace
+        const PVCpu_Inst* last = &out->insts[out->count - 1];
+        bool jcc = last->opcode >= OP_JZ && last->opcode <= OP_JNE;
+        if (last->opcode != OP_JMP && !jcc) return;
+        uint64_t next;
+        if (last->mode == REG_IMM) next = last->src;
+        else if (last->mode == REG_EXTIMM) next = out->values[out->count - 1];
+        else return;
+
+        if (jcc) {
+            const PVCpu_Block* stats = tc_lookup(&rt->tc, pc);
+            if (stats == NULL || stats->exec_count < PVCPU_TRACE_MIN_EXECS) return;
+            if (stats->fall_count * 2 > stats->exec_count) next = out->end;
+        }
+
+        // Loops close through the last exit, which gets chained back to the head
+        for (int i = 0; i <= n; i++) {
+            if (starts[i] == next) return;
+        }
+        pc = next;
+    }
+}
+
+void pvcpu_helper_raise(PVCpu_State* state, uint64_t pc, uint64_t code) {
+    state->regs[PVCPU_REG_PC] = pc;
+    state->exception = (uint32_t)code;
+    state->exit_reason = PVCPU_EXIT_EXCEPTION;
+}
+
+void pvcpu_helper_call(PVCpu_State* state, uint64_t ret, uint64_t target) {
+    uint64_t sp = state->regs[PVCPU_REG_SP];
+    if (sp < 8 || sp > state->memsize) {
+        // PC still holds the address of the call
+        pvcpu_helper_raise(state, state->regs[PVCPU_REG_PC], PVCPU_EXC_STACK);
+        return;
+    }
+    sp -= 8;
+    memcpy(state->memory + sp, &ret, 8);
+    state->regs[PVCPU_REG_SP] = sp;
+    state->regs[PVCPU_REG_LR] = ret;
+    state->regs[PVCPU_REG_PC] = target;
+}
+
+void pvcpu_helper_ret(PVCpu_State* state) {
+    uint64_t sp = state->regs[PVCPU_REG_SP];
+    if (sp > state->memsize || state->memsize - sp < 8) {
+        pvcpu_helper_raise(state, state->regs[PVCPU_REG_PC], PVCPU_EXC_STACK);
+        return;
+    }
+    uint64_t target;
+    memcpy(&target, state->memory + sp, 8);
+    state->regs[PVCPU_REG_SP] = sp + 8;
+    state->regs[PVCPU_REG_PC] = target;
+}
+
+const void* pvcpu_helper(uint8_t kind) {
+    switch (kind) {
+        case PVCPU_RELOC_HELPER_CALL: return (const void*)pvcpu_helper_call;
+        case PVCPU_RELOC_HELPER_RET: return (const void*)pvcpu_helper_ret;
+        case PVCPU_RELOC_HELPER_RAISE: return (const void*)pvcpu_helper_raise;
+        default: return NULL;
+    }
+}
+
+static void print_regs(const PVCpu_State* state) {
+    static const char* names[3] = {"LR", "SF", "SP"};
+    printf("NULL = 0x%016llx\n", (unsigned long long)state->regs[0]);
+    for (int i = 1; i < 35; i++) {
+        if (i < 32) printf("G%-3d = 0x%016llx", i - 1, (unsigned long long)state->regs[i]);
+        else printf("%-4s = 0x%016llx", names[i - 32], (unsigned long long)state->regs[i]);
+        printf((i % 4 == 0 || i == 34) ? "\n" : "    ");
+    }
+}
+
+// Patches the queued chain links, the code cache has to be writable
+static void link_pending(PVCpu_Runtime* rt) {
+    for (size_t i = 0; i < rt->link_count; i++) tc_link(&rt->cache, rt->links[i].exit, rt->links[i].target);
+    rt->link_count = 0;
+}
+
+// Links through the writable alias right away. A single mapping would be unsealed and sealed again
+// for every link, there links wait for the next translation or until the queue is full.
+static bool link_exit(PVCpu_Runtime* rt, PVCpu_Block_Exit* exit, PVCpu_Block* target) {
+    if (rt->cache.fd >= 0) {
+        tc_link(&rt->cache, exit, target);
+        return true;
+    }
+    rt->links[rt->link_count++] = (PVCpu_Pending_Link){exit, target};
+    if (rt->link_count < PVCPU_LINK_QUEUE) return true;
+    if (!cc_begin_write(&rt->cache)) return false;
+    link_pending(rt);
+    return cc_publish(&rt->cache);
+}
+
+PVCpu_Block* pvcpu_new_block(PVCpu_Runtime* rt, uint64_t pc) {
+    PVCpu_Decoded_Block* db = malloc(sizeof(PVCpu_Decoded_Block));
+    PVCpu_Block* block = calloc(1, sizeof(PVCpu_Block));
+    if (db == NULL || block == NULL) {
+        free(db);
+        free(block);
+        return NULL;
+    }
+    pvcpu_decode_block(rt, pc, db);
+
+    block->pc = pc;
+    block->tier = PVCPU_TIER_INTERP;
+    block->span_start = db->span_start;
+    block->span_end = db->span_end;
+    bool ok = pvcpu_interp_prepare(block, db);
+    if (ok && gm_code_writes(&rt->mem, db->span_start, db->span_end) >= PVCPU_CODE_WRITES_MAX) {
+        // The guest keeps rewriting this code, interpreting it is cheaper than faulting on every write
+        block->tier = PVCPU_TIER_INTERP_ONLY;
+        block->snapshot = malloc(db->span_end - db->span_start);
+        if (block->snapshot == NULL) ok = false;
+        else memcpy(block->snapshot, rt->state.memory + db->span_start, db->span_end - db->span_start);
+    } else if (ok) {
+        gm_protect_code(&rt->mem, db->span_start, db->span_end);
+    }
+    if (ok && rt->baseline && block->tier == PVCPU_TIER_INTERP) {
+        // Blocks the stencils do not cover are simply interpreted
+        if (cc_begin_write(&rt->cache)) {
+            pvcpu_stencil_compile(rt, block, db);
+            link_pending(rt);
+        }
+        ok = cc_publish(&rt->cache);
+    }
+    free(db);
+    if (!ok || !tc_insert(&rt->tc, block)) {
+        tc_free(block);
+        return NULL;
+    }
+    return block;
+}
+
+// Removes a block whose guest code changed, the next lookup decodes it again. False when the code
+// cache could not be written, the block then stays.
+static bool drop_block(PVCpu_Runtime* rt, PVCpu_Block* block) {
+    if (!tc_remove(&rt->tc, &rt->cache, block) || !cc_publish(&rt->cache)) return false;
+    rt->cache_dirty = true;
+    // Shadow return stack entries may point into its exits
+    rt->state.ras_top = 0;
+    const PVCpu_Block_Exit* exit = rt->state.last_exit;
+    if (exit != NULL && exit->block == block) rt->state.last_exit = NULL;
+    size_t kept = 0;
+    for (size_t i = 0; i < rt->link_count; i++) {
+        if (rt->links[i].exit->block != block && rt->links[i].target != block) rt->links[kept++] = rt->links[i];
+    }
+    rt->link_count = kept;
+    if (block->tier == PVCPU_TIER_QUEUED) {
+        size_t j = 0;
+        for (size_t i = 0; i < rt->queue_count; i++) {
+            if (rt->jit_queue[i] != block) rt->jit_queue[j++] = rt->jit_queue[i];
+        }
+        rt->queue_count = j;
+    }
+    // The background compiler still refers to it and frees it when handing it back
+    if (block->compiling) block->dropped = true;
+    else tc_free(block);
+    return true;
+}
+
+// Drops the blocks on every code page the guest wrote since the last call, false on allocation failure
+// or when the code cache could not be written
+static bool drop_written(PVCpu_Runtime* rt) {
+    uint64_t start, end;
+    while (gm_next_written(&rt->mem, &start, &end)) {
+        // Collected first, removing blocks moves others around in the table
+        size_t count = 0;
+        PVCpu_Block** hit = malloc((rt->tc.count + 1) * sizeof(PVCpu_Block*));
+        if (hit == NULL) return false;
+        for (size_t i = 0; i < rt->tc.cap; i++) {
+            PVCpu_Block* b = rt->tc.slots[i];
+            if (b != NULL && b->span_start < end && b->span_end > start) hit[count++] = b;
+        }
+        bool ok = true;
+        for (size_t i = 0; i < count && ok; i++) ok = drop_block(rt, hit[i]);
+        free(hit);
+        if (!ok) return false;
+    }
+    return true;
+}
+
+// Translates every queued block and publishes them together
+static bool drain_queue(PVCpu_Runtime* rt) {
+    bool ok = pvcpu_translate_blocks(rt, rt->jit_queue, rt->queue_count);
+    rt->queue_count = 0;
+    if (ok) link_pending(rt);
+    return cc_publish(&rt->cache) && ok;
+}
+
+static bool queue_block(PVCpu_Runtime* rt, PVCpu_Block* block) {
+    // The background compiler takes it right away, the block keeps running in its tier meanwhile
+    if (rt->compiler != NULL) return block->compiling || pvcpu_compiler_request(rt, block);
+    if (rt->queue_count == PVCPU_JIT_QUEUE && !drain_queue(rt)) return false;
+    block->tier = PVCPU_TIER_QUEUED;
+    rt->jit_queue[rt->queue_count++] = block;
+    return true;
+}
+
+// With a zero threshold every block is translated before it runs anyway, so the blocks of a linear
+// sweep over the code are translated up front in one parallel batch. Blocks starting anywhere
+// else are still translated one by one when they are reached.
+static bool translate_ahead(PVCpu_Runtime* rt) {
+    size_t cap = 256;
+    size_t count = 0;
+    PVCpu_Block** blocks = malloc(cap * sizeof(PVCpu_Block*));
+    if (blocks == NULL) return false;
+
+    uint64_t pc = 0;
+    while (pc < rt->code_size) {
+        PVCpu_Block* block = tc_lookup(&rt->tc, pc);
+        if (block == NULL) block = pvcpu_new_block(rt, pc);
+        if (block == NULL) {
+            free(blocks);
+            return false;
+        }
+        if (block->tier == PVCPU_TIER_INTERP || block->tier == PVCPU_TIER_BASELINE) {
+            if (count == cap) {
+                cap *= 2;
+                PVCpu_Block** grown = realloc(blocks, cap * sizeof(PVCpu_Block*));
+                if (grown == NULL) {
+                    free(blocks);
+                    return false;
+                }
+                blocks = grown;
+            }
+            blocks[count++] = block;
+        }
+        if (block->end == pc) break; // Faulting instruction, nothing decodes past it
+        pc = block->end;
+    }
+
+    bool ok = pvcpu_translate_blocks(rt, blocks, count);
+    ok = cc_publish(&rt->cache) && ok;
+    free(blocks);
+    return ok;
+}
+
+static void dump_blocks(PVCpu_Runtime* rt) {
+    printf("Host Code generation completed!\n");
+    printf("Dumping Code : \n");
+
+    // Linear sweep, every block starts where the previous one ended
+    uint64_t pc = 0;
+    while (pc < rt->code_size) {
+        PVCpu_Block* block = tc_lookup(&rt->tc, pc);
+        if (block == NULL) block = pvcpu_new_block(rt, pc);
+        if (block == NULL || (block->tier != PVCPU_TIER_JIT && (!cc_begin_write(&rt->cache) || !pvcpu_translate_block(rt, block)))) return;
+
+        printf("Block 0x%llx - 0x%llx (%u instructions):\n", (unsigned long long)block->pc, (unsigned long long)block->end, block->inst_count);
+        if (block->tier == PVCPU_TIER_INTERP_ONLY) {
+            printf("interpreted\n");
+        } else {
+            const uint8_t* data = cc_rw(&rt->cache, block->code);
+            for (size_t i = 0; i < block->code_size; i++) {
+                printf("%02x ", data[i]);
+            }
+            printf("\n");
+        }
+
+        if (block->end == pc) break; // Faulting instruction, nothing decodes past it
+        pc = block->end;
+    }
+}
+
+// Instructions of the block at `start` that count as run when it raised at `pc`, the faulting one included
+static uint32_t retired_until(const PVCpu_Runtime* rt, uint64_t start, uint32_t count, uint64_t pc) {
+    uint64_t at = start;
+    for (uint32_t i = 0; i < count; i++) {
+        if (at == pc) return i + 1;
+        PVCpu_Inst inst;
+        uint64_t value;
+        uint64_t extflags[PVCPU_MAX_EXTFLAGS];
+        int extflag_count = 0;
+        size_t read = pvcpu_unpack_inst(rt->state.memory + at, rt->code_size - at, &inst, &value, extflags, &extflag_count);
+        if (read == 0) break;
+        at += read;
+    }
+    return count;
+}
+
+// Runs an interpreted or baseline block, charging its instructions up front
+static void run_block(PVCpu_Runtime* rt, const PVCpu_Block* block) {
+    PVCpu_State* state = &rt->state;
+    if (rt->fuel) state->fuel -= block->inst_count;
+    if (block->tier == PVCPU_TIER_BASELINE) ((JitFn)block->code)(state);
+    else pvcpu_interp_block(state, block);
+    if (rt->fuel && state->exit_reason == PVCPU_EXIT_EXCEPTION) {
+        state->fuel += block->inst_count - retired_until(rt, block->pc, block->inst_count, state->regs[PVCPU_REG_PC]);
+    }
+}
+
+// Interprets the basic block at `pc` straight from guest memory without caching it, for a block
+// needing more fuel than is left and for code just written. With fuel it runs as much as the fuel
+// covers, stopping with PVCPU_EXIT_FUEL once none is left. False on allocation failure.
+static bool run_uncached(PVCpu_Runtime* rt, uint64_t pc) {
+    PVCpu_State* state = &rt->state;
+    if (rt->fuel && state->fuel == 0) {
+        state->exit_reason = PVCPU_EXIT_FUEL;
+        return true;
+    }
+
+    PVCpu_Decoded_Block* db = malloc(sizeof(PVCpu_Decoded_Block));
+    if (db == NULL) return false;
+    pvcpu_decode_block(rt, pc, db);
+    if (rt->fuel && db->count > state->fuel) {
+        db->count = (size_t)state->fuel;
+        db->end = db->pcs[db->count];
+        db->fault = 0;
+    }
+    PVCpu_Block block = {0};
+    block.pc = pc;
+    bool ok = pvcpu_interp_prepare(&block, db);
+    free(db);
+    if (ok) run_block(rt, &block);
+    free(block.insts);
+    return ok;
+}
+
+static int dispatch(PVCpu_Runtime* rt) {
+    PVCpu_State* state = &rt->state;
+
+    while (state->exit_reason == PVCPU_EXIT_NONE) {
+        if (rt->compiler != NULL && !pvcpu_compiler_install(rt)) {
+            fprintf(stderr, "Error: Installing translated code failed!\n");
+            return 9;
+        }
+        if (rt->mem.written && !drop_written(rt)) {
+            fprintf(stderr, "Error: Invalidating rewritten code failed!\n");
+            return 9;
+        }
+        uint64_t pc = state->regs[PVCPU_REG_PC];
+        if (pc >= rt->code_size) {
+            state->last_exit = NULL;
+            state->exit_reason = PVCPU_EXIT_HALT;
+            break;
+        }
+
+        PVCpu_Block* block = tc_lookup(&rt->tc, pc);
+        // Code on pages the guest keeps writing is checked against what it was decoded from instead
+        if (block != NULL && block->snapshot != NULL && memcmp(block->snapshot, state->memory + block->span_start, block->span_end - block->span_start)) {
+            if (!drop_block(rt, block)) {
+                fprintf(stderr, "Error: Invalidating rewritten code failed!\n");
+                return 9;
+            }
+            block = NULL;
+        }
+        if (block == NULL) {
+            block = pvcpu_new_block(rt, pc);
+            if (block == NULL) {
+                fprintf(stderr, "Error: Decoding of block at 0x%llx failed!\n", (unsigned long long)pc);
+                return 9;
+            }
+        }
+
+        // A queued block coming around again is hot, the whole batch is translated now.
+        // With a zero threshold every block takes this path before its first execution.
+        bool ok = true;
+        bool counting = block->tier == PVCPU_TIER_INTERP || block->tier == PVCPU_TIER_BASELINE;
+        if (counting && rt->jit_threshold == 0) ok = queue_block(rt, block);
+        if (ok && block->tier == PVCPU_TIER_QUEUED) ok = drain_queue(rt);
+        if (!ok) {
+            fprintf(stderr, "Error: Translation of block at 0x%llx failed!\n", (unsigned long long)pc);
+            return 9;
+        }
+
+        PVCpu_Block_Exit* exit = state->last_exit;
+        state->last_exit = NULL;
+
+        if (rt->fuel && state->fuel < block->inst_count) {
+            if (!run_uncached(rt, pc)) {
+                fprintf(stderr, "Error: Decoding of block at 0x%llx failed!\n", (unsigned long long)pc);
+                return 9;
+            }
+            continue;
+        }
+
+        if (block->tier != PVCPU_TIER_JIT) {
+            // Exits into interpreted or baseline blocks stay unlinked, they are taken again once the target is translated
+            run_block(rt, block);
+            if (block->tier != PVCPU_TIER_INTERP && block->tier != PVCPU_TIER_BASELINE) continue;
+            if (state->regs[PVCPU_REG_PC] == block->end) block->fall_count++;
+            if (++block->exec_count >= rt->jit_threshold && !queue_block(rt, block)) {
+                fprintf(stderr, "Error: Translation of block at 0x%llx failed!\n", (unsigned long long)pc);
+                return 9;
+            }
+            continue;
+        }
+
+        // The previous block left through a static exit, jump straight here next time
+        if (exit && !link_exit(rt, exit, block)) {
+            fprintf(stderr, "Error: Linking translated code failed!\n");
+            return 9;
+        }
+
+        ((JitFn)block->code)(state);
+
+        // A store hit a protected code page, possibly code of this very block. It raised before
+        // writing, the blocks on that page are dropped and the store runs again interpreted.
+        if (rt->mem.retried) {
+            rt->mem.retried = false;
+            state->exit_reason = PVCPU_EXIT_NONE;
+            state->exception = 0;
+            state->last_exit = NULL;
+            if (rt->fuel) state->fuel++; // The raise charged the store
+            if (!drop_written(rt) || !run_uncached(rt, state->regs[PVCPU_REG_PC])) {
+                fprintf(stderr, "Error: Invalidating rewritten code failed!\n");
+                return 9;
+            }
+        }
+    }
+
+    if (state->exit_reason == PVCPU_EXIT_EXCEPTION) {
+        fprintf(stderr, "Guest exception 0x%x at PC 0x%llx\n", state->exception, (unsigned long long)state->regs[PVCPU_REG_PC]);
+        return 8;
+    }
+    if (state->exit_reason == PVCPU_EXIT_FUEL) {
+        fprintf(stderr, "Guest ran out of fuel at PC 0x%llx\n", (unsigned long long)state->regs[PVCPU_REG_PC]);
+        return 3;
+    }
+    return 0;
+}
+
+int pvcpu_run(const uint8_t* code, size_t code_size, const PVCpu_Config* config) {
+    ir_init();
+    pvcpu_interp_init();
+    size_t memsize = config->memsize;
+
+    if (code_size > memsize) {
+        fprintf(stderr, "Error: Program (%zu bytes) does not fit into guest memory (%zu bytes)!\n", code_size, memsize);
+        return 9;
+    }
+
+    PVCpu_Runtime* rt = calloc(1, sizeof(PVCpu_Runtime));
+    if (rt == NULL) {
+        perror("Error: Runtime allocation failed!");
+        return 9;
+    }
+    if (!cc_init(&rt->cache, PVCPU_CC_RESERVE)) {
+        perror("Error: Code cache reservation failed!");
+        free(rt);
+        return 9;
+    }
+    if (!jit_init(&rt->buf, &rt->cache, config->chunk_size) || !tc_init(&rt->tc, PVCPU_TC_INITIAL)) {
+        perror("Error: Instruction memory allocation failed!");
+        jit_free(&rt->buf);
+        cc_destroy(&rt->cache);
+        free(rt);
+        return 9;
+    }
+    if (!gm_init(&rt->mem, memsize)) {
+        perror("Error: Memory allocation failed!");
+        tc_destroy(&rt->tc);
+        jit_free(&rt->buf);
+        cc_destroy(&rt->cache);
+        free(rt);
+        return 9;
+    }
+    if (!gm_watch_code(&rt->mem, code_size)) {
+        perror("Error: Memory allocation failed!");
+        gm_destroy(&rt->mem);
+        tc_destroy(&rt->tc);
+        jit_free(&rt->buf);
+        cc_destroy(&rt->cache);
+        free(rt);
+        return 9;
+    }
+    rt->state.memory = rt->mem.memory;
+    rt->state.memsize = memsize;
+    rt->code_size = code_size;
+    rt->jit_threshold = config->jit_threshold;
+    rt->host = config->host;
+    rt->fuel = config->fuel != 0;
+    rt->state.fuel = config->fuel;
+    rt->traces = (config->run_code & PVCPU_RUN_TRACES) && (config->run_code & PVCPU_RUN_EXEC);
+    rt->baseline = (config->run_code & PVCPU_RUN_BASELINE) && (config->run_code & PVCPU_RUN_EXEC);
+    if (rt->baseline) pvcpu_stencil_init();
+    rt->cache_dir = (config->run_code & PVCPU_RUN_EXEC) ? config->cache_dir : NULL;
+    rt->keep_relocs = rt->cache_dir != NULL;
+    // Hot blocks go to the background compiler, a zero threshold translates everything up front on the pool instead
+    unsigned threads = config->jit_threads ? config->jit_threads : pvcpu_jit_threads();
+    if (threads > 1 && rt->jit_threshold > 0 && (config->run_code & PVCPU_RUN_EXEC)) pvcpu_compiler_start(rt);
+    if (rt->compiler == NULL) pvcpu_pool_start(rt, threads);
+
+    // Code lives at the bottom of guest memory, the stack grows down from the top
+    memcpy(rt->state.memory, code, code_size);
+    rt->state.regs[PVCPU_REG_SP] = memsize;
+    rt->state.regs[PVCPU_REG_SF] = memsize;
+    rt->state.regs[PVCPU_REG_PC] = 0;
+
+    int ret = 0;
+    if (config->run_code & PVCPU_RUN_EXEC) {
+        if (rt->cache_dir != NULL && !dc_load(rt)) {
+            fprintf(stderr, "Error: Loading the translation cache failed!\n");
+            ret = 9;
+        } else if (rt->pool != NULL && rt->jit_threshold == 0 && !translate_ahead(rt)) {
+            fprintf(stderr, "Error: Translation failed!\n");
+            ret = 9;
+        } else {
+            gm_catch_faults(&rt->mem);
+            ret = dispatch(rt);
+            pvcpu_compiler_stop(rt);
+            gm_release_faults();
+        }
+        if (rt->fuel) fprintf(stderr, "Guest instructions executed: %llu\n", (unsigned long long)(config->fuel - rt->state.fuel));
+        if (rt->cache_dir != NULL && !dc_save(rt)) fprintf(stderr, "Warning: Translation cache in %s could not be written!\n", rt->cache_dir);
+        if (config->run_code & PVCPU_RUN_DUMP_REGS) print_regs(&rt->state);
+    } else {
+        dump_blocks(rt);
+    }
+
+    pvcpu_pool_stop(rt);
+    gm_destroy(&rt->mem);
+    tc_destroy(&rt->tc);
+    jit_free(&rt->buf);
+    cc_destroy(&rt->cache);
+    free(rt);
+    return ret;
+}
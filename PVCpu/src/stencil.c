@@ -0,0 +1,426 @@
+// Author: Pheonix Studios/AkshuDev
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <pvcpu-isa.h>
+#include <pvcpu-codecache.h>
+#include <pvcpu-jit.h>
+#include <pvcpu-helpers.h>
+#include <pvcpu-regalloc.h>
+#include <pvcpu-tcache.h>
+#include <pvcpu-runtime.h>
+
+// Baseline tier: copy-and-patch compilation
+// Every supported (opcode, mode) has a stencil, a piece of machine code built once at startup
+// with the guest operands left as holes. Compiling a block copies the stencils of its
+// instructions back to back and patches the holes, there is no IR and no register allocation.
+// Guest registers live in PVCpu_State throughout, rbx holds the state and rax/rcx/rdx are scratch.
+
+// Stand-in values the templates are emitted with, found again by scanning the code.
+// The low byte is the Hole_Kind so several holes can share a stencil.
+#define HOLE_DISP_MAGIC 0x3C3C3C00u // disp32 holes, register offsets
+#define HOLE_IMM_MAGIC 0xA5A5A5A5A5A5A500ull // imm64 holes, guest values and addresses
+
+#define STENCIL_MAX 192
+#define STENCIL_HOLES 8
+#define STENCIL_COUNT 96
+
+typedef enum {
+    HOLE_DEST = 1, // disp32, offset of the dest register
+    HOLE_SRC, // disp32, offset of the src register
+    HOLE_IMM, // imm64, immediate, address or exception code
+    HOLE_PC, // imm64, guest address of the instruction
+    HOLE_NEXT, // imm64, guest address after it
+    HOLE_STUB, // imm64, flags stub
+} Hole_Kind;
+
+typedef struct {
+    uint8_t code[STENCIL_MAX];
+    uint8_t size;
+    uint8_t hole_count;
+    uint8_t hole_at[STENCIL_HOLES];
+    uint8_t hole_kind[STENCIL_HOLES];
+} Stencil;
+
+typedef void (*Stencil_Emit)(Jit_Buf* buf, uint16_t opcode, uint8_t mode);
+
+static Stencil stencils[STENCIL_COUNT];
+static size_t stencil_count;
+static uint8_t stencil_of[4096][16]; // Index + 1 of the stencil for each (opcode, mode), 0 when there is none
+static size_t exit_stencil; // Index of the fall-through exit
+static size_t raise_stencil; // Index of EXCEPTION REG_EXTIMM, also raises the fault of a block
+static Reg_Alloc frame; // Nothing cached, the stencils share the frame of every other block
+
+#ifdef _WIN32
+static const int arg_regs[3] = {HOST_RCX, HOST_RDX, HOST_R8};
+#else
+static const int arg_regs[3] = {HOST_RDI, HOST_RSI, HOST_RDX};
+#endif
+
+static int32_t disp_hole(Hole_Kind kind) {
+    return (int32_t)(HOLE_DISP_MAGIC | kind);
+}
+
+static uint64_t imm_hole(Hole_Kind kind) {
+    return HOLE_IMM_MAGIC | kind;
+}
+
+// Loads the source operand of the REG_* modes into `dst`
+static void emit_operand(Jit_Buf* buf, uint8_t mode, int dst) {
+    if (mode == REG_REG) emit_load64(buf, dst, PVCPU_HOST_STATE, disp_hole(HOLE_SRC));
+    else emit_movimm64(buf, dst, imm_hole(HOLE_IMM));
+}
+
+static void emit_set_pc(Jit_Buf* buf, int src) {
+    emit_store64(buf, PVCPU_HOST_STATE, offsetof(PVCpu_State, regs) + PVCPU_REG_PC * 8, src);
+}
+
+// Leaves the block continuing at the guest address in `src`
+static void emit_leave(Jit_Buf* buf, int src) {
+    emit_set_pc(buf, src);
+    ra_emit_epilogue(buf, &frame);
+}
+
+// PC of the instruction, for exceptions raised by a helper
+static void emit_store_pc(Jit_Buf* buf) {
+    emit_movimm64(buf, HOST_RAX, imm_hole(HOLE_PC));
+    emit_set_pc(buf, HOST_RAX);
+}
+
+// Calls fn(state, arg1, arg2) with the arguments already loaded and leaves the block, the helper sets PC itself
+static void emit_helper_exit(Jit_Buf* buf, const void* fn) {
+    emit_mov64(buf, arg_regs[0], PVCPU_HOST_STATE);
+    emit_call_abs(buf, fn);
+    ra_emit_epilogue(buf, &frame);
+}
+
+static void emit_raise(Jit_Buf* buf, uint64_t code) {
+    emit_movimm64(buf, arg_regs[1], imm_hole(HOLE_PC));
+    emit_movimm64(buf, arg_regs[2], code);
+    emit_helper_exit(buf, (const void*)pvcpu_helper_raise);
+}
+
+// Leaves rdx = address + 8 when [address, address + 8) lies in guest memory, raising PVCPU_EXC_MEMORY otherwise
+static void emit_bounds_check(Jit_Buf* buf, int addr) {
+    emit_mov64(buf, HOST_RDX, addr);
+    emit_op_ri(buf, X86_ADD, HOST_RDX, 8);
+    uint8_t* wrapped = emit_jcc32(buf, X86_CC_C);
+    emit_op_rm(buf, X86_CMP, HOST_RDX, x86_mem(PVCPU_HOST_STATE, offsetof(PVCpu_State, memsize)));
+    uint8_t* inside = emit_jcc32(buf, X86_CC_BE);
+    jit_patch_rel32(buf, wrapped, jit_pos(buf));
+    emit_raise(buf, PVCPU_EXC_MEMORY);
+    jit_patch_rel32(buf, inside, jit_pos(buf));
+}
+
+// Guest address of a LOAD_* or STORE_* access into rcx, `base` is the register hole holding it
+static void emit_address(Jit_Buf* buf, uint8_t mode, Hole_Kind base) {
+    switch (mode) {
+        case LOAD_IMMADDR:
+        case STORE_IMMADDR:
+            emit_movimm64(buf, HOST_RCX, imm_hole(HOLE_IMM));
+            break;
+        case LOAD_PC_REL:
+        case STORE_PC_REL:
+            emit_load64(buf, HOST_RCX, PVCPU_HOST_STATE, disp_hole(base));
+            emit_movimm64(buf, HOST_RAX, imm_hole(HOLE_PC));
+            emit_op_rr(buf, X86_ADD, HOST_RCX, HOST_RAX);
+            break;
+        default:
+            emit_load64(buf, HOST_RCX, PVCPU_HOST_STATE, disp_hole(base));
+            break;
+    }
+}
+
+static void stencil_alu(Jit_Buf* buf, uint16_t opcode, uint8_t mode) {
+    X86_Op op;
+    switch (opcode) {
+        case OP_ADD: op = X86_ADD; break;
+        case OP_SUB: op = X86_SUB; break;
+        case OP_AND: op = X86_AND; break;
+        case OP_OR: op = X86_OR; break;
+        default: op = X86_XOR; break;
+    }
+    emit_operand(buf, mode, HOST_RCX);
+    emit_op_mr(buf, op, x86_mem(PVCPU_HOST_STATE, disp_hole(HOLE_DEST)), HOST_RCX);
+}
+
+// imul has no memory destination, the product goes through rax
+static void stencil_mul(Jit_Buf* buf, uint16_t opcode, uint8_t mode) {
+    (void)opcode;
+    emit_operand(buf, mode, HOST_RCX);
+    emit_load64(buf, HOST_RAX, PVCPU_HOST_STATE, disp_hole(HOLE_DEST));
+    emit_imul(buf, HOST_RAX, HOST_RCX);
+    emit_store64(buf, PVCPU_HOST_STATE, disp_hole(HOLE_DEST), HOST_RAX);
+}
+
+static void stencil_mov(Jit_Buf* buf, uint16_t opcode, uint8_t mode) {
+    (void)opcode;
+    emit_operand(buf, mode, HOST_RCX);
+    emit_store64(buf, PVCPU_HOST_STATE, disp_hole(HOLE_DEST), HOST_RCX);
+}
+
+// Records the compare, flags are computed by whoever reads them (see pvcpu_flags())
+static void stencil_compare(Jit_Buf* buf, uint16_t opcode, uint8_t mode) {
+    emit_load64(buf, HOST_RAX, PVCPU_HOST_STATE, disp_hole(HOLE_DEST));
+    emit_operand(buf, mode, HOST_RCX);
+    emit_store64(buf, PVCPU_HOST_STATE, offsetof(PVCpu_State, flags_a), HOST_RAX);
+    emit_store64(buf, PVCPU_HOST_STATE, offsetof(PVCpu_State, flags_b), HOST_RCX);
+    emit_op_mi(buf, X86_MOV, 4, x86_mem(PVCPU_HOST_STATE, offsetof(PVCpu_State, flags_op)), opcode);
+}
+
+static void stencil_load(Jit_Buf* buf, uint16_t opcode, uint8_t mode) {
+    (void)opcode;
+    emit_address(buf, mode, HOLE_SRC);
+    emit_bounds_check(buf, HOST_RCX);
+    emit_load64(buf, HOST_RAX, PVCPU_HOST_STATE, offsetof(PVCpu_State, memory));
+    emit_op_rm(buf, X86_MOV, HOST_RAX, x86_mem_indexed(HOST_RAX, HOST_RCX, 0, 0));
+    emit_store64(buf, PVCPU_HOST_STATE, disp_hole(HOLE_DEST), HOST_RAX);
+}
+
+static void stencil_store(Jit_Buf* buf, uint16_t opcode, uint8_t mode) {
+    (void)opcode;
+    emit_address(buf, mode, HOLE_DEST);
+    emit_bounds_check(buf, HOST_RCX);
+    emit_load64(buf, HOST_RAX, PVCPU_HOST_STATE, disp_hole(HOLE_SRC));
+    emit_load64(buf, HOST_RDX, PVCPU_HOST_STATE, offsetof(PVCpu_State, memory));
+    emit_op_mr(buf, X86_MOV, x86_mem_indexed(HOST_RDX, HOST_RCX, 0, 0), HOST_RAX);
+}
+
+static void stencil_jmp(Jit_Buf* buf, uint16_t opcode, uint8_t mode) {
+    (void)opcode;
+    emit_operand(buf, mode, HOST_RAX);
+    emit_leave(buf, HOST_RAX);
+}
+
+// Taken when (flags & mask) is non zero, or zero for jnz/jne
+static void stencil_jcc(Jit_Buf* buf, uint16_t opcode, uint8_t mode) {
+    static const uint8_t masks[8] = {
+        PVCPU_FLAG_Z, PVCPU_FLAG_Z, PVCPU_FLAG_L, PVCPU_FLAG_L | PVCPU_FLAG_Z,
+        PVCPU_FLAG_G, PVCPU_FLAG_G | PVCPU_FLAG_Z, PVCPU_FLAG_Z, PVCPU_FLAG_Z
+    };
+    bool invert = opcode == OP_JNZ || opcode == OP_JNE;
+
+    emit_op_mi(buf, X86_CMP, 4, x86_mem(PVCPU_HOST_STATE, offsetof(PVCpu_State, flags_op)), 0);
+    uint8_t* ready = emit_jcc32(buf, X86_CC_E);
+    emit_call_abs(buf, (const void*)(uintptr_t)imm_hole(HOLE_STUB));
+    jit_patch_rel32(buf, ready, jit_pos(buf));
+    emit_op_mi(buf, X86_TEST, 1, x86_mem(PVCPU_HOST_STATE, offsetof(PVCpu_State, flags)), masks[opcode - OP_JZ]);
+    uint8_t* stay = emit_jcc32(buf, invert ? X86_CC_NE : X86_CC_E);
+    emit_operand(buf, mode, HOST_RAX);
+    emit_leave(buf, HOST_RAX);
+    jit_patch_rel32(buf, stay, jit_pos(buf));
+    emit_movimm64(buf, HOST_RAX, imm_hole(HOLE_NEXT));
+    emit_leave(buf, HOST_RAX);
+}
+
+static void stencil_call(Jit_Buf* buf, uint16_t opcode, uint8_t mode) {
+    (void)opcode;
+    emit_store_pc(buf);
+    emit_operand(buf, mode, arg_regs[2]);
+    emit_movimm64(buf, arg_regs[1], imm_hole(HOLE_NEXT));
+    emit_helper_exit(buf, (const void*)pvcpu_helper_call);
+}
+
+static void stencil_ret(Jit_Buf* buf, uint16_t opcode, uint8_t mode) {
+    (void)opcode; (void)mode;
+    emit_store_pc(buf);
+    emit_helper_exit(buf, (const void*)pvcpu_helper_ret);
+}
+
+static void stencil_exception(Jit_Buf* buf, uint16_t opcode, uint8_t mode) {
+    (void)opcode; (void)mode;
+    emit_raise(buf, imm_hole(HOLE_IMM));
+}
+
+static void stencil_exit(Jit_Buf* buf, uint16_t opcode, uint8_t mode) {
+    (void)opcode; (void)mode;
+    emit_movimm64(buf, HOST_RAX, imm_hole(HOLE_NEXT));
+    emit_leave(buf, HOST_RAX);
+}
+
+// Emits the template into scratch memory and records where its holes are
+static size_t build_stencil(Stencil_Emit fn, uint16_t opcode, uint8_t mode) {
+    static uint8_t scratch[STENCIL_MAX * 2];
+    // Scratch memory aliases itself, so the local jumps can be patched as usual
+    Code_Cache cc = {0};
+    cc.rw = scratch;
+    cc.rx = scratch;
+    Jit_Buf buf = {0};
+    buf.data = scratch;
+    buf.exec = scratch;
+    buf.capacity = sizeof(scratch);
+    buf.cc = &cc;
+    fn(&buf, opcode, mode);
+
+    Stencil* s = &stencils[stencil_count];
+    memcpy(s->code, scratch, buf.size);
+    s->size = (uint8_t)buf.size;
+    s->hole_count = 0;
+    for (size_t at = 0; at + 4 <= buf.size; at++) {
+        uint32_t disp;
+        uint64_t imm = 0;
+        memcpy(&disp, scratch + at, 4);
+        if (at + 8 <= buf.size) memcpy(&imm, scratch + at, 8);
+
+        size_t len;
+        uint8_t kind;
+        if ((imm & ~0xFFull) == HOLE_IMM_MAGIC) {
+            kind = (uint8_t)imm;
+            len = 8;
+        } else if ((disp & ~0xFFu) == HOLE_DISP_MAGIC) {
+            kind = (uint8_t)disp;
+            len = 4;
+        } else {
+            continue;
+        }
+        s->hole_at[s->hole_count] = (uint8_t)at;
+        s->hole_kind[s->hole_count++] = kind;
+        at += len - 1;
+    }
+    return stencil_count++;
+}
+
+static void register_stencil(uint16_t opcode, Stencil_Emit fn, uint16_t modes) {
+    for (uint8_t mode = 0; mode < 16; mode++) {
+        if (!(modes & (1 << mode))) continue;
+        stencil_of[opcode][mode] = (uint8_t)(build_stencil(fn, opcode, mode) + 1);
+    }
+}
+
+#define MODES_OPERAND ((1 << REG_REG) | (1 << REG_IMM) | (1 << REG_EXTIMM))
+#define MODES_LOAD ((1 << LOAD_REGADDR) | (1 << LOAD_IMMADDR) | (1 << LOAD_PC_REL))
+#define MODES_STORE ((1 << STORE_REGADDR) | (1 << STORE_IMMADDR) | (1 << STORE_PC_REL))
+#define MODES_IMM ((1 << REG_IMM) | (1 << REG_EXTIMM))
+
+void pvcpu_stencil_init() {
+    memset(stencil_of, 0, sizeof(stencil_of));
+    stencil_count = 0;
+    // Baseline blocks always return to the dispatcher, which meters them itself
+    ra_init_frame(&frame, false);
+
+    #ifdef __x86_64__
+        register_stencil(OP_ADD, stencil_alu, MODES_OPERAND);
+        register_stencil(OP_SUB, stencil_alu, MODES_OPERAND);
+        register_stencil(OP_MUL, stencil_mul, MODES_OPERAND);
+        register_stencil(OP_AND, stencil_alu, MODES_OPERAND);
+        register_stencil(OP_OR, stencil_alu, MODES_OPERAND);
+        register_stencil(OP_XOR, stencil_alu, MODES_OPERAND);
+        register_stencil(OP_MOV, stencil_mov, MODES_OPERAND);
+        register_stencil(OP_CMP, stencil_compare, MODES_OPERAND);
+        register_stencil(OP_UCMP, stencil_compare, MODES_OPERAND);
+        register_stencil(OP_TEST, stencil_compare, MODES_OPERAND);
+        register_stencil(OP_LOAD, stencil_load, MODES_LOAD);
+        register_stencil(OP_STORE, stencil_store, MODES_STORE);
+
+        register_stencil(OP_JMP, stencil_jmp, MODES_OPERAND);
+        for (uint16_t op = OP_JZ; op <= OP_JNE; op++) {
+            register_stencil(op, stencil_jcc, MODES_OPERAND);
+        }
+        register_stencil(OP_CALL, stencil_call, MODES_OPERAND);
+        register_stencil(OP_RET, stencil_ret, 0xFFFF);
+        register_stencil(OP_EXCEPTION, stencil_exception, MODES_IMM);
+
+        raise_stencil = stencil_of[OP_EXCEPTION][REG_EXTIMM] - 1u;
+        exit_stencil = build_stencil(stencil_exit, 0, 0);
+    #endif
+}
+
+static const Stencil* stencil_for(const PVCpu_Inst* inst) {
+    uint8_t i = stencil_of[inst->opcode][inst->mode & 0xF];
+    return i ? &stencils[i - 1] : NULL;
+}
+
+// Writes operations without an effect are dropped, except for a load which may still fault
+static bool is_nop(const PVCpu_Inst* inst) {
+    if (inst->dest != PVCPU_REG_NULL) return false;
+    switch (inst->opcode) {
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_AND:
+        case OP_OR:
+        case OP_XOR:
+        case OP_MOV: return stencil_for(inst) != NULL;
+        default: return false;
+    }
+}
+
+typedef struct {
+    uint64_t imm;
+    uint64_t pc;
+    uint64_t next;
+    uint8_t dest;
+    uint8_t src;
+} Stencil_Args;
+
+static void copy_stencil(Jit_Buf* buf, const Stencil* s, const Stencil_Args* args, const uint8_t* stub) {
+    uint8_t* code = buf->data + buf->size;
+    memcpy(code, s->code, s->size);
+    for (uint8_t h = 0; h < s->hole_count; h++) {
+        uint8_t* at = code + s->hole_at[h];
+        uint64_t imm;
+        int32_t disp;
+        switch (s->hole_kind[h]) {
+            case HOLE_DEST:
+                disp = (int32_t)(offsetof(PVCpu_State, regs) + args->dest * 8);
+                memcpy(at, &disp, 4);
+                continue;
+            case HOLE_SRC:
+                disp = (int32_t)(offsetof(PVCpu_State, regs) + args->src * 8);
+                memcpy(at, &disp, 4);
+                continue;
+            case HOLE_IMM: imm = args->imm; break;
+            case HOLE_PC: imm = args->pc; break;
+            case HOLE_NEXT: imm = args->next; break;
+            default: imm = (uint64_t)(uintptr_t)stub; break;
+        }
+        memcpy(at, &imm, 8);
+    }
+    buf->size += s->size;
+}
+
+bool pvcpu_stencil_compile(PVCpu_Runtime* rt, PVCpu_Block* block, const PVCpu_Decoded_Block* db) {
+    if (stencil_count == 0 || (db->count == 0 && !db->fault)) return false;
+
+    size_t code_max = PVCPU_RA_PROLOGUE_MAX + STENCIL_MAX;
+    for (size_t i = 0; i < db->count; i++) {
+        const PVCpu_Inst* inst = &db->insts[i];
+        if (is_nop(inst)) continue;
+        const Stencil* s = stencil_for(inst);
+        if (s == NULL || (inst->opcode == OP_LOAD && inst->dest == PVCPU_REG_NULL)) return false;
+        code_max += s->size;
+    }
+
+    const uint8_t* stub = pvcpu_flags_stub(rt);
+    if (stub == NULL || !jit_reserve(&rt->buf, code_max)) return false;
+
+    uint8_t* entry = jit_pos(&rt->buf);
+    ra_emit_prologue(&rt->buf, &frame);
+    for (size_t i = 0; i < db->count; i++) {
+        const PVCpu_Inst* inst = &db->insts[i];
+        if (is_nop(inst)) continue;
+        Stencil_Args args = {
+            inst->mode == REG_IMM ? inst->src : db->values[i],
+            db->pcs[i], db->pcs[i] + db->sizes[i], inst->dest, inst->src
+        };
+        copy_stencil(&rt->buf, stencil_for(inst), &args, stub);
+    }
+
+    // Blocks ending in a branch have left already
+    if (db->fault) {
+        Stencil_Args args = {db->fault, db->end, db->end, 0, 0};
+        copy_stencil(&rt->buf, &stencils[raise_stencil], &args, stub);
+    } else if (db->count == 0 || !pvcpu_is_block_end(db->insts[db->count - 1].opcode)) {
+        Stencil_Args args = {0, db->end, db->end, 0, 0};
+        copy_stencil(&rt->buf, &stencils[exit_stencil], &args, stub);
+    }
+
+    block->code = entry;
+    block->body = NULL;
+    block->code_size = (size_t)(jit_pos(&rt->buf) - entry);
+    block->tier = PVCPU_TIER_BASELINE;
+    return true;
+}
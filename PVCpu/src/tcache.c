@@ -0,0 +1,116 @@
+// Author: Pheonix Studios/AkshuDev
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <pvcpu-tcache.h>
+
+bool tc_init(Trans_Cache* tc, size_t cap) {
+    size_t c = 16;
+    while (c < cap) c <<= 1;
+    tc->slots = calloc(c, sizeof(PVCpu_Block*));
+    tc->cap = c;
+    tc->count = 0;
+    return tc->slots != NULL;
+}
+
+void tc_destroy(Trans_Cache* tc) {
+    for (size_t i = 0; i < tc->cap; i++) {
+        if (tc->slots[i]) tc_free(tc->slots[i]);
+    }
+    free(tc->slots);
+    memset(tc, 0, sizeof(Trans_Cache));
+}
+
+void tc_free(PVCpu_Block* block) {
+    free(block->insts);
+    free(block->relocs);
+    free(block->snapshot);
+    free(block);
+}
+
+static void place(PVCpu_Block** slots, size_t cap, PVCpu_Block* block) {
+    size_t mask = cap - 1;
+    size_t i = tc_hash(block->pc) & mask;
+    while (slots[i] != NULL && slots[i]->pc != block->pc) i = (i + 1) & mask;
+    slots[i] = block;
+}
+
+bool tc_insert(Trans_Cache* tc, PVCpu_Block* block) {
+    // Keep the load factor under 1/2 so probes stay short
+    if ((tc->count + 1) * 2 > tc->cap) {
+        size_t ncap = tc->cap * 2;
+        PVCpu_Block** slots = calloc(ncap, sizeof(PVCpu_Block*));
+        if (slots == NULL) return false;
+        for (size_t i = 0; i < tc->cap; i++) {
+            if (tc->slots[i]) place(slots, ncap, tc->slots[i]);
+        }
+        free(tc->slots);
+        tc->slots = slots;
+        tc->cap = ncap;
+    }
+    place(tc->slots, tc->cap, block);
+    tc->count++;
+    return true;
+}
+
+// The rel32 is 4 byte aligned, so other threads see either the old or the new jump
+static void patch_site(Code_Cache* cc, uint8_t* site, const uint8_t* target) {
+    int32_t rel = (int32_t)(target - (site + 4));
+    __atomic_store_n((int32_t*)cc_rw(cc, site), rel, __ATOMIC_RELEASE);
+}
+
+void tc_link(Code_Cache* cc, PVCpu_Block_Exit* exit, PVCpu_Block* target) {
+    if (exit->linked == target) return;
+    if (exit->linked) tc_unlink(cc, exit);
+
+    patch_site(cc, exit->site, target->body);
+    exit->linked = target;
+    exit->next_in = target->incoming;
+    target->incoming = exit;
+}
+
+void tc_unlink(Code_Cache* cc, PVCpu_Block_Exit* exit) {
+    PVCpu_Block* target = exit->linked;
+    if (target == NULL) return;
+
+    patch_site(cc, exit->site, exit->stub);
+    for (PVCpu_Block_Exit** it = &target->incoming; *it; it = &(*it)->next_in) {
+        if (*it == exit) {
+            *it = exit->next_in;
+            break;
+        }
+    }
+    exit->linked = NULL;
+    exit->next_in = NULL;
+}
+
+bool tc_remove(Trans_Cache* tc, Code_Cache* cc, PVCpu_Block* block) {
+    if (!cc_begin_write(cc)) return false;
+    while (block->incoming) tc_unlink(cc, block->incoming);
+    for (uint32_t i = 0; i < block->exit_count; i++) {
+        tc_unlink(cc, &block->exits[i]);
+    }
+
+    // Backward shift deletion keeps probe chains intact without tombstones
+    size_t mask = tc->cap - 1;
+    size_t i = tc_hash(block->pc) & mask;
+    while (tc->slots[i] != block) {
+        if (tc->slots[i] == NULL) return true;
+        i = (i + 1) & mask;
+    }
+    tc->slots[i] = NULL;
+    tc->count--;
+    for (size_t j = (i + 1) & mask; tc->slots[j] != NULL; j = (j + 1) & mask) {
+        PVCpu_Block* b = tc->slots[j];
+        size_t home = tc_hash(b->pc) & mask;
+        // Move b back if its home slot is not cyclically within (i, j]
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            tc->slots[i] = b;
+            tc->slots[j] = NULL;
+            i = j;
+        }
+    }
+    return true;
+}
@@ -11,13 +11,19 @@ bool pvcpu_validate_inst(const PVCpu_Inst* inst, uint64_t value, size_t allocate
     if (!(inst->flags & PVCPU_FLAGS_BP_VALID)) return false; // Invalid Instruction
     if (inst->opcode > 0xFFF) return false; // Out of opcode range
     // Supported Category check
-    if (inst->opcode > 0xFF) return false; 
+    if (inst->opcode > 0xFF && inst->opcode != OP_LOAD && inst->opcode != OP_STORE && inst->opcode != OP_MOV && !(inst->opcode >= OP_JMP && inst->opcode <= OP_JNE)) return false; 
     if (inst->src > 33 || inst->dest > 33) return false; // No Access to internal registers
     
     if (inst->flags & PVCPU_FLAGS_BP_EXT) return false; // No Extended flags support yet
+
+    // Control flow takes its target from a register or an immediate
+    if (inst->opcode >= OP_JMP && inst->opcode <= OP_JNE && inst->opcode != OP_RET && inst->opcode != OP_EXCEPTION) {
+        if (inst->mode != REG_REG && inst->mode != REG_IMM && inst->mode != REG_EXTIMM) return false;
+    }
+    if ((inst->mode == REG_EXTIMM || inst->mode == LOAD_IMMADDR || inst->mode == STORE_IMMADDR) && !(inst->flags & PVCPU_FLAGS_BP_IMM)) return false; // Immediate missing
     
     // Memory
-    if (inst->opcode > 0xFF && inst->opcode < 0x1FF) {
+    if (inst->opcode > 0xFF && inst->opcode < 0x1FF && (inst->mode == LOAD_IMMADDR || inst->mode == STORE_IMMADDR)) {
         // Out of Memory operations
         if (inst->flags & PVCPU_FLAGS_BP_IMM) {
             if (value > allocated_size) return false;